@@ -0,0 +1,114 @@
+#!/usr/bin/python
+
+# Per-call overhead of the Python callbacks.
+#
+# Solves hs071 (the model in example.py) a number of times and reports how
+# much of the solve is spent in the C <-> Python glue of callback.c, i.e. the
+# wall time of the solve minus the time spent inside the Python callbacks
+# themselves, divided by the number of callback invocations.  Ipopt's own
+# work is included in that figure, so compare numbers from two builds of
+# pyipopt on the same machine rather than reading them as absolute costs.
+#
+#   python bench_callback.py [solves]
+
+import sys, time
+import pyipopt
+from numpy import *
+
+nvar = 4
+x_L = ones((nvar), dtype=float_) * 1.0
+x_U = ones((nvar), dtype=float_) * 5.0
+ncon = 2
+g_L = array([25.0, 40.0])
+g_U = array([2.0*pow(10.0, 19), 40.0])
+nnzj = 8
+nnzh = 10
+
+hrow = array([0, 1, 1, 2, 2, 2, 3, 3, 3, 3])
+hcol = array([0, 0, 1, 0, 1, 2, 0, 1, 2, 3])
+jrow = array([0, 0, 0, 0, 1, 1, 1, 1])
+jcol = array([0, 1, 2, 3, 0, 1, 2, 3])
+
+def eval_f(x, user_data = None):
+	return x[0] * x[3] * (x[0] + x[1] + x[2]) + x[2]
+
+def eval_grad_f(x, user_data = None):
+	return array([
+		x[0] * x[3] + x[3] * (x[0] + x[1] + x[2]),
+		x[0] * x[3],
+		x[0] * x[3] + 1.0,
+		x[0] * (x[0] + x[1] + x[2])
+		], float_)
+
+def eval_g(x, user_data = None):
+	return array([
+		x[0] * x[1] * x[2] * x[3],
+		x[0]*x[0] + x[1]*x[1] + x[2]*x[2] + x[3]*x[3]
+		], float_)
+
+def eval_jac_g(x, flag, user_data = None):
+	if flag:
+		return (jrow, jcol)
+	return array([x[1]*x[2]*x[3], x[0]*x[2]*x[3],
+		      x[0]*x[1]*x[3], x[0]*x[1]*x[2],
+		      2.0*x[0], 2.0*x[1], 2.0*x[2], 2.0*x[3]])
+
+def eval_h(x, lagrange, obj_factor, flag, user_data = None):
+	if flag:
+		return (hcol, hrow)
+	values = zeros((10), float_)
+	values[0] = obj_factor * (2*x[3]) + lagrange[1] * 2
+	values[1] = obj_factor * (x[3]) + lagrange[0] * (x[2] * x[3])
+	values[2] = lagrange[1] * 2
+	values[3] = obj_factor * (x[3]) + lagrange[0] * (x[1] * x[3])
+	values[4] = lagrange[0] * (x[0] * x[3])
+	values[5] = lagrange[1] * 2
+	values[6] = obj_factor * (2*x[0] + x[1] + x[2]) + lagrange[0] * (x[1] * x[2])
+	values[7] = obj_factor * (x[0]) + lagrange[0] * (x[0] * x[2])
+	values[8] = obj_factor * (x[0]) + lagrange[0] * (x[0] * x[1])
+	values[9] = lagrange[1] * 2
+	return values
+
+calls = {}
+spent = [0.0]
+
+def timed(name, fn):
+	calls[name] = 0
+	def wrapper(*args):
+		calls[name] += 1
+		t = time.time()
+		try:
+			return fn(*args)
+		finally:
+			spent[0] += time.time() - t
+	return wrapper
+
+def main():
+	solves = 200
+	if len(sys.argv) > 1:
+		solves = int(sys.argv[1])
+
+	nlp = pyipopt.create(nvar, x_L, x_U, ncon, g_L, g_U, nnzj, nnzh,
+		timed("eval_f", eval_f), timed("eval_grad_f", eval_grad_f),
+		timed("eval_g", eval_g), timed("eval_jac_g", eval_jac_g),
+		timed("eval_h", eval_h))
+	nlp.int_option("print_level", 0)
+
+	x0 = array([1.0, 5.0, 5.0, 1.0])
+	start = time.time()
+	for i in xrange(solves):
+		nlp.solve(x0)
+	wall = time.time() - start
+	nlp.close()
+
+	total = sum(calls.values())
+	print "solves            %d" % solves
+	print "callback calls    %d" % total
+	for name in sorted(calls):
+		print "  %-15s %d" % (name, calls[name])
+	print "wall time         %.3f s" % wall
+	print "python time       %.3f s" % spent[0]
+	print "non-python time per call %.2f us" % ((wall - spent[0]) / total * 1e6)
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,70 @@
+#!/usr/bin/python
+
+# Leak check for the problem lifecycle.
+#
+# Runs create/solve/close cycles on hs071 (the model in example.py, taken
+# from bench_callback.py) and samples the resident set size along the way.
+# After a warm-up the RSS has to stay flat: the script exits with status 1
+# if it grows by more than the tolerance, or if pyipopt.live_problems()
+# still reports problems once the cycles are over.
+#
+#   python bench_lifecycle.py [cycles [tolerance_kb]]
+
+import sys, os, gc
+import pyipopt
+from numpy import *
+from bench_callback import nvar, x_L, x_U, ncon, g_L, g_U, nnzj, nnzh, \
+	eval_f, eval_grad_f, eval_g, eval_jac_g, eval_h
+
+def rss_kb():
+	f = open("/proc/self/statm")
+	pages = int(f.read().split()[1])
+	f.close()
+	return pages * os.sysconf("SC_PAGE_SIZE") / 1024
+
+def cycle(x0, userdata):
+	with pyipopt.create(nvar, x_L, x_U, ncon, g_L, g_U, nnzj, nnzh,
+			    eval_f, eval_grad_f, eval_g, eval_jac_g,
+			    eval_h) as nlp:
+		nlp.int_option("print_level", 0)
+		nlp.solve(x0, userdata)
+
+def main():
+	cycles = 1000000
+	tolerance = 4096
+	if len(sys.argv) > 1:
+		cycles = int(sys.argv[1])
+	if len(sys.argv) > 2:
+		tolerance = int(sys.argv[2])
+
+	x0 = array([1.0, 5.0, 5.0, 1.0])
+	userdata = {"cycle": 0}
+	warmup = min(1000, cycles // 10)
+	every = max(cycles // 20, 1)
+	for i in xrange(warmup):
+		cycle(x0, userdata)
+	base = rss_kb()
+	print "cycles       %d" % cycles
+	print "rss after %d warm-up cycles  %d kB" % (warmup, base)
+
+	peak = base
+	for i in xrange(warmup, cycles):
+		cycle(x0, userdata)
+		if (i + 1) % every == 0:
+			rss = rss_kb()
+			peak = max(peak, rss)
+			print "  %9d cycles  rss %d kB  (%+d)" % (i + 1, rss, rss - base)
+
+	gc.collect()
+	live = pyipopt.live_problems()
+	growth = peak - base
+	print "rss growth   %d kB (tolerance %d kB)" % (growth, tolerance)
+	print "live problems %d holding %d bytes" % (live["problems"], live["bytes"])
+	print "userdata refcount %d" % sys.getrefcount(userdata)
+	if growth > tolerance or live["problems"] != 0:
+		print "LEAK"
+		sys.exit(1)
+	print "ok"
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,47 @@
+#!/usr/bin/python
+
+# Throughput of pyipopt.nl_eval_batch.
+#
+# Evaluates f and g of a .nl model at random points in [0.5, 2]^n, once as
+# a single batch and once point by point from a Python loop, and reports
+# points per second for both.
+#
+#   python bench_nl_batch.py [model.nl] [points]
+
+import sys, time
+import pyipopt
+from numpy import *
+
+def main():
+	path = "trimloss.nl"
+	points = 10000
+	if len(sys.argv) > 1:
+		path = sys.argv[1]
+	if len(sys.argv) > 2:
+		points = int(sys.argv[2])
+
+	# number of variables, from the second header line
+	n = int(open(path).readlines()[1].split()[0])
+	nlp = pyipopt.create_from_nl(path)
+	X = random.uniform(0.5, 2.0, (points, n))
+
+	start = time.time()
+	F, G = pyipopt.nl_eval_batch(nlp, X)
+	batch = time.time() - start
+
+	start = time.time()
+	for i in xrange(points):
+		f, g = pyipopt.nl_eval_batch(nlp, X[i:i+1])
+		if f[0] != F[i] and not (isnan(f[0]) and isnan(F[i])):
+			print "mismatch at point %d" % i
+	single = time.time() - start
+	nlp.close()
+
+	print "model             %s" % path
+	print "points            %d" % points
+	print "batched           %.0f points/s" % (points / batch)
+	print "one at a time     %.0f points/s" % (points / single)
+	print "speedup           %.1fx" % (single / batch)
+
+if __name__ == "__main__":
+	main()
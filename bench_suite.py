@@ -0,0 +1,385 @@
+#!/usr/bin/python
+
+# Fixed and per-element cost of every callback path, as JSON.
+#
+# Solves trivial models with whichever pyipopt is on the path, the numpy
+# build (callback.c) or the list build (pyipopt-list.c): hs071 from
+# example.py and a synthetic separable problem
+#
+#	min sum (x_i - 1)^2  s.t.  x_i + x_i+1 >= 1,  -10 <= x <= 10
+#
+# with n = 10, 100, ... up to --max-n variables, n - 1 constraints, 2(n - 1)
+# Jacobian and n Hessian nonzeros.  It starts at the optimum so Ipopt does
+# next to nothing and the callbacks are as cheap as Python allows.
+#
+# The Python side of each callback is timed on its own by calling it
+# directly.  With the numpy build, stats() gives the time of each wrapper in
+# callback.c and what is left after taking the Python away is the glue:
+# building the views, calling in and copying the result into Ipopt's buffer.
+# It is reported per path (eval_f ... eval_h, or eval_all) for the plain,
+# inplace=True and eval_all modes, and a line fitted through the synthetic
+# sizes splits it into a fixed cost per call and a cost per element, the
+# element being a variable for eval_f and eval_grad_f, a constraint for
+# eval_g and a nonzero for eval_jac_g and eval_h.
+#
+# The list build keeps no counters, so for both builds there is also
+# overhead_us_per_call, the wall time of the solves minus the Python time
+# over the number of callback calls as in bench_callback.py.  It includes
+# Ipopt's own work and is only meant for comparing the two builds.  The list
+# build prints its solution on every solve (stdout is sent to /dev/null
+# while solving), rebuilds the problem for each solve and has no Hessian,
+# so it runs with limited-memory and its sizes stop at 10^5 by default.
+#
+#   python bench_suite.py [--max-n N] [--solves K] [--out FILE]
+#   PYIPOPT_BUILD=list python bench_suite.py ...	(after make pyipopt-list)
+
+import sys, os, time, json, platform
+from optparse import OptionParser
+
+# This directory, with the numpy build in it, comes before PYTHONPATH;
+# PYIPOPT_BUILD=dir picks the pyipopt.so in dir instead
+if os.environ.get("PYIPOPT_BUILD"):
+	sys.path.insert(0, os.environ["PYIPOPT_BUILD"])
+import pyipopt
+from numpy import array, ones, zeros, arange, repeat, dot, float_
+
+LIST_BUILD = not hasattr(pyipopt, "stats")
+
+PATHS = ["eval_f", "eval_grad_f", "eval_g", "eval_jac_g", "eval_h"]
+
+def hs071():
+	import bench_callback as b
+	return {"name": "hs071", "n": b.nvar, "m": b.ncon,
+		"nnzj": b.nnzj, "nnzh": b.nnzh,
+		"xl": b.x_L, "xu": b.x_U, "gl": b.g_L, "gu": b.g_U,
+		"x0": array([1.0, 5.0, 5.0, 1.0]),
+		"eval_f": b.eval_f, "eval_grad_f": b.eval_grad_f,
+		"eval_g": b.eval_g, "eval_jac_g": b.eval_jac_g,
+		"eval_h": b.eval_h}
+
+def synthetic(n):
+	m = n - 1
+	jrow = repeat(arange(m), 2)
+	jcol = (arange(2 * m) + 1) // 2
+	jval = ones((2 * m), float_)
+	diag = arange(n)
+	hval = ones((n), float_)
+
+	def eval_f(x, user_data = None):
+		d = x - 1.0
+		return float(dot(d, d))
+
+	def eval_grad_f(x, user_data = None):
+		return 2.0 * (x - 1.0)
+
+	def eval_g(x, user_data = None):
+		return x[:-1] + x[1:]
+
+	def eval_jac_g(x, flag, user_data = None):
+		if flag:
+			return (jrow, jcol)
+		return jval
+
+	def eval_h(x, lagrange, obj_factor, flag, user_data = None):
+		if flag:
+			return (diag, diag)
+		return hval * (2.0 * obj_factor)
+
+	return {"name": "synthetic", "n": n, "m": m,
+		"nnzj": 2 * m, "nnzh": n,
+		"xl": ones((n), float_) * -10.0, "xu": ones((n), float_) * 10.0,
+		"gl": ones((m), float_), "gu": ones((m), float_) * 2.0e19,
+		"x0": ones((n), float_),
+		"eval_f": eval_f, "eval_grad_f": eval_grad_f,
+		"eval_g": eval_g, "eval_jac_g": eval_jac_g,
+		"eval_h": eval_h}
+
+def path_size(model, path):
+	return {"eval_f": model["n"], "eval_grad_f": model["n"],
+		"eval_g": model["m"], "eval_jac_g": model["nnzj"],
+		"eval_h": model["nnzh"], "eval_all": model["n"]}[path]
+
+# The callbacks each mode hands to create(), all built from the plain ones
+
+def inplace_callbacks(model):
+	f, grad_f, g, jac_g, h = [model[p] for p in PATHS]
+	def eval_grad_f(x, out, user_data = None):
+		out[:] = grad_f(x)
+	def eval_g(x, out, user_data = None):
+		out[:] = g(x)
+	def eval_jac_g(x, flag, out = None, user_data = None):
+		if flag:
+			return jac_g(x, True)
+		out[:] = jac_g(x, False)
+	def eval_h(x, lagrange, obj_factor, flag, out = None, user_data = None):
+		if flag:
+			return h(x, lagrange, obj_factor, True)
+		out[:] = h(x, lagrange, obj_factor, False)
+	return {"eval_f": f, "eval_grad_f": eval_grad_f, "eval_g": eval_g,
+		"eval_jac_g": eval_jac_g, "eval_h": eval_h}
+
+def eval_all_callbacks(model):
+	f, grad_f, g, jac_g = [model[p] for p in PATHS[:4]]
+	def eval_all(x, need, user_data = None):
+		result = {}
+		if need & pyipopt.NEED_F:
+			result["f"] = f(x)
+		if need & pyipopt.NEED_GRAD_F:
+			result["grad_f"] = grad_f(x)
+		if need & pyipopt.NEED_G:
+			result["g"] = g(x)
+		if need & pyipopt.NEED_JAC_G:
+			result["jac_g"] = jac_g(x, False)
+		return result
+	return {"eval_f": None, "eval_grad_f": None, "eval_g": None,
+		"eval_jac_g": jac_g, "eval_h": model["eval_h"],
+		"eval_all": eval_all}
+
+def list_callbacks(model):
+	f, grad_f, g, jac_g = [model[p] for p in PATHS[:4]]
+	structure = [a.tolist() for a in jac_g(model["x0"], True)]
+	def eval_f(x, user_data = None):
+		return float(f(array(x)))
+	def eval_grad_f(x, user_data = None):
+		return grad_f(array(x)).tolist()
+	def eval_g(x, user_data = None):
+		return g(array(x)).tolist()
+	def eval_jac_g(x, flag, user_data = None):
+		if flag:
+			return tuple(structure)
+		return jac_g(array(x), False).tolist()
+	return {"eval_f": eval_f, "eval_grad_f": eval_grad_f,
+		"eval_g": eval_g, "eval_jac_g": eval_jac_g}
+
+# Which stats() entries and which Python callbacks make up each reported
+# path: with eval_all the four cached paths only make sense together
+def path_groups(mode):
+	if mode == "eval_all":
+		return {"eval_all": (PATHS[:4], ["eval_all", "eval_jac_g"]),
+			"eval_h": (["eval_h"], ["eval_h"])}
+	if mode == "list":
+		return dict([(p, ([], [p])) for p in PATHS[:4]])
+	return dict([(p, ([p], [p])) for p in PATHS])
+
+calls = {}
+
+def counted(name, fn):
+	calls[name] = 0
+	def wrapper(*args):
+		calls[name] += 1
+		return fn(*args)
+	return wrapper
+
+# Python time of one call, measured directly with the arguments the glue
+# would pass; eval_all is timed asking for everything
+def python_us(name, fn, model, mode):
+	x = model["x0"]
+	n, m = model["n"], model["m"]
+	lagrange = ones((m), float_)
+	if mode == "list":
+		x = x.tolist()
+	if name == "eval_all":
+		args = (x, pyipopt.NEED_F | pyipopt.NEED_GRAD_F |
+			pyipopt.NEED_G | pyipopt.NEED_JAC_G)
+	else:
+		args = {"eval_f": (x,), "eval_grad_f": (x,), "eval_g": (x,),
+			"eval_jac_g": (x, False),
+			"eval_h": (x, lagrange, 1.0, False)}[name]
+	if mode == "inplace":
+		out = {"eval_grad_f": n, "eval_g": m,
+		       "eval_jac_g": model["nnzj"], "eval_h": model["nnzh"]}
+		if name in out:
+			args = args + (zeros((out[name]), float_),)
+	k = 0
+	start = time.time()
+	while k < 3 or time.time() - start < 0.05:
+		fn(*args)
+		k += 1
+	return (time.time() - start) / k * 1e6
+
+def mute():
+	sys.stdout.flush()
+	saved = os.dup(1)
+	null = os.open(os.devnull, os.O_WRONLY)
+	os.dup2(null, 1)
+	os.close(null)
+	return saved
+
+# printf in the list build goes through C's own buffer, flush that too
+def unmute(saved):
+	sys.stdout.flush()
+	try:
+		import ctypes
+		ctypes.CDLL(None).fflush(None)
+	except (ImportError, OSError, AttributeError):
+		pass
+	os.dup2(saved, 1)
+	os.close(saved)
+
+def run_numpy(model, mode, solves):
+	if mode == "inplace":
+		given = inplace_callbacks(model)
+	elif mode == "eval_all":
+		given = eval_all_callbacks(model)
+	else:
+		given = dict([(p, model[p]) for p in PATHS])
+	wrapped = dict([(k, fn and counted(k, fn))
+			for k, fn in given.items()])
+
+	nlp = pyipopt.create(model["n"], model["xl"], model["xu"],
+		model["m"], model["gl"], model["gu"],
+		model["nnzj"], model["nnzh"],
+		wrapped["eval_f"], wrapped["eval_grad_f"],
+		wrapped["eval_g"], wrapped["eval_jac_g"], wrapped["eval_h"],
+		inplace = (mode == "inplace"),
+		eval_all = wrapped.get("eval_all"))
+	nlp.int_option("print_level", 0)
+	saved = mute()
+	try:
+		nlp.solve(model["x0"])
+		nlp.stats(True)
+		for k in calls:
+			calls[k] = 0
+		start = time.time()
+		for i in xrange(solves):
+			nlp.solve(model["x0"])
+		wall = time.time() - start
+	finally:
+		unmute(saved)
+	stats = nlp.stats()
+	nlp.close()
+	return wall, dict(calls), wrapped, stats
+
+def run_list(model, solves):
+	wrapped = dict([(k, counted(k, fn))
+			for k, fn in list_callbacks(model).items()])
+	bounds = [model[k].tolist() for k in ("xl", "xu", "gl", "gu")]
+	x0 = model["x0"].tolist()
+	wall = 0.0
+	saved = mute()
+	try:
+		for i in xrange(solves):
+			pyipopt.create(model["n"], bounds[0], bounds[1],
+				model["m"], bounds[2], bounds[3],
+				model["nnzj"], 0,
+				wrapped["eval_f"], wrapped["eval_grad_f"],
+				wrapped["eval_g"], wrapped["eval_jac_g"])
+			start = time.time()
+			pyipopt.solve(x0)
+			wall += time.time() - start
+	finally:
+		unmute(saved)
+	return wall, dict(calls), wrapped, None
+
+def run(model, mode, solves):
+	calls.clear()
+	if mode == "list":
+		wall, counts, wrapped, stats = run_list(model, solves)
+	else:
+		wall, counts, wrapped, stats = run_numpy(model, mode, solves)
+	py = dict([(k, python_us(k, fn, model, mode))
+		   for k, fn in wrapped.items() if fn])
+	python_time = sum([counts[k] * py[k] for k in counts]) / 1e6
+	total = sum(counts.values())
+
+	paths = {}
+	for name, (keys, pynames) in path_groups(mode).items():
+		entry = {"size": path_size(model, name),
+			 "python_calls": sum([counts.get(k, 0) for k in pynames]),
+			 "python_us_per_call": py.get(name)}
+		if stats is not None:
+			ncalls = sum([stats[k]["calls"] for k in keys])
+			spent = sum([stats[k]["time"] for k in keys]) * 1e6 - \
+				sum([counts.get(k, 0) * py.get(k, 0.0)
+				     for k in pynames])
+			entry["calls"] = ncalls
+			entry["bytes"] = sum([stats[k]["bytes"] for k in keys])
+			entry["glue_us_per_call"] = None
+			if ncalls:
+				entry["glue_us_per_call"] = spent / ncalls
+		paths[name] = entry
+
+	overhead = None
+	if total:
+		overhead = (wall - python_time) / total * 1e6
+	return {"model": model["name"], "mode": mode,
+		"n": model["n"], "m": model["m"],
+		"nnzj": model["nnzj"], "nnzh": model["nnzh"],
+		"solves": solves, "wall": wall, "python_time": python_time,
+		"calls": total,
+		"overhead_us_per_call": overhead,
+		"paths": paths}
+
+# Least squares line through (size, us per call): fixed_us + size * per_element
+def fit(points):
+	points = [p for p in points if p[1] is not None]
+	if len(set([p[0] for p in points])) < 2:
+		return None
+	k = float(len(points))
+	sx = sum([p[0] for p in points])
+	sy = sum([p[1] for p in points])
+	sxx = sum([p[0] * p[0] for p in points])
+	sxy = sum([p[0] * p[1] for p in points])
+	slope = (k * sxy - sx * sy) / (k * sxx - sx * sx)
+	return {"fixed_us": (sy - slope * sx) / k,
+		"per_element_ns": slope * 1e3,
+		"points": len(points)}
+
+def fits(runs, modes):
+	result = {}
+	for mode in modes:
+		mine = [r for r in runs
+			if r["mode"] == mode and r["model"] == "synthetic"]
+		entry = {"all": fit([(r["n"], r["overhead_us_per_call"])
+				     for r in mine])}
+		if mine:
+			for name in mine[0]["paths"]:
+				entry[name] = fit([(r["paths"][name]["size"],
+					r["paths"][name].get("glue_us_per_call"))
+					for r in mine])
+		result[mode] = entry
+	return result
+
+def main():
+	parser = OptionParser(usage = "%prog [--max-n N] [--solves K] "
+			      "[--out FILE]")
+	parser.add_option("--max-n", type = "int",
+			  default = LIST_BUILD and 10**5 or 10**7,
+			  help = "largest synthetic size, a power of ten")
+	parser.add_option("--solves", type = "int", default = 0,
+			  help = "solves per run, default scales with n")
+	parser.add_option("--out", help = "write the JSON here")
+	opts, args = parser.parse_args()
+
+	modes = LIST_BUILD and ["list"] or ["return", "inplace", "eval_all"]
+	sizes = [0]
+	n = 10
+	while n <= opts.max_n:
+		sizes.append(n)
+		n *= 10
+
+	runs = []
+	for size in sizes:
+		# one size at a time, the largest take a few hundred MB each
+		model = size and synthetic(size) or hs071()
+		solves = opts.solves or max(1, min(200, 10**6 // model["n"]))
+		for mode in modes:
+			runs.append(run(model, mode, solves))
+			sys.stderr.write("%-9s n=%-8d %-8s %8.2f us/call\n" %
+				(model["name"], model["n"], mode,
+				 runs[-1]["overhead_us_per_call"] or 0.0))
+
+	report = {"build": LIST_BUILD and "list" or "numpy",
+		  "python": platform.python_version(),
+		  "platform": platform.platform(),
+		  "runs": runs, "fits": fits(runs, modes)}
+	text = json.dumps(report, indent = 1, sort_keys = True)
+	if opts.out:
+		f = open(opts.out, "w")
+		f.write(text + "\n")
+		f.close()
+	else:
+		print text
+
+if __name__ == "__main__":
+	main()
@@ -28,8 +28,19 @@
 /* For the interface of these five functions, check 
 	Ipopt's document: Ipopt C Interface */
 	// TODO: change the apply_new interface
-	
+
+/* Ipopt runs with the GIL released (see solve() in pyipopt.c), so every
+   callback takes the GIL back with PyGILState_Ensure before it touches a
+   Python object and hands it back on the way out. A Python exception raised
+   in a callback is parked in the problem's own DispatchData until solve()
+   returns. A problem with native (C) callbacks never takes the GIL at all. */
+
+#define NO_IMPORT_ARRAY
 #include "hook.h"
+#include "nlmodel.h"
+#include "pool.h"
+#include "iterlog.h"
+#include <time.h>
 
 #if 0
 void logger(const char* fmt,...)
@@ -47,7 +58,6 @@ void logger(const char* fmt,...) {}
 
 
 #define Is_double_Array(obj) ((PyArray_TYPE(obj)) == NPY_DOUBLE)
-#define Is_long_Array(obj)   ((PyArray_TYPE(obj)) == NPY_LONG)
 
 #define ERROR								\
 	do								\
@@ -56,34 +66,384 @@ void logger(const char* fmt,...) {}
 		goto error;						\
 	} while(0)
 
-Bool apply_new_python(DispatchData *myowndata, PyObject *arrayx)
+
+/* Argument marshalling
+
+   Every callback used to wrap x (and lambda) in a new ndarray and build a
+   new argument tuple on each call. Each problem now keeps one long-lived
+   view per Ipopt buffer and one prebuilt tuple per calling convention in its
+   DispatchData. A view is created the first time it is needed and only has
+   its data pointer moved when Ipopt hands over a different buffer, so the
+   arrays passed to Python are only valid for the duration of the call. The
+   tuples are dropped by reset_dispatch_args() whenever the userdata they
+   carry changes. */
+
+static Number no_data[1];
+
+static PyObject *bind_view(PyArrayObject **view, Index len, Number *buf)
+{
+	/* a NULL buffer would make numpy allocate (and later free) its own */
+	if (buf == NULL) buf = no_data;
+	if (*view == NULL)
+	{
+		npy_intp dims[1];
+		dims[0] = len;
+		*view = (PyArrayObject*) PyArray_SimpleNewFromData(1, dims,
+					PyArray_DOUBLE, (char*) buf);
+		if (*view == NULL) return NULL;
+	}
+	else if ((*view)->data != (char*) buf)
+		(*view)->data = (char*) buf;
+	return (PyObject*) *view;
+}
+
+/* New tuple holding items followed by the userdata, if there is one.
+   params is not in it: every Python call gets it as the params keyword,
+   through myowndata->params_kw, so it has the same place whatever the
+   userdata */
+static PyObject *build_args(DispatchData *data, int nitems, PyObject **items, 
+			    int with_userdata)
+{
+	int k;
+	PyObject *user = with_userdata ? data->userdata : NULL;
+	PyObject *args = PyTuple_New(nitems + (user != NULL));
+	if (!args) return NULL;
+	for (k = 0; k < nitems; k++)
+	{
+		Py_INCREF(items[k]);
+		PyTuple_SET_ITEM(args, k, items[k]);
+	}
+	if (user != NULL)
+	{
+		Py_INCREF(user);
+		PyTuple_SET_ITEM(args, nitems, user);
+	}
+	return args;
+}
+
+/* (x[, userdata]), shared by eval_f, eval_grad_f and eval_g */
+static PyObject *args_x(DispatchData *data, Index n, Number *x)
+{
+	PyObject *items[1];
+	if (!(items[0] = bind_view(&data->arrayx, n, x))) return NULL;
+	if (data->args_x == NULL)
+		data->args_x = build_args(data, 1, items, TRUE);
+	return data->args_x;
+}
+
+/* (x, out[, userdata]) for eval_grad_f and eval_g when the problem was
+   created with inplace=True; out is a view over Ipopt's result buffer */
+static PyObject *args_x_out(DispatchData *data, PyObject **slot,
+			    PyArrayObject **outview, Index n, Number *x,
+			    Index len, Number *out)
+{
+	PyObject *items[2];
+	if (!(items[0] = bind_view(&data->arrayx, n, x))) return NULL;
+	if (!(items[1] = bind_view(outview, len, out))) return NULL;
+	if (*slot == NULL)
+		*slot = build_args(data, 2, items, TRUE);
+	return *slot;
+}
+
+/* (x, False[, out][, userdata]) for the values call of eval_jac_g */
+static PyObject *args_jac(DispatchData *data, Index n, Number *x,
+			  Index nele_jac, Number *values)
+{
+	PyObject *items[3];
+	if (!(items[0] = bind_view(&data->arrayx, n, x))) return NULL;
+	items[1] = Py_False;
+	if (data->inplace)
+		if (!(items[2] = bind_view(&data->arrayjac, nele_jac, values)))
+			return NULL;
+	if (data->args_jac == NULL)
+		data->args_jac = build_args(data, 2 + data->inplace, items, TRUE);
+	return data->args_jac;
+}
+
+/* (x, lambda, obj_factor, False[, out][, userdata]) for the values call of
+   eval_h. obj_factor changes from call to call; it is swapped in place
+   unless the callee held on to the tuple, in which case a fresh one is
+   built. */
+static PyObject *args_h(DispatchData *data, Index n, Number *x,
+			Index m, Number *lambda, Number obj_factor,
+			Index nele_hess, Number *values)
+{
+	PyObject *items[5], *factor;
+	if (!(items[0] = bind_view(&data->arrayx, n, x))) return NULL;
+	if (!(items[1] = bind_view(&data->arraylambda, m, lambda))) return NULL;
+	if (data->inplace)
+		if (!(items[4] = bind_view(&data->arrayh, nele_hess, values)))
+			return NULL;
+	if (data->args_h != NULL && Py_REFCNT(data->args_h) > 1)
+		Py_CLEAR(data->args_h);
+	if (data->args_h != NULL)
+	{
+		factor = PyTuple_GET_ITEM(data->args_h, 2);
+		if (PyFloat_AS_DOUBLE(factor) == obj_factor) return data->args_h;
+		if (!(factor = PyFloat_FromDouble(obj_factor))) return NULL;
+		Py_DECREF(PyTuple_GET_ITEM(data->args_h, 2));
+		PyTuple_SET_ITEM(data->args_h, 2, factor);
+		return data->args_h;
+	}
+	if (!(factor = PyFloat_FromDouble(obj_factor))) return NULL;
+	items[2] = factor;
+	items[3] = Py_False;
+	data->args_h = build_args(data, 4 + data->inplace, items, TRUE);
+	Py_DECREF(factor);
+	return data->args_h;
+}
+
+void reset_dispatch_args(DispatchData *data)
+{
+	Py_CLEAR(data->args_x);
+	Py_CLEAR(data->args_jac);
+	Py_CLEAR(data->args_h);
+	Py_CLEAR(data->args_grad_f);
+	Py_CLEAR(data->args_g);
+	Py_CLEAR(data->args_new_x);
+}
+
+/* The C memory held for a problem of n variables, as live_problems()
+   reports it. Ipopt's own memory is out of sight. */
+size_t dispatch_data_bytes(const DispatchData *data, Index n)
+{
+	size_t bytes = sizeof(DispatchData);
+	Index nele_hess = data->nele_hess;
+
+	if (data->cache_x)
+		bytes += sizeof(Number) * (2*n + data->m + data->nele_jac + 1);
+	if (data->jac_structure) bytes += 2 * sizeof(Index) * data->nele_jac;
+	if (data->hess_structure) bytes += 2 * sizeof(Index) * nele_hess;
+	bytes += 5 * sizeof(npy_intp) * (data->jac_sparse.nnz + 
+					 data->hess_sparse.nnz);
+	bytes += sizeof(ConstraintBlock) * data->nblocks;
+	if (data->timeline.events)
+		bytes += sizeof(TimelineEvent) * data->timeline.capacity;
+	bytes += sizeof(IterRecord) * data->history.capacity;
+	if (data->x_L) bytes += sizeof(Number) * 2 * (n + data->m + 1);
+	if (data->limits.x) bytes += 2 * sizeof(Number) * n;
+	if (data->nl) bytes += nl_bytes(data->nl);
+	return bytes;
+}
+
+static void free_sparse_map(SparseMap *map)
+{
+	free(map->target);
+	free(map->coords);
+	free(map->scratch);
+	memset(map, 0, sizeof(SparseMap));
+}
+
+void clear_dispatch_data(DispatchData *data)
+{
+	reset_dispatch_args(data);
+	/* the callbacks and userdata are owned here */
+	Py_CLEAR(data->eval_f_python);
+	Py_CLEAR(data->eval_grad_f_python);
+	Py_CLEAR(data->eval_g_python);
+	Py_CLEAR(data->eval_jac_g_python);
+	Py_CLEAR(data->eval_h_python);
+	Py_CLEAR(data->apply_new_python);
+	Py_CLEAR(data->eval_all_python);
+	Py_CLEAR(data->userdata);
+	Py_CLEAR(data->arrayx);
+	Py_CLEAR(data->arraylambda);
+	Py_CLEAR(data->arraygradf);
+	Py_CLEAR(data->arrayg);
+	Py_CLEAR(data->arrayjac);
+	Py_CLEAR(data->arrayh);
+	Py_CLEAR(data->exctype);
+	Py_CLEAR(data->excval);
+	Py_CLEAR(data->exctb);
+	free(data->cache_x);
+	data->cache_x = NULL;
+	free(data->jac_structure);
+	data->jac_structure = NULL;
+	free(data->hess_structure);
+	data->hess_structure = NULL;
+	free_sparse_map(&data->jac_sparse);
+	free_sparse_map(&data->hess_sparse);
+	if (data->native.free_user_data)
+		data->native.free_user_data(data->native.user_data);
+	data->native.free_user_data = NULL;
+	data->native.user_data = NULL;
+	Py_CLEAR(data->native.owner);
+	pool_free(data->pool);
+	data->pool = NULL;
+	free(data->blocks);
+	data->blocks = NULL;
+	data->nblocks = 0;
+	free(data->timeline.events);
+	data->timeline.events = NULL;
+	free(data->history.records);
+	data->history.records = NULL;
+	data->history.count = data->history.capacity = 0;
+	Py_CLEAR(data->intermediate_python);
+	Py_CLEAR(data->params);
+	Py_CLEAR(data->params_kw);
+	Py_CLEAR(data->options);
+	free(data->x_L);
+	free(data->x_U);
+	free(data->g_L);
+	free(data->g_U);
+	data->x_L = data->x_U = data->g_L = data->g_U = NULL;
+	free(data->limits.x);
+	free(data->limits.pending);
+	data->limits.x = data->limits.pending = NULL;
+	data->nl = NULL;
+}
+
+/* Every wrapper that sees a new x comes through here, with the GIL. The
+   eval_all cache moves to x at the same time, so a cached call at the
+   same point doesn't take it for new and call apply_new again */
+Bool apply_new_python(DispatchData *myowndata, Index n, Number *x)
 {
+	if (myowndata->cache_x)
+	{
+		myowndata->cache_valid = 0;
+		memcpy(myowndata->cache_x, x, sizeof(Number)*n);
+	}
 	if (!myowndata->apply_new_python) return TRUE;
 
 	Bool r = FALSE;
-	PyObject* arg1 = Py_BuildValue("(O)", arrayx);
-	if (!arg1) ERROR;
-	PyObject* tempresult = PyObject_CallObject (myowndata->apply_new_python, arg1);
+	PyObject *tempresult = NULL;
+	PyObject *items[1];
+	double start = monotonic_time();
+	if (!(items[0] = bind_view(&myowndata->arrayx, n, x))) ERROR;
+	if (myowndata->args_new_x == NULL)
+		myowndata->args_new_x = build_args(myowndata, 1, items, FALSE);
+	if (!myowndata->args_new_x) ERROR;
+	tempresult = PyObject_Call(myowndata->apply_new_python, 
+				   myowndata->args_new_x, myowndata->params_kw);
 	if (!tempresult) ERROR;
 	r = TRUE;
 error:
 	assert( r || PyErr_Occurred());
-	save_python_exception();
-	Py_XDECREF(arg1);
 	Py_XDECREF(tempresult);
+	record_call(myowndata, EVENT_APPLY_NEW, start, TRUE, FALSE);
 	return r;
 }
 
-Bool eval_f(Index n, Number* x, Bool new_x,
+/* Fused evaluation
+
+   When the problem has an eval_all callback, eval_f, eval_grad_f, eval_g
+   and the values call of eval_jac_g are answered from a cache in
+   DispatchData keyed on the iterate. On a miss eval_all(x, need[, userdata])
+   is called with the NEED_* bits of the entries that are missing and has to
+   return a dict holding at least those of "f", "grad_f", "g" and "jac_g".
+   Anything else it returns is cached as well until x changes, so a model
+   can hand back everything it got for free in the same pass. Cache hits
+   never take the GIL. */
+
+static int eval_all_store(DispatchData *data, PyObject *dict, char *key,
+			  int bit, Number *dest, Index len)
+{
+	PyObject *item = PyDict_GetItemString(dict, key);	/* borrowed */
+	PyArrayObject *arr;
+	if (item == NULL) return TRUE;
+	if (bit == NEED_F)
+	{
+		*dest = PyFloat_AsDouble(item);
+		if (*dest == -1.0 && PyErr_Occurred()) return FALSE;
+	}
+	else
+	{
+		arr = (PyArrayObject*) PyArray_FROMANY(item, NPY_DOUBLE, 1, 1,
+						       NPY_IN_ARRAY);
+		if (!arr) return FALSE;
+		if (len != PyArray_DIM(arr, 0))
+		{
+			PyErr_Format(PyExc_TypeError, "eval_all: %s must "
+				     "have %d elements", key, (int) len);
+			Py_DECREF(arr);
+			return FALSE;
+		}
+		memcpy(dest, arr->data, sizeof(Number)*len);
+		Py_DECREF(arr);
+	}
+	data->cache_valid |= bit;
+	return TRUE;
+}
+
+Bool eval_all_python(DispatchData *myowndata, Index n, Number *x,
+		     Bool new_x, int need)
+{
+	Bool r = FALSE, moved = FALSE;
+	PyObject *arglist = NULL, *result = NULL, *items[2] = {NULL, NULL};
+	PyGILState_STATE gstate;
+
+	/* apply_new_python below moves the cache to x */
+	moved = new_x || memcmp(myowndata->cache_x, x, sizeof(Number)*n) != 0;
+	if (!moved)
+	{
+		if ((myowndata->cache_valid & need) == need) return TRUE;
+		need &= ~myowndata->cache_valid;
+	}
+
+	logger("[Callback:E] eval_all");
+	double start = monotonic_time();
+	gstate = PyGILState_Ensure();
+
+	if (moved) if (!apply_new_python(myowndata, n, x)) ERROR;
+
+	if (!(items[0] = bind_view(&myowndata->arrayx, n, x))) ERROR;
+	if (!(items[1] = PyInt_FromLong(need))) ERROR;
+	if (!(arglist = build_args(myowndata, 2, items, TRUE))) ERROR;
+
+	result = PyObject_Call(myowndata->eval_all_python, arglist,
+				myowndata->params_kw);
+	if (!result) ERROR;
+	if (!PyDict_Check(result))
+	{
+		PyErr_SetString(PyExc_TypeError, "eval_all: result must be a dict");
+		ERROR;
+	}
+	if (!eval_all_store(myowndata, result, "f", NEED_F,
+			    &myowndata->cache_f, 1) ||
+	    !eval_all_store(myowndata, result, "grad_f", NEED_GRAD_F,
+			    myowndata->cache_grad_f, n) ||
+	    !eval_all_store(myowndata, result, "g", NEED_G,
+			    myowndata->cache_g, myowndata->m) ||
+	    !eval_all_store(myowndata, result, "jac_g", NEED_JAC_G,
+			    myowndata->cache_jac, myowndata->nele_jac))
+		ERROR;
+	if ((myowndata->cache_valid & need) != need)
+	{
+		PyErr_SetString(PyExc_KeyError, "eval_all: result is missing "
+				"an entry that was asked for");
+		ERROR;
+	}
+	r = TRUE;
+error:
+	assert( r || PyErr_Occurred());
+	save_python_exception(myowndata);
+	Py_XDECREF(items[1]);
+	Py_XDECREF(arglist);
+	Py_XDECREF(result);
+	logger("[Callback:R] eval_all");
+	PyGILState_Release(gstate);
+	record_call(myowndata, EVENT_EVAL_ALL, start, moved, FALSE);
+	return r;
+}
+
+static Bool dispatch_f(Index n, Number* x, Bool new_x,
             Number* obj_value, UserDataPtr data)
 {
 	Bool r = FALSE;
+	PyObject *arglist = NULL, *result = NULL;
 	logger("[Callback:E]eval_f");
-	npy_intp dims[1];
-	dims[0] = n;
 
 	DispatchData *myowndata = (DispatchData*) data;
-	UserDataPtr user_data = (UserDataPtr) myowndata->userdata;
+	if (myowndata->native.eval_f)
+		return myowndata->native.eval_f(n, x, new_x, obj_value,
+						myowndata->native.user_data);
+	if (myowndata->eval_all_python != NULL)
+	{
+		if (!eval_all_python(myowndata, n, x, new_x, NEED_F)) return FALSE;
+		*obj_value = myowndata->cache_f;
+		return TRUE;
+	}
+	PyGILState_STATE gstate = PyGILState_Ensure();
 	
 	if (myowndata->eval_f_python == NULL)
 	{
@@ -91,19 +451,12 @@ Bool eval_f(Index n, Number* x, Bool new_x,
 		ERROR;
 	}
 
-	PyObject *arrayx = PyArray_SimpleNewFromData(1, dims, PyArray_DOUBLE , (char*) x);
-	if (!arrayx) ERROR;
-
-	if (new_x) if (!apply_new_python(myowndata, arrayx)) ERROR;
-	
-	PyObject* arglist;
+	if (new_x) if (!apply_new_python(myowndata, n, x)) ERROR;
 	
-	if (user_data != NULL)
-		arglist = Py_BuildValue("(OO)", arrayx, (PyObject*)user_data);
-	else 
-		arglist = Py_BuildValue("(O)", arrayx);
+	if (!(arglist = args_x(myowndata, n, x))) ERROR;
 
-	PyObject* result  = PyObject_CallObject (myowndata->eval_f_python ,arglist);
+	result  = PyObject_Call(myowndata->eval_f_python, arglist,
+				myowndata->params_kw);
 	if (!result) ERROR;
 	if (!PyFloat_Check(result))
 	{
@@ -116,24 +469,34 @@ Bool eval_f(Index n, Number* x, Bool new_x,
 
 error:
 	assert( r || PyErr_Occurred());
-	save_python_exception();
+	save_python_exception(myowndata);
 	Py_XDECREF(result);
-  	Py_XDECREF(arrayx);
-	Py_CLEAR(arglist);
 	logger("[Callback:R] eval_f");
+	PyGILState_Release(gstate);
   	return r;
 }
 
-Bool eval_grad_f(Index n, Number* x, Bool new_x,
+static Bool dispatch_grad_f(Index n, Number* x, Bool new_x,
                  Number* grad_f, UserDataPtr data)
 {
 	Bool r = FALSE;
-	PyObject *arrayx = NULL, *arglist = NULL;
+	PyObject *arglist = NULL;
 	PyArrayObject* result = NULL;
 	logger("[Callback:E] eval_grad_f");
 	
 	DispatchData *myowndata = (DispatchData*) data;
-	UserDataPtr user_data = (UserDataPtr) myowndata->userdata;
+	if (myowndata->native.eval_grad_f)
+		return myowndata->native.eval_grad_f(n, x, new_x, grad_f,
+						     myowndata->native.user_data);
+	if (myowndata->eval_all_python != NULL)
+	{
+		if (!eval_all_python(myowndata, n, x, new_x, NEED_GRAD_F))
+			return FALSE;
+		memcpy(grad_f, myowndata->cache_grad_f, sizeof(Number)*n);
+		myowndata->stats[STAT_GRAD_F].bytes += sizeof(Number)*n;
+		return TRUE;
+	}
+	PyGILState_STATE gstate = PyGILState_Ensure();
 	
 	if (myowndata->eval_grad_f_python == NULL)
 	{
@@ -141,23 +504,20 @@ Bool eval_grad_f(Index n, Number* x, Bool new_x,
 		ERROR;
 	}
 	
-	npy_intp dims[1];
-	dims[0] = n;
-	import_array1(FALSE); 
-	
-	arrayx = PyArray_SimpleNewFromData(1, dims, PyArray_DOUBLE , (char*) x);
-	if (!arrayx) ERROR;
-	
-	if (new_x) if (!apply_new_python(myowndata, arrayx)) ERROR;
+	if (new_x) if (!apply_new_python(myowndata, n, x)) ERROR;
 	
-	if (user_data != NULL)
-		arglist = Py_BuildValue("(OO)", arrayx, (PyObject*)user_data);
-	else 
-		arglist = Py_BuildValue("(O)", arrayx);
+	if (myowndata->inplace)
+		arglist = args_x_out(myowndata, &myowndata->args_grad_f,
+				     &myowndata->arraygradf, n, x, n, grad_f);
+	else
+		arglist = args_x(myowndata, n, x);
+	if (!arglist) ERROR;
 	
-	result = (PyArrayObject*) PyObject_CallObject 
-		(myowndata->eval_grad_f_python, arglist);
+	result = (PyArrayObject*) PyObject_Call
+		(myowndata->eval_grad_f_python, arglist, myowndata->params_kw);
 	
+	/* in-place callbacks have already written into grad_f */
+	if (result && myowndata->inplace) goto done;
 	if (!result || !PyArray_Check(result)) ERROR;
 
 #define CHECK(expr,msg)							\
@@ -173,32 +533,98 @@ Bool eval_grad_f(Index n, Number* x, Bool new_x,
 		"result must have as many elements as the input vector");
 #undef CHECK	
 	
-	double *tempdata = (double*)result->data;
-	int i;
-	for (i = 0; i < n; i++)
-		grad_f[i] = tempdata[i];
+	memcpy(grad_f, result->data, sizeof(Number)*n);
+	myowndata->stats[STAT_GRAD_F].bytes += sizeof(Number)*n;
+done:
 	r = TRUE;
 error:
 	assert( r || PyErr_Occurred());
-	save_python_exception();
+	save_python_exception(myowndata);
 	Py_XDECREF(result);
-  	Py_CLEAR(arrayx);
-	Py_CLEAR(arglist);
 	logger("[Callback:R] eval_grad_f");	
+	PyGILState_Release(gstate);
 	return r;
 }
 
 
-Bool eval_g(Index n, Number* x, Bool new_x,
+/* Constraint blocks: every block is one task on the pool and writes its
+   own rows of g and its own Jacobian nonzeros, so the tasks never share
+   anything but x. */
+typedef struct {
+	DispatchData *data;
+	Index n;
+	Number *x;
+	Bool new_x;
+	Number *g;
+	Index *iRow, *jCol;
+	Number *values;
+} BlockCall;
+
+static int block_g(void *arg, int task)
+{
+	BlockCall *call = (BlockCall*) arg;
+	ConstraintBlock *b = &call->data->blocks[task];
+	return b->eval_g(call->n, call->x, call->new_x,
+			 b->row_end - b->row_start, call->g + b->row_start,
+			 b->user_data);
+}
+
+static int block_jac_g(void *arg, int task)
+{
+	BlockCall *call = (BlockCall*) arg;
+	ConstraintBlock *b = &call->data->blocks[task];
+	Index k;
+	if (call->values != NULL)
+		return b->eval_jac_g(call->n, call->x, call->new_x,
+				     b->row_end - b->row_start,
+				     b->nz_end - b->nz_start, NULL, NULL,
+				     call->values + b->nz_start, b->user_data);
+	if (!b->eval_jac_g(call->n, call->x, call->new_x,
+			   b->row_end - b->row_start, b->nz_end - b->nz_start,
+			   call->iRow + b->nz_start, call->jCol + b->nz_start,
+			   NULL, b->user_data))
+		return 0;
+	for (k = b->nz_start; k < b->nz_end; k++)
+		call->iRow[k] += b->row_start;
+	return 1;
+}
+
+static Bool run_blocks(DispatchData *data, PoolTask *fn, BlockCall *call)
+{
+	if (data->pool == NULL)
+	{
+		data->pool = pool_create(data->threads > 0 ? data->threads
+					 : pool_default_threads());
+		if (data->pool == NULL) return FALSE;
+	}
+	return pool_run(data->pool, data->nblocks, fn, call) ? TRUE : FALSE;
+}
+
+static Bool dispatch_g(Index n, Number* x, Bool new_x,
             Index m, Number* g, UserDataPtr data)
 {
 	Bool r = FALSE;
-	PyObject *arrayx = NULL, *arglist = NULL;
+	PyObject *arglist = NULL;
 	PyArrayObject* result = NULL;
 	logger("[Callback:E] eval_g");
 
 	DispatchData *myowndata = (DispatchData*) data;
-	UserDataPtr user_data = (UserDataPtr) myowndata->userdata;
+	if (myowndata->nblocks > 0)
+	{
+		BlockCall call = {myowndata, n, x, new_x, g, NULL, NULL, NULL};
+		return run_blocks(myowndata, block_g, &call);
+	}
+	if (myowndata->native.eval_g)
+		return myowndata->native.eval_g(n, x, new_x, m, g,
+						myowndata->native.user_data);
+	if (myowndata->eval_all_python != NULL)
+	{
+		if (!eval_all_python(myowndata, n, x, new_x, NEED_G)) return FALSE;
+		memcpy(g, myowndata->cache_g, sizeof(Number)*m);
+		myowndata->stats[STAT_G].bytes += sizeof(Number)*m;
+		return TRUE;
+	}
+	PyGILState_STATE gstate = PyGILState_Ensure();
 	
 	if (myowndata->eval_g_python == NULL) 
 	{
@@ -206,26 +632,19 @@ Bool eval_g(Index n, Number* x, Bool new_x,
 		ERROR;
 	}
 
-	npy_intp dims[1];
-	int i;
-	double *tempdata;
-	
-	dims[0] = n;
-	import_array1(FALSE);
-	
-	arrayx = PyArray_SimpleNewFromData(1, dims, PyArray_DOUBLE , (char*) x);
-	if (!arrayx) ERROR;
-	
-	if (new_x) if (!apply_new_python(myowndata, arrayx)) ERROR;
+	if (new_x) if (!apply_new_python(myowndata, n, x)) ERROR;
 	
-	if (user_data != NULL)
-		arglist = Py_BuildValue("(OO)", arrayx, (PyObject*)user_data);
-	else 
-		arglist = Py_BuildValue("(O)", arrayx);
+	if (myowndata->inplace)
+		arglist = args_x_out(myowndata, &myowndata->args_g,
+				     &myowndata->arrayg, n, x, m, g);
+	else
+		arglist = args_x(myowndata, n, x);
+	if (!arglist) ERROR;
 	
-	result = (PyArrayObject*) PyObject_CallObject 
-		(myowndata->eval_g_python, arglist);
+	result = (PyArrayObject*) PyObject_Call
+		(myowndata->eval_g_python, arglist, myowndata->params_kw);
 	
+	if (result && myowndata->inplace) goto done;
 	if (!result || !PyArray_Check(result)) ERROR;
 	
 #define CHECK(expr,msg)							\
@@ -240,21 +659,387 @@ Bool eval_g(Index n, Number* x, Bool new_x,
 	CHECK(m==PyArray_DIM(result,0),
 		"result must have as many elements as constraints");
 #undef CHECK	
-	tempdata = (double*)result->data;
-	for (i = 0; i < m; i++)
-		g[i] = tempdata[i];
+	memcpy(g, result->data, sizeof(Number)*m);
+	myowndata->stats[STAT_G].bytes += sizeof(Number)*m;
+done:
 	r = TRUE;
 error:
 	assert( r || PyErr_Occurred());
-	save_python_exception();
+	save_python_exception(myowndata);
 	Py_XDECREF(result);
-  	Py_CLEAR(arrayx);
-	Py_CLEAR(arglist);
 	logger("[Callback:R] eval_g");
+	PyGILState_Release(gstate);
 	return r;
 }
 
-Bool eval_jac_g(Index n, Number *x, Bool new_x,
+/* Sparsity structure
+
+   Row and column indices are converted once, either at create() time or
+   from the first structure call, into a block of 2*nele Index (rows then
+   columns) kept in DispatchData; later structure calls are answered from it
+   without taking the GIL. Any 1d integer array is accepted. int32 and int64
+   arrays in native byte order are read in place, anything else goes through
+   a single numpy cast. The bounds check is a min/max reduction over the
+   whole array rather than a branch per element. */
+
+#define COPY_INDICES(type)						\
+	do								\
+	{								\
+		const type *src = (const type*) arr->data;		\
+		type lo = 0, hi = 0;					\
+		for (i = 0; i < nele; i++)				\
+		{							\
+			lo = src[i] < lo ? src[i] : lo;			\
+			hi = src[i] > hi ? src[i] : hi;			\
+			out[i] = (Index) src[i];			\
+		}							\
+		bad = nele > 0 && (lo < 0 || hi >= (type) bound);	\
+	} while(0)
+
+static int copy_indices(PyObject *obj, Index nele, Index bound, Index *out,
+			const char *who, const char *what)
+{
+	PyArrayObject *arr = NULL;
+	int type, bad = 0;
+	npy_intp i;
+
+	arr = (PyArrayObject*) PyArray_FROM_O(obj);
+	if (!arr) return FALSE;
+	if (!PyArray_ISINTEGER(arr) || 1 != PyArray_NDIM(arr))
+	{
+		PyErr_Format(PyExc_TypeError, "%s: %s must be a 1d integer "
+			     "array", who, what);
+		goto fail;
+	}
+	if (nele != PyArray_DIM(arr, 0))
+	{
+		PyErr_Format(PyExc_TypeError, "%s: there must be as many %s "
+			     "as non-zero values", who, what);
+		goto fail;
+	}
+	type = PyArray_ITEMSIZE(arr) == 4 ? NPY_INT32 : NPY_INT64;
+	if (PyArray_TYPE(arr) != type || !PyArray_ISCARRAY_RO(arr) ||
+	    !PyArray_ISNOTSWAPPED(arr))
+	{
+		PyArrayObject *native = (PyArrayObject*) 
+			PyArray_FROM_OTF((PyObject*) arr, type, NPY_IN_ARRAY);
+		Py_DECREF(arr);
+		if (!(arr = native)) return FALSE;
+	}
+	if (type == NPY_INT32)
+		COPY_INDICES(npy_int32);
+	else
+		COPY_INDICES(npy_int64);
+	if (bad)
+	{
+		PyErr_Format(PyExc_ValueError, "%s: %s must be between 0 and %d",
+			     who, what, (int) bound - 1);
+		goto fail;
+	}
+	Py_DECREF(arr);
+	return TRUE;
+fail:
+	Py_DECREF(arr);
+	return FALSE;
+}
+#undef COPY_INDICES
+
+Index *convert_structure(PyObject *pair, Index nele, Index nrows, Index ncols,
+			 const char *who)
+{
+	PyObject *rows, *cols;
+	Index *structure;
+	if (!PyArg_ParseTuple(pair, "OO;structure must be a (rows, columns) tuple",
+			      &rows, &cols))
+		return NULL;
+	structure = (Index*) malloc(sizeof(Index)*(2*nele + 1));
+	if (!structure) return (Index*) PyErr_NoMemory();
+	if (!copy_indices(rows, nele, nrows, structure, who, "rows") ||
+	    !copy_indices(cols, nele, ncols, structure + nele, who, "columns"))
+	{
+		free(structure);
+		return NULL;
+	}
+	return structure;
+}
+
+/* scipy.sparse results
+
+   The values calls of eval_jac_g and eval_h may return a scipy.sparse
+   matrix instead of a flat array in structure order. The first time one
+   comes back, each entry of its storage (data[j]) is matched against the
+   declared structure and the resulting storage -> triplet map is kept in a
+   SparseMap; every later call is a single scatter-add of data through that
+   map. Duplicate COO entries therefore add up, as they do in scipy. The map
+   is rebuilt when the format or the number of stored entries changes, so
+   the sparsity pattern of what the callback returns must otherwise stay
+   put. For the Hessian an entry that is not in the structure is matched to
+   its transpose, unless the matrix stores that transpose as well, in which
+   case it is the redundant half of a symmetric matrix and is skipped. */
+
+enum { SPARSE_NONE = 0, SPARSE_COO, SPARSE_CSR, SPARSE_CSC };
+
+typedef struct {
+	npy_int64 key;
+	npy_intp index;
+} sparse_key;
+
+static int compare_keys(const void *a, const void *b)
+{
+	npy_int64 ka = ((const sparse_key*) a)->key;
+	npy_int64 kb = ((const sparse_key*) b)->key;
+	return ka < kb ? -1 : ka > kb;
+}
+
+static npy_intp find_key(sparse_key *keys, npy_intp count, npy_int64 key)
+{
+	sparse_key probe, *hit;
+	probe.key = key;
+	hit = (sparse_key*) bsearch(&probe, keys, count, sizeof(sparse_key),
+				    compare_keys);
+	return hit ? hit->index : -1;
+}
+
+static int sparse_format(PyObject *obj)
+{
+	PyObject *format;
+	char *name;
+	int code = SPARSE_NONE;
+	if (PyArray_Check(obj) || !PyObject_HasAttrString(obj, "format") ||
+	    !PyObject_HasAttrString(obj, "data"))
+		return SPARSE_NONE;
+	format = PyObject_GetAttrString(obj, "format");
+	if (!format) 
+	{
+		PyErr_Clear();
+		return SPARSE_NONE;
+	}
+	name = PyString_Check(format) ? PyString_AsString(format) : "";
+	if (!strcmp(name, "coo")) code = SPARSE_COO;
+	else if (!strcmp(name, "csr")) code = SPARSE_CSR;
+	else if (!strcmp(name, "csc")) code = SPARSE_CSC;
+	Py_DECREF(format);
+	return code;
+}
+
+static PyArrayObject *sparse_array(PyObject *obj, char *attr, int type)
+{
+	PyObject *value = PyObject_GetAttrString(obj, attr);
+	PyArrayObject *arr;
+	if (!value) return NULL;
+	arr = (PyArrayObject*) PyArray_FROMANY(value, type, 1, 1, NPY_IN_ARRAY);
+	Py_DECREF(value);
+	return arr;
+}
+
+/* Row and column of every stored entry, in storage order */
+static int sparse_coordinates(PyObject *obj, int format, npy_intp nnz,
+			      npy_intp *row, npy_intp *col)
+{
+	PyArrayObject *a = NULL, *b = NULL;
+	npy_intp i, j, *p, *q;
+	int r = FALSE;
+	if (format == SPARSE_COO)
+	{
+		if (!(a = sparse_array(obj, "row", NPY_INTP))) goto out;
+		if (!(b = sparse_array(obj, "col", NPY_INTP))) goto out;
+		if (PyArray_DIM(a, 0) < nnz || PyArray_DIM(b, 0) < nnz) 
+			goto size;
+		memcpy(row, a->data, sizeof(npy_intp)*nnz);
+		memcpy(col, b->data, sizeof(npy_intp)*nnz);
+	}
+	else
+	{
+		/* compressed rows (csr) or columns (csc) */
+		npy_intp *outer = format == SPARSE_CSR ? row : col;
+		npy_intp *inner = format == SPARSE_CSR ? col : row;
+		if (!(a = sparse_array(obj, "indptr", NPY_INTP))) goto out;
+		if (!(b = sparse_array(obj, "indices", NPY_INTP))) goto out;
+		if (PyArray_DIM(b, 0) < nnz) goto size;
+		p = (npy_intp*) a->data;
+		q = (npy_intp*) b->data;
+		for (i = 0; i + 1 < PyArray_DIM(a, 0); i++)
+			for (j = p[i]; j < p[i+1] && j < nnz; j++)
+			{
+				outer[j] = i;
+				inner[j] = q[j];
+			}
+	}
+	r = TRUE;
+	goto out;
+size:
+	PyErr_SetString(PyExc_ValueError, "sparse result has fewer indices "
+			"than stored values");
+out:
+	Py_XDECREF(a);
+	Py_XDECREF(b);
+	return r;
+}
+
+/* Fills row and col, rows then columns of nnz entries each, and checks
+   every entry lies in the nrows x ncols matrix; outside it the keys
+   below could collide and put a value in another entry's slot */
+static int checked_coordinates(PyObject *obj, int format, npy_intp nnz,
+			       npy_intp *row, Index nrows, Index ncols,
+			       const char *who)
+{
+	npy_intp j, *col = row + nnz;
+	for (j = 0; j < nnz; j++) row[j] = col[j] = -1;
+	if (!sparse_coordinates(obj, format, nnz, row, col)) return FALSE;
+	for (j = 0; j < nnz; j++)
+		if (row[j] < 0 || row[j] >= nrows || 
+		    col[j] < 0 || col[j] >= ncols)
+		{
+			PyErr_Format(PyExc_ValueError, "%s: sparse result has "
+				     "an entry at (%ld, %ld) outside the "
+				     "%ld x %ld matrix", who, (long) row[j],
+				     (long) col[j], (long) nrows, 
+				     (long) ncols);
+			return FALSE;
+		}
+	return TRUE;
+}
+
+static int build_sparse_map(SparseMap *map, PyObject *obj, int format, 
+			    npy_intp nnz, Index *structure, Index nele,
+			    Index nrows, Index ncols, int symmetric, 
+			    const char *who)
+{
+	npy_intp j, k, *row = NULL, *col = NULL, *target = NULL;
+	npy_intp *scratch = NULL;
+	sparse_key *keys = NULL, *stored = NULL;
+	int r = FALSE;
+
+	row = (npy_intp*) malloc(sizeof(npy_intp)*(2*nnz + 1));
+	scratch = (npy_intp*) malloc(sizeof(npy_intp)*(2*nnz + 1));
+	target = (npy_intp*) malloc(sizeof(npy_intp)*(nnz + 1));
+	keys = (sparse_key*) malloc(sizeof(sparse_key)*(nele + 1));
+	if (symmetric) 
+		stored = (sparse_key*) malloc(sizeof(sparse_key)*(nnz + 1));
+	if (!row || !scratch || !target || !keys || (symmetric && !stored))
+	{
+		PyErr_NoMemory();
+		goto out;
+	}
+	col = row + nnz;
+	if (!checked_coordinates(obj, format, nnz, row, nrows, ncols, who))
+		goto out;
+
+	for (k = 0; k < nele; k++)
+	{
+		keys[k].key = (npy_int64) structure[k] * ncols + structure[nele+k];
+		keys[k].index = k;
+	}
+	qsort(keys, nele, sizeof(sparse_key), compare_keys);
+	if (symmetric)
+	{
+		for (j = 0; j < nnz; j++)
+		{
+			stored[j].key = (npy_int64) row[j] * ncols + col[j];
+			stored[j].index = j;
+		}
+		qsort(stored, nnz, sizeof(sparse_key), compare_keys);
+	}
+
+	for (j = 0; j < nnz; j++)
+	{
+		npy_int64 transposed = (npy_int64) col[j] * ncols + row[j];
+		target[j] = find_key(keys, nele, 
+				     (npy_int64) row[j] * ncols + col[j]);
+		if (target[j] < 0 && symmetric && row[j] != col[j])
+		{
+			/* the other half of a symmetric matrix */
+			if (find_key(stored, nnz, transposed) >= 0) continue;
+			target[j] = find_key(keys, nele, transposed);
+		}
+		if (target[j] < 0)
+		{
+			PyErr_Format(PyExc_ValueError, "%s: sparse result has "
+				     "an entry at (%ld, %ld) outside the "
+				     "declared structure", who, 
+				     (long) row[j], (long) col[j]);
+			goto out;
+		}
+	}
+
+	free_sparse_map(map);
+	map->target = target;
+	map->coords = row;
+	map->scratch = scratch;
+	map->format = format;
+	map->nnz = nnz;
+	target = row = scratch = NULL;
+	r = TRUE;
+out:
+	free(row);
+	free(scratch);
+	free(target);
+	free(keys);
+	free(stored);
+	return r;
+}
+
+/* The map is only good for the pattern it was built from; the same
+   format and count with other indices needs a new one */
+static int sparse_values(SparseMap *map, PyObject *obj, int format,
+			 Index *structure, Index nele, Index nrows, 
+			 Index ncols, int symmetric, Number *values, 
+			 const char *who)
+{
+	PyArrayObject *data;
+	const double *src;
+	const npy_intp *target;
+	npy_intp j, nnz;
+
+	if (!structure)
+	{
+		PyErr_Format(PyExc_SystemError, "%s: sparse result before "
+			     "the structure is known", who);
+		return FALSE;
+	}
+	if (!(data = sparse_array(obj, "data", NPY_DOUBLE))) return FALSE;
+	nnz = PyArray_DIM(data, 0);
+	if (map->target != NULL && map->format == format && map->nnz == nnz)
+	{
+		if (!checked_coordinates(obj, format, nnz, map->scratch,
+					 nrows, ncols, who))
+		{
+			Py_DECREF(data);
+			return FALSE;
+		}
+		if (memcmp(map->scratch, map->coords, 
+			   sizeof(npy_intp)*2*nnz) != 0)
+			free_sparse_map(map);
+	}
+	if (map->target == NULL || map->format != format || map->nnz != nnz)
+		if (!build_sparse_map(map, obj, format, nnz, structure, nele,
+				      nrows, ncols, symmetric, who))
+		{
+			Py_DECREF(data);
+			return FALSE;
+		}
+	src = (const double*) data->data;
+	target = map->target;
+	memset(values, 0, sizeof(Number)*nele);
+	for (j = 0; j < nnz; j++)
+		if (target[j] >= 0)
+			values[target[j]] += src[j];
+	Py_DECREF(data);
+	return TRUE;
+}
+
+/* x is NULL when Ipopt asks for a sparsity structure; the structure
+   callbacks still get an array of the right length, but a zeroed one */
+static PyObject *structure_x(Index n, Number *x)
+{
+	npy_intp dims[1];
+	dims[0] = n;
+	if (x != NULL)
+		return PyArray_SimpleNewFromData(1, dims, PyArray_DOUBLE, (char*) x);
+	return PyArray_ZEROS(1, dims, PyArray_DOUBLE, 0);
+}
+
+static Bool dispatch_jac_g(Index n, Number *x, Bool new_x,
                 Index m, Index nele_jac,
                 Index *iRow, Index *jCol, Number *values,
                 UserDataPtr data)
@@ -262,21 +1047,39 @@ Bool eval_jac_g(Index n, Number *x, Bool new_x,
 
 	Bool r = FALSE;
 	PyObject *arrayx = NULL, *arglist = NULL, *result = NULL;
-	PyArrayObject *row = NULL, *col = NULL; 
+	int format;
 	logger("[Callback:E] eval_jac_g");
 
 	DispatchData *myowndata = (DispatchData*) data;
-	UserDataPtr user_data = (UserDataPtr) myowndata->userdata;
-	
-	int i;
-	npy_intp* rowd = NULL;
-	npy_intp* cold = NULL;
-	
-	npy_intp dims[1];
-	dims[0] = n;
+	if (myowndata->nblocks > 0)
+	{
+		BlockCall call = {myowndata, n, x, new_x, NULL, iRow, jCol, 
+				  values};
+		return run_blocks(myowndata, block_jac_g, &call);
+	}
+	if (myowndata->native.eval_jac_g)
+		return myowndata->native.eval_jac_g(n, x, new_x, m, nele_jac,
+						    iRow, jCol, values,
+						    myowndata->native.user_data);
+	if (values == NULL && myowndata->jac_structure != NULL)
+	{
+		memcpy(iRow, myowndata->jac_structure, sizeof(Index)*nele_jac);
+		memcpy(jCol, myowndata->jac_structure + nele_jac, 
+		       sizeof(Index)*nele_jac);
+		myowndata->stats[STAT_JAC_G].bytes += 2*sizeof(Index)*nele_jac;
+		return TRUE;
+	}
+	if (values != NULL && myowndata->eval_all_python != NULL)
+	{
+		if (!eval_all_python(myowndata, n, x, new_x, NEED_JAC_G))
+			return FALSE;
+		memcpy(values, myowndata->cache_jac, sizeof(Number)*nele_jac);
+		myowndata->stats[STAT_JAC_G].bytes += sizeof(Number)*nele_jac;
+		return TRUE;
+	}
+	PyGILState_STATE gstate = PyGILState_Ensure();
+	PyObject *items[2];
 	
-	double *tempdata;
-
 	if (myowndata->eval_jac_g_python == NULL) 
 	{
 		PyErr_SetString(PyExc_SystemError,"null constraint jacobian function");
@@ -284,67 +1087,50 @@ Bool eval_jac_g(Index n, Number *x, Bool new_x,
 	}
 
 	if (values == NULL) {
-		import_array1(FALSE);
-		PyObject *arrayx = PyArray_SimpleNewFromData(1, 
-					dims, PyArray_DOUBLE , (char*) x);
+		arrayx = structure_x(n, x);
 		if (!arrayx) ERROR;
 
-		if (user_data != NULL)
-			arglist = Py_BuildValue("(OOO)", 
-					arrayx, Py_True, (PyObject*)user_data);
-		else 
-			arglist = Py_BuildValue("(OO)", arrayx, Py_True);	
+		items[0] = (PyObject*) arrayx;
+		items[1] = Py_True;
+		arglist = build_args(myowndata, 2, items, TRUE);
+		if (!arglist) ERROR;
 		
-		result = PyObject_CallObject (myowndata->eval_jac_g_python, arglist);
+		result = PyObject_Call(myowndata->eval_jac_g_python, arglist,
+					myowndata->params_kw);
 		if (!result) ERROR;
-		if (!PyArg_ParseTuple(result, "O!O!;result of eval_jac_g must be two arrays in a tuple",
-				      &PyArray_Type, &row,
-				      &PyArray_Type, &col) && row && col)
-			ERROR;
-#define CHECK(expr,msg) do {						\
-		if (!(expr))						\
-		{							\
-			PyErr_SetString(PyExc_TypeError, "eval_jac_g: " msg); \
-			ERROR;						\
-		} } while(0)
-		CHECK(PyArray_ISCONTIGUOUS(row),"rows must be contiguous");
-		CHECK(PyArray_ISCONTIGUOUS(col),"columns must be contiguous");
-		CHECK(Is_long_Array(row),"rows must be an integer array");
-		CHECK(Is_long_Array(col),"columns must be an integer array");
-		CHECK(1 == PyArray_NDIM(row),"rows must be a 1d array");
-		CHECK(1 == PyArray_NDIM(col),"columns must be a 1d array");
-		CHECK(nele_jac == PyArray_DIM(row,0),
-			"there must be as many rows as non-zero jacobian values");
-		CHECK(nele_jac == PyArray_DIM(col,0),
-			"there must be as many columns as non-zero jacobian values");
-#undef CHECK
-
-		rowd = (npy_intp*) row->data;
-		cold = (npy_intp*) col->data;
-		
-		for (i = 0; i < nele_jac; i++) {
-			iRow[i] = (Index) rowd[i];
-			jCol[i] = (Index) cold[i];
-			//logger("%d Row %d, Col %d\n", i, iRow[i], jCol[i]);
-		}
+		myowndata->jac_structure = convert_structure(result, nele_jac, 
+						m, n, "eval_jac_g");
+		if (!myowndata->jac_structure) ERROR;
+		memcpy(iRow, myowndata->jac_structure, sizeof(Index)*nele_jac);
+		memcpy(jCol, myowndata->jac_structure + nele_jac, 
+		       sizeof(Index)*nele_jac);
+		myowndata->stats[STAT_JAC_G].bytes += 2*sizeof(Index)*nele_jac;
 		logger("[Callback:R] eval_jac_g(1)");	
 	}
 	
 	else {
-		arrayx = PyArray_SimpleNewFromData(1, dims, PyArray_DOUBLE , (char*) x);
-		if (!arrayx) ERROR;
+		if (new_x) if (!apply_new_python(myowndata, n, x)) ERROR;
 		
-		if (new_x) if (!apply_new_python(myowndata, arrayx)) ERROR;
+		if (!(arglist = args_jac(myowndata, n, x, nele_jac, values))) ERROR;
+		/* borrowed from DispatchData, keep the error path off it */
+		Py_INCREF(arglist);
 		
-		if (user_data != NULL)
-			arglist = Py_BuildValue("(OOO)", 
-					arrayx, Py_False, (PyObject*)user_data);
-		else 
-			arglist = Py_BuildValue("(OO)", arrayx, Py_False);	
+		result = PyObject_Call(myowndata->eval_jac_g_python, arglist,
+					myowndata->params_kw);
 		
-		result = PyObject_CallObject(myowndata->eval_jac_g_python, arglist);
-		
-		if (!result || !PyArray_Check(result)) ERROR;
+		if (result && myowndata->inplace) goto done;
+		if (!result) ERROR;
+		if ((format = sparse_format(result)) != SPARSE_NONE)
+		{
+			if (!sparse_values(&myowndata->jac_sparse, result, 
+					   format, myowndata->jac_structure,
+					   nele_jac, m, n, FALSE, values,
+					   "eval_jac_g"))
+				ERROR;
+			myowndata->stats[STAT_JAC_G].bytes += 
+				sizeof(Number)*nele_jac;
+			goto done;
+		}
 
 #define CHECK(expr,msg)							\
 		do if (!(expr))						\
@@ -352,6 +1138,7 @@ Bool eval_jac_g(Index n, Number *x, Bool new_x,
 			PyErr_SetString(PyExc_TypeError, "eval_jac_g: " msg); \
 			ERROR;						\
 		} while(0)
+		CHECK(PyArray_Check(result),"result must be an array or a scipy.sparse matrix");
 		CHECK(PyArray_ISCONTIGUOUS(result),"result array must be contiguous");
 		CHECK(Is_double_Array(result),"result must be a float array");
 		CHECK(1==PyArray_NDIM(result),"result must be a 1d array");
@@ -359,42 +1146,52 @@ Bool eval_jac_g(Index n, Number *x, Bool new_x,
 			"result must have as many values as non-zero constraint jacobian values");
 #undef CHECK	
 		
-		tempdata = (double*)((PyArrayObject*)result)->data;
-		
-		for (i = 0; i < nele_jac; i++)
-			values[i] = tempdata[i];
+		memcpy(values, ((PyArrayObject*)result)->data, 
+		       sizeof(Number)*nele_jac);
+		myowndata->stats[STAT_JAC_G].bytes += sizeof(Number)*nele_jac;
 
 		logger("[Callback:R] eval_jac_g(2)");
 	}
+done:
 	r = TRUE;
 error:
 	assert( r || PyErr_Occurred());
-	save_python_exception();
+	save_python_exception(myowndata);
 	Py_XDECREF(result);
 	Py_CLEAR(arrayx);
 	Py_CLEAR(arglist);
 	logger("[Callback:R] eval_jac_g");
+	PyGILState_Release(gstate);
   	return r;
 }
 
 
-Bool eval_h(Index n, Number *x, Bool new_x, Number obj_factor,
+static Bool dispatch_h(Index n, Number *x, Bool new_x, Number obj_factor,
             Index m, Number *lambda, Bool new_lambda,
             Index nele_hess, Index *iRow, Index *jCol,
             Number *values, UserDataPtr data)
 {
 	Bool r = FALSE;
-	PyObject *objfactor = NULL, *lagrange = NULL,
-		*arglist = NULL, *result = NULL, *arrayx = NULL;
+	PyObject *objfactor = NULL, *arglist = NULL, *result = NULL;
+	int format;
 	logger("[Callback:E] eval_h");
 
 	DispatchData *myowndata = (DispatchData*) data;
-	UserDataPtr user_data = (UserDataPtr) myowndata->userdata;
-	
-
-	int i;
-	npy_intp dims[1];
-	npy_intp dims2[1];
+	if (myowndata->native.eval_h)
+		return myowndata->native.eval_h(n, x, new_x, obj_factor, m,
+						lambda, new_lambda, nele_hess,
+						iRow, jCol, values,
+						myowndata->native.user_data);
+	if (values == NULL && myowndata->hess_structure != NULL)
+	{
+		memcpy(iRow, myowndata->hess_structure, sizeof(Index)*nele_hess);
+		memcpy(jCol, myowndata->hess_structure + nele_hess, 
+		       sizeof(Index)*nele_hess);
+		myowndata->stats[STAT_H].bytes += 2*sizeof(Index)*nele_hess;
+		return TRUE;
+	}
+	PyGILState_STATE gstate = PyGILState_Ensure();
+	PyObject *items[4];
 	
 	if (myowndata->eval_h_python == NULL) 
 	{
@@ -402,84 +1199,52 @@ Bool eval_h(Index n, Number *x, Bool new_x, Number obj_factor,
 		ERROR;
 	}
 	if (values == NULL) {
-		arrayx = Py_True;
 		objfactor = Py_BuildValue("d", obj_factor);
-		lagrange = Py_True;
+		if (!objfactor) ERROR;
 		
-		if (user_data != NULL) 
-			arglist =  Py_BuildValue("(OOOOO)", arrayx, lagrange, objfactor, Py_True, (PyObject*)user_data);
-		else 
-			arglist =  Py_BuildValue("(OOOO)", arrayx, lagrange, objfactor, Py_True);
+		items[0] = items[1] = items[3] = Py_True;
+		items[2] = objfactor;
+		arglist = build_args(myowndata, 4, items, TRUE);
+		if (!arglist) ERROR;
 		
-		result = PyObject_CallObject (myowndata->eval_h_python, arglist);
+		result = PyObject_Call(myowndata->eval_h_python, arglist,
+					myowndata->params_kw);
 		if (!result) ERROR;
-
-		PyArrayObject *row = NULL, *col = NULL; 
-		if (!PyArg_ParseTuple(result, "O!O!;result of eval_h must be two arrays in a tuple",
-				      &PyArray_Type, &row,
-				      &PyArray_Type, &col) &&
-		    row && col)
-			ERROR;
-
-#define CHECK(expr,msg) do {						\
-		if (!(expr))						\
-		{							\
-			PyErr_SetString(PyExc_TypeError, "eval_h: " msg); \
-			ERROR;						\
-		} } while(0)
-		CHECK(PyArray_ISCONTIGUOUS(row),"rows must be contiguous");
-		CHECK(PyArray_ISCONTIGUOUS(col),"columns must be contiguous");
-		CHECK(Is_long_Array(row),"rows must be an integer array");
-		CHECK(Is_long_Array(col),"columns must be an integer array");
-		CHECK(1 == PyArray_NDIM(row),"rows must be a 1d array");
-		CHECK(1 == PyArray_NDIM(col),"columns must be a 1d array");
-		CHECK(nele_hess == PyArray_DIM(row,0),
-			"there must be as many rows as non-zero hessian values");
-		CHECK(nele_hess == PyArray_DIM(col,0),
-			"there must be as many columns as non-zero hessian values");
-#undef CHECK
-
-		long* rdata = (long*)row->data;
-		long* cdata = (long*)col->data;
-		
-		// A compiler warning here, from long -> Index(int)
-		
-		for (i = 0; i < nele_hess; i++) {
-			iRow[i] = (Index)rdata[i];
-			jCol[i] = (Index)cdata[i];
-			if ( n < iRow[i] || n < jCol[i] )
-			{
-				PyErr_SetString(PyExc_TypeError, "eval_h: "
-					"Row or column must be less than "
-					"number of input elements");
-				ERROR;
-			}
-			// logger("PyIPOPT_DEBUG %d, %d\n", iRow[i], jCol[i]);
-		}
+		myowndata->hess_structure = convert_structure(result, nele_hess, 
+						n, n, "eval_h");
+		if (!myowndata->hess_structure) ERROR;
+		memcpy(iRow, myowndata->hess_structure, sizeof(Index)*nele_hess);
+		memcpy(jCol, myowndata->hess_structure + nele_hess, 
+		       sizeof(Index)*nele_hess);
+		myowndata->stats[STAT_H].bytes += 2*sizeof(Index)*nele_hess;
 
 		logger("[Callback:R] eval_h (1)");
 	}
 	else {	
-		objfactor = Py_BuildValue("d", obj_factor);
-		
-		dims[0] = n;
-		arrayx = PyArray_SimpleNewFromData(1, dims, PyArray_DOUBLE , (char*) x);
-		if (!arrayx) ERROR;
-		
-		if (new_x) if (!apply_new_python(myowndata, arrayx)) ERROR;
-		
-		dims2[0] = m;
-		lagrange = PyArray_SimpleNewFromData(1, dims2, PyArray_DOUBLE , (char*) lambda);
-		if (!lagrange) ERROR;
+		if (new_x) if (!apply_new_python(myowndata, n, x)) ERROR;
 		
-		if (user_data != NULL)
-			arglist = Py_BuildValue("(OOOOO)", arrayx, lagrange, objfactor, Py_False, (PyObject*)user_data);
-		else
-			arglist = Py_BuildValue("(OOOO)", arrayx, lagrange, objfactor, Py_False);
+		arglist = args_h(myowndata, n, x, m, lambda, obj_factor,
+				 nele_hess, values);
+		if (!arglist) ERROR;
+		/* borrowed from DispatchData, keep the error path off it */
+		Py_INCREF(arglist);
 
-		result = PyObject_CallObject (myowndata->eval_h_python, arglist);
+		result = PyObject_Call(myowndata->eval_h_python, arglist,
+					myowndata->params_kw);
 		
-		if (!result || !PyArray_Check(result)) ERROR;
+		if (result && myowndata->inplace) goto done;
+		if (!result) ERROR;
+		if ((format = sparse_format(result)) != SPARSE_NONE)
+		{
+			if (!sparse_values(&myowndata->hess_sparse, result, 
+					   format, myowndata->hess_structure,
+					   nele_hess, n, n, TRUE, values, 
+					   "eval_h"))
+				ERROR;
+			myowndata->stats[STAT_H].bytes += 
+				sizeof(Number)*nele_hess;
+			goto done;
+		}
 
 #define CHECK(expr,msg)							\
 		do if (!(expr))						\
@@ -487,6 +1252,7 @@ Bool eval_h(Index n, Number *x, Bool new_x, Number obj_factor,
 			PyErr_SetString(PyExc_TypeError, "eval_h: " msg); \
 			ERROR;						\
 		} while(0)
+		CHECK(PyArray_Check(result),"result must be an array or a scipy.sparse matrix");
 		CHECK(PyArray_ISCONTIGUOUS(result),"result array must be contiguous");
 		CHECK(Is_double_Array(result),"result must be a float array");
 		CHECK(1==PyArray_NDIM(result),"result must be a 1d array");
@@ -494,24 +1260,301 @@ Bool eval_h(Index n, Number *x, Bool new_x, Number obj_factor,
 			"result must have as many values as non-zero hessian values");
 #undef CHECK	
 		
-		double* tempdata = (double*)((PyArrayObject*)result)->data;
-		for (i = 0; i < nele_hess; i++)
-		{
-			values[i] = tempdata[i];
-			// logger("PyDebug %f \n", values[i]);
-		}	
+		memcpy(values, ((PyArrayObject*)result)->data,
+		       sizeof(Number)*nele_hess);
+		myowndata->stats[STAT_H].bytes += sizeof(Number)*nele_hess;
 		logger("[Callback:R] eval_h (2)");
 	}	
+done:
 	r = TRUE;
 error:
 	assert( r || PyErr_Occurred());
-	save_python_exception();
-	Py_CLEAR(arrayx);
-	Py_CLEAR(lagrange);
+	save_python_exception(myowndata);
 	Py_CLEAR(objfactor);
 	Py_XDECREF(result);
 	Py_CLEAR(arglist);
+	PyGILState_Release(gstate);
   	return r;
 }
 
+/* Deadline and evaluation budget
+
+   Checked with nothing but the clock and a counter before every value
+   call and at every iteration, so only at callback boundaries: a callback
+   that blocks runs past the deadline until it returns. Past
+   either limit the wrappers fail without calling anything, which makes
+   Ipopt give up on the iteration, and intermediate_cb stops the solve as
+   soon as Ipopt reports one. */
+
+static int out_of_limits(DispatchData *myowndata, double now)
+{
+	SolveLimits *limits = &myowndata->limits;
+
+	if (limits->stop) return 1;
+	if (limits->max_evals && limits->evals >= limits->max_evals)
+		limits->stop = STOP_BUDGET;
+	else if (limits->deadline && now >= limits->deadline)
+		limits->stop = STOP_DEADLINE;
+	return limits->stop != 0;
+}
+
+/* For a value call starting at now: 0 to go ahead, counted, 1 to fail */
+static int refuse_call(DispatchData *myowndata, double now)
+{
+	if (out_of_limits(myowndata, now)) return 1;
+	myowndata->limits.evals++;
+	return 0;
+}
+
+/* Iteration history
+
+   Ipopt reports every iteration to intermediate_cb, which appends it to
+   the history without touching Python. Only every intermediate_every-th
+   iteration, and only with a Python hook set, is the GIL taken to call
+   intermediate(alg_mod, iter_count, obj_value, inf_pr, inf_du, mu, d_norm,
+   regularization_size, alpha_du, alpha_pr, ls_trials[, userdata]), with
+   params=problem.params when that is set. The
+   hook returns False to stop the solve. */
+
+Bool intermediate_cb(Index alg_mod, Index iter_count, Number obj_value,
+                     Number inf_pr, Number inf_du, Number mu, Number d_norm,
+                     Number regularization_size, Number alpha_du, 
+                     Number alpha_pr, Index ls_trials, UserDataPtr data)
+{
+	Bool r = FALSE;
+	PyObject *report = NULL, *arglist = NULL, *result = NULL;
+	DispatchData *myowndata = (DispatchData*) data;
+	IterHistory *history = &myowndata->history;
+	IterRecord *record;
+
+	if (history->count == history->capacity)
+	{
+		long capacity = history->capacity ? 2 * history->capacity : 256;
+		record = (IterRecord*) realloc(history->records, 
+					       sizeof(IterRecord) * capacity);
+		/* out of memory only loses the rest of the history */
+		if (record)
+		{
+			history->records = record;
+			history->capacity = capacity;
+		}
+	}
+	if (history->count < history->capacity)
+	{
+		record = &history->records[history->count++];
+		record->iter = iter_count;
+		record->ls_trials = ls_trials;
+		record->alg_mod = alg_mod;
+		record->obj = obj_value;
+		record->inf_pr = inf_pr;
+		record->inf_du = inf_du;
+		record->mu = mu;
+		record->d_norm = d_norm;
+		record->regularization_size = regularization_size;
+		record->alpha_du = alpha_du;
+		record->alpha_pr = alpha_pr;
+	}
+	/* a full disk ends the log, not the solve; solve() warns */
+	if (myowndata->iterlog)
+		iterlog_commit(myowndata->iterlog, iter_count, obj_value);
+	if (myowndata->limits.x)
+	{
+		SolveLimits *limits = &myowndata->limits;
+		memcpy(limits->x, limits->pending, sizeof(Number) * limits->n);
+		limits->obj = obj_value;
+		limits->have_x = 1;
+		if (out_of_limits(myowndata, monotonic_time())) return FALSE;
+	}
+
+	if (myowndata->intermediate_python == NULL ||
+	    iter_count % myowndata->intermediate_every != 0)
+		return TRUE;
+
+	logger("[Callback:E] intermediate");
+	PyGILState_STATE gstate = PyGILState_Ensure();
+	report = Py_BuildValue("(iiddddddddi)", alg_mod, iter_count,
+			       obj_value, inf_pr, inf_du, mu, d_norm,
+			       regularization_size, alpha_du, alpha_pr, 
+			       ls_trials);
+	if (!report) ERROR;
+	arglist = build_args(myowndata, PyTuple_GET_SIZE(report), 
+			     &PyTuple_GET_ITEM(report, 0), TRUE);
+	if (!arglist) ERROR;
+	result = PyObject_Call(myowndata->intermediate_python, arglist,
+				myowndata->params_kw);
+	if (!result) ERROR;
+	/* None, like a hook without a return statement, goes on */
+	r = result == Py_None || PyObject_IsTrue(result) != 0;
+	if (PyErr_Occurred()) r = FALSE;
+error:
+	save_python_exception(myowndata);
+	Py_XDECREF(report);
+	Py_XDECREF(arglist);
+	Py_XDECREF(result);
+	logger("[Callback:R] intermediate");
+	PyGILState_Release(gstate);
+	return r;
+}
+
+/* Statistics
 
+   Ipopt calls the wrappers below, which count every call and time it with
+   the monotonic clock around the dispatchers above. That is two clock
+   reads per callback, a few tens of nanoseconds, and one store into the
+   timeline when it is on. */
+
+/* Allocation counts
+
+   numpy reports every data buffer it allocates to one process-wide hook.
+   While a callback of a problem solved with memory=True runs, the wrapper
+   points this thread's current_allocs at that callback's counters, so
+   arrays other threads make meanwhile go uncounted. Freed buffers aren't
+   subtracted: the counts are of what was asked for. */
+
+static __thread AllocStats *current_allocs;
+static PyDataMem_EventHookFunc *previous_hook;
+static void *previous_hook_data;
+static int hook_installed;
+
+static void count_allocation(void *inp, void *outp, size_t size, 
+			     void *user_data)
+{
+	AllocStats *allocs = current_allocs;
+	/* outp is NULL for a free */
+	if (allocs && outp)
+	{
+		allocs->count++;
+		allocs->bytes += size;
+	}
+	if (previous_hook) previous_hook(inp, outp, size, previous_hook_data);
+}
+
+/* Install the hook, once; needs the GIL */
+void track_allocations(void)
+{
+	if (hook_installed) return;
+	previous_hook = PyDataMem_SetEventHook(&count_allocation, NULL,
+					       &previous_hook_data);
+	hook_installed = 1;
+}
+
+static AllocStats *enter_allocs(DispatchData *myowndata, int kind)
+{
+	AllocStats *outer = current_allocs;
+	if (myowndata->track_memory) current_allocs = &myowndata->allocs[kind];
+	return outer;
+}
+
+double monotonic_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+void record_call(DispatchData *data, int kind, double start, int new_x,
+		 int structure)
+{
+	double end = monotonic_time(), t = end - start;
+	Timeline *timeline = &data->timeline;
+	TimelineEvent *event;
+
+	if (kind < NSTATS)
+	{
+		CallStats *stats = &data->stats[kind];
+		stats->calls++;
+		if (new_x) stats->new_x++;
+		if (structure) stats->structure++;
+		stats->time += t;
+		if (t > stats->max_time) stats->max_time = t;
+	}
+	if (timeline->events == NULL) return;
+	event = &timeline->events[timeline->count++ % timeline->capacity];
+	event->start = start;
+	event->end = end;
+	event->kind = kind;
+	event->flags = (new_x ? EVENT_NEW_X : 0) | 
+		(structure ? EVENT_STRUCTURE : 0);
+}
+
+Bool eval_f(Index n, Number* x, Bool new_x,
+            Number* obj_value, UserDataPtr data)
+{
+	DispatchData *myowndata = (DispatchData*) data;
+	double start = monotonic_time();
+	if (refuse_call(myowndata, start)) return FALSE;
+	AllocStats *outer = enter_allocs(myowndata, STAT_F);
+	Bool r = dispatch_f(n, x, new_x, obj_value, data);
+	current_allocs = outer;
+	record_call(myowndata, STAT_F, start, new_x, FALSE);
+	return r;
+}
+
+Bool eval_grad_f(Index n, Number* x, Bool new_x,
+                 Number* grad_f, UserDataPtr data)
+{
+	DispatchData *myowndata = (DispatchData*) data;
+	double start = monotonic_time();
+	if (refuse_call(myowndata, start)) return FALSE;
+	AllocStats *outer = enter_allocs(myowndata, STAT_GRAD_F);
+	Bool r = dispatch_grad_f(n, x, new_x, grad_f, data);
+	current_allocs = outer;
+	record_call(myowndata, STAT_GRAD_F, start, new_x, FALSE);
+	if (r && myowndata->iterlog) iterlog_set_x(myowndata->iterlog, x);
+	if (r && myowndata->limits.pending)
+		memcpy(myowndata->limits.pending, x, sizeof(Number) * n);
+	return r;
+}
+
+Bool eval_g(Index n, Number* x, Bool new_x,
+            Index m, Number* g, UserDataPtr data)
+{
+	DispatchData *myowndata = (DispatchData*) data;
+	double start = monotonic_time();
+	if (refuse_call(myowndata, start)) return FALSE;
+	AllocStats *outer = enter_allocs(myowndata, STAT_G);
+	Bool r = dispatch_g(n, x, new_x, m, g, data);
+	current_allocs = outer;
+	record_call(myowndata, STAT_G, start, new_x, FALSE);
+	return r;
+}
+
+Bool eval_jac_g(Index n, Number *x, Bool new_x,
+                Index m, Index nele_jac,
+                Index *iRow, Index *jCol, Number *values,
+                UserDataPtr data)
+{
+	DispatchData *myowndata = (DispatchData*) data;
+	double start = monotonic_time();
+	if (values && refuse_call(myowndata, start)) return FALSE;
+	AllocStats *outer = enter_allocs(myowndata, STAT_JAC_G);
+	Bool r = dispatch_jac_g(n, x, new_x, m, nele_jac, iRow, jCol, values,
+				data);
+	current_allocs = outer;
+	record_call(myowndata, STAT_JAC_G, start, new_x, 
+		  values == NULL);
+	if (r && values && myowndata->iterlog) 
+		iterlog_set_x(myowndata->iterlog, x);
+	if (r && values && myowndata->limits.pending)
+		memcpy(myowndata->limits.pending, x, sizeof(Number) * n);
+	return r;
+}
+
+Bool eval_h(Index n, Number *x, Bool new_x, Number obj_factor,
+            Index m, Number *lambda, Bool new_lambda,
+            Index nele_hess, Index *iRow, Index *jCol,
+            Number *values, UserDataPtr data)
+{
+	DispatchData *myowndata = (DispatchData*) data;
+	double start = monotonic_time();
+	if (values && refuse_call(myowndata, start)) return FALSE;
+	AllocStats *outer = enter_allocs(myowndata, STAT_H);
+	Bool r = dispatch_h(n, x, new_x, obj_factor, m, lambda, new_lambda,
+			    nele_hess, iRow, jCol, values, data);
+	current_allocs = outer;
+	record_call(myowndata, STAT_H, start, new_x, values == NULL);
+	/* the Hessian comes after the iterate was reported */
+	if (r && values && myowndata->iterlog) 
+		iterlog_set_multipliers(myowndata->iterlog, lambda);
+	return r;
+}
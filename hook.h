@@ -1,6 +1,9 @@
 #include "Python.h"
 #include "IpStdCInterface.h"
 #include <stdio.h>
+/* One numpy C-API table for the whole module; pyipopt.c imports it and
+   callback.c only defines NO_IMPORT_ARRAY */
+#define PY_ARRAY_UNIQUE_SYMBOL pyipopt_ARRAY_API
 #include "numpy/arrayobject.h"       /* NumPy header */
 
 #ifndef PY_IPOPT_HOOK
@@ -25,6 +28,135 @@
             Index nele_hess, Index *iRow, Index *jCol,
             Number *values, UserDataPtr user_data);
 
+ Bool intermediate_cb(Index alg_mod, Index iter_count, Number obj_value,
+            Number inf_pr, Number inf_du, Number mu, Number d_norm,
+            Number regularization_size, Number alpha_du, Number alpha_pr,
+            Index ls_trials, UserDataPtr user_data);
+
+/* A set of C callbacks that replaces the Python ones; the dispatchers in
+   callback.c hand calls straight through without taking the GIL. Any of
+   them may be NULL. free_user_data, if set, releases user_data along with
+   the problem. owner holds whatever Python objects (capsules, ctypes
+   function pointers) the addresses came from, so they stay alive. */
+typedef struct {
+	Eval_F_CB eval_f;
+	Eval_Grad_F_CB eval_grad_f;
+	Eval_G_CB eval_g;
+	Eval_Jac_G_CB eval_jac_g;
+	Eval_H_CB eval_h;
+	UserDataPtr user_data;
+	void (*free_user_data)(UserDataPtr);
+	PyObject *owner;
+} NativeCallbacks;
+
+struct NLModel;
+struct ThreadPool;
+
+/* Counters for one callback, or for IpoptSolve itself, see stats() in
+   pyipopt.c */
+typedef struct {
+	long calls;
+	long new_x;		/* calls with new_x set */
+	long structure;		/* structure calls rather than value calls */
+	double time, max_time;	/* wall clock seconds */
+	long long bytes;	/* copied into Ipopt's buffers */
+} CallStats;
+
+#define STAT_F		0
+#define STAT_GRAD_F	1
+#define STAT_G		2
+#define STAT_JAC_G	3
+#define STAT_H		4
+#define STAT_SOLVE	5
+#define NSTATS		6
+
+/* solve(memory=True): numpy buffers allocated while each callback ran,
+   counted by a numpy allocation hook, see callback.c */
+typedef struct {
+	long count;
+	long long bytes;
+} AllocStats;
+
+/* The timeline: when enabled (problem.timeline()), every call counted in
+   the stats and every apply_new and eval_all call also leaves an event in
+   a ring buffer allocated up front, which keeps the latest capacity of
+   them. Kinds are the STAT_* and these. */
+#define EVENT_APPLY_NEW	NSTATS
+#define EVENT_EVAL_ALL	(NSTATS + 1)
+#define NEVENTS		(NSTATS + 2)
+
+#define EVENT_NEW_X	1
+#define EVENT_STRUCTURE	2
+
+typedef struct {
+	double start, end;	/* monotonic seconds */
+	int kind;
+	int flags;		/* EVENT_NEW_X, EVENT_STRUCTURE */
+} TimelineEvent;
+
+typedef struct {
+	TimelineEvent *events;	/* NULL when off */
+	long capacity;
+	long count;		/* recorded in all, kept or not */
+} Timeline;
+
+/* A run of constraint rows [row_start, row_end) and the matching Jacobian
+   nonzeros [nz_start, nz_end) with its own C evaluators, see add_block in
+   pyipopt.c. They only see their slice: m is the number of rows in the
+   block, g and values point at its first row and nonzero, and the
+   structure call gives rows counted from row_start. */
+typedef struct {
+	Index row_start, row_end;
+	Index nz_start, nz_end;
+	Eval_G_CB eval_g;
+	Eval_Jac_G_CB eval_jac_g;
+	UserDataPtr user_data;
+} ConstraintBlock;
+
+/* One iteration as Ipopt reports it to the intermediate callback */
+typedef struct {
+	Index iter, ls_trials, alg_mod;
+	Number obj, inf_pr, inf_du, mu, d_norm, regularization_size;
+	Number alpha_du, alpha_pr;
+} IterRecord;
+
+/* The iterations of the last solve; the buffer is kept from one solve to
+   the next and only grows when a solve runs longer than any before */
+typedef struct {
+	IterRecord *records;
+	long count, capacity;
+} IterHistory;
+
+/* solve(deadline=, max_evals=), enforced without Python: once either
+   runs out the eval_* wrappers refuse to evaluate and intermediate_cb
+   stops the solve. x is the last accepted iterate, copied like the
+   iterate log's from the last gradient or Jacobian evaluation. */
+typedef struct {
+	double deadline;	/* monotonic seconds, 0 for none */
+	long max_evals;		/* 0 for none */
+	long evals;		/* value calls so far */
+	int stop;		/* STOP_DEADLINE or STOP_BUDGET once out */
+	Index n;
+	Number *x, *pending;	/* NULL without limits */
+	Number obj;
+	int have_x;
+} SolveLimits;
+
+#define STOP_DEADLINE	1
+#define STOP_BUDGET	2
+
+/* Where each stored value of a scipy.sparse result goes in Ipopt's
+   triplet order, see callback.c. coords has the rows then the columns
+   of the pattern target was worked out for, scratch the same for the
+   result at hand */
+typedef struct {
+	int format;
+	npy_intp nnz;
+	npy_intp *target;
+	npy_intp *coords;
+	npy_intp *scratch;
+} SparseMap;
+
 typedef struct {
 	PyObject *eval_f_python;
 	PyObject *eval_grad_f_python; 
@@ -33,8 +165,89 @@ typedef struct {
 	PyObject *eval_h_python;
 	PyObject *apply_new_python;
 	PyObject* userdata;
+	/* problem.params, and {"params": params} for the keyword arguments
+	   of every Python call; both NULL when it isn't set */
+	PyObject *params;
+	PyObject *params_kw;
+	/* Exception raised by a callback during the current solve, kept per
+	   problem so that concurrent solves cannot clobber each other. */
+	PyObject *exctype, *excval, *exctb;
+	/* Persistent views over Ipopt's buffers and prebuilt argument
+	   tuples, owned here and rebound on every call (see callback.c) */
+	PyArrayObject *arrayx;
+	PyArrayObject *arraylambda;
+	PyObject *args_x;
+	PyObject *args_jac;
+	PyObject *args_h;
+	PyObject *args_new_x;
+	/* inplace=True: eval_grad_f, eval_g, eval_jac_g and eval_h get a
+	   writable view over Ipopt's result buffer as an extra argument */
+	int inplace;
+	PyArrayObject *arraygradf;
+	PyArrayObject *arrayg;
+	PyArrayObject *arrayjac;
+	PyArrayObject *arrayh;
+	PyObject *args_grad_f;
+	PyObject *args_g;
+	/* eval_all(x, need) and the results it returned for cache_x; 
+	   cache_valid holds the NEED_* bits that are up to date */
+	PyObject *eval_all_python;
+	Index m, nele_jac;
+	Number *cache_x;
+	Number cache_f;
+	Number *cache_grad_f;
+	Number *cache_g;
+	Number *cache_jac;
+	int cache_valid;
+	/* sparsity structures, rows then columns, see convert_structure */
+	Index *jac_structure;
+	Index *hess_structure;
+	SparseMap jac_sparse;
+	SparseMap hess_sparse;
+	NativeCallbacks native;
+	CallStats stats[NSTATS];
+	int track_memory;
+	AllocStats allocs[NSTATS];
+	Timeline timeline;
+	/* intermediate(callback, every): called on every every-th iteration */
+	IterHistory history;
+	PyObject *intermediate_python;
+	int intermediate_every;
+	/* with blocks, eval_g and eval_jac_g run them all on the pool (made
+	   with threads threads on first use) and nothing else */
+	ConstraintBlock *blocks;
+	int nblocks;
+	int threads;
+	struct ThreadPool *pool;
+	/* solve(log=path): x of the last gradient or Jacobian evaluation is
+	   the accepted iterate when Ipopt reports it, see intermediate_cb */
+	struct IterLog *iterlog;
+	SolveLimits limits;
+	/* what the IpoptProblem is made from, so that set_bounds() can make
+	   it again: the bounds, and the options set so far by name */
+	Number *x_L, *x_U, *g_L, *g_U;
+	Index nele_hess;
+	PyObject *options;
+	/* set for problems made by create_from_nl, also native.user_data */
+	struct NLModel *nl;
 } DispatchData;
 
+/* what eval_all is asked to compute */
+#define NEED_F		1
+#define NEED_GRAD_F	2
+#define NEED_G		4
+#define NEED_JAC_G	8
+
+double monotonic_time(void);
+void record_call(DispatchData *data, int kind, double start, int new_x,
+		 int structure);
+void reset_dispatch_args(DispatchData *data);
+void clear_dispatch_data(DispatchData *data);
+size_t dispatch_data_bytes(const DispatchData *data, Index n);
+void track_allocations(void);
+Index *convert_structure(PyObject *pair, Index nele, Index nrows, Index ncols,
+			 const char *who);
+
 // DispatchData myowndata;
 
 // static IpoptProblem nlp = NULL;             /* IpoptProblem */
@@ -45,14 +258,34 @@ __attribute__ ((format (printf, 1, 2)))
 void logger(const char* fmt, ...);
 
 
-typedef struct {
+typedef struct problem {
 	PyObject_HEAD
 	IpoptProblem nlp;
 	DispatchData* data;
 	Index n,m;
+	int in_solve;
+	/* nl_eval_batch() calls reading the model without the GIL */
+	int in_batch;
+	/* every problem alive, see live_problems() in pyipopt.c */
+	struct problem *live_prev, *live_next;
 } problem;
 
+/* What solve(out=) writes into instead of a new dict, see problem.result()
+   in pyipopt.c. The arrays are Ipopt's output buffers. */
+typedef struct {
+	PyObject_HEAD
+	PyArrayObject *x, *mult_xL, *mult_xU, *mult_g, *g;
+	double f;
+	const char *status;	/* NULL before the first solve */
+	PyObject *memory;	/* from solve(memory=True), or NULL */
+} result;
+
+
+void save_python_exception(DispatchData *data);
+int restore_python_exception(DispatchData *data);
 
-void save_python_exception(void);
+/* pyipopt.trace, see trace.c */
+int init_tracer(void);
+PyObject *trace_model(PyObject *self, PyObject *args, PyObject *keywds);
 
 #endif
@@ -0,0 +1,244 @@
+/* Copyright (c) 2008, Eric You Xu, Washington University
+* All rights reserved.
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the Washington University nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS "AS IS" AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// This file has the on-disk iterate log behind solve(log=...)
+/* The file is mapped shared and grown by doubling, so x goes straight
+   from Ipopt's buffer into the page cache with one copy and the kernel
+   writes it back in its own time; nothing is held in memory beyond the
+   pages being written. The record after the last complete one is the
+   one being formed: iterlog_set_x fills its x and iterlog_commit adds the
+   rest and bumps the count in the header. */
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "iterlog.h"
+
+struct IterLog {
+	int fd;
+	char *map;
+	size_t map_size;
+	long n, m;
+	long long record_size;
+	long capacity;		/* records the file has room for */
+	int multipliers;
+	int failed;		/* errno of the failure that stopped the log */
+};
+
+#define HEADER(log)	((IterLogHeader*) (log)->map)
+#define RECORD(log, k)	((log)->map + sizeof(IterLogHeader) + \
+			 (size_t) (k) * (log)->record_size)
+
+/* Room for capacity records; the mapping moves. The blocks are reserved
+   up front: a sparse file would only fail, with SIGBUS, when a callback
+   writes into the mapping on a full disk */
+static int grow(IterLog *log, long capacity)
+{
+	size_t size = sizeof(IterLogHeader) + 
+		(size_t) capacity * log->record_size;
+	char *map;
+	int rc;
+
+	rc = posix_fallocate(log->fd, log->map_size, size - log->map_size);
+	if (rc == EINVAL || rc == EOPNOTSUPP)
+		rc = ftruncate(log->fd, size) != 0 ? errno : 0;
+	if (rc != 0)
+	{
+		log->failed = errno = rc;
+		return -1;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+	if (map == MAP_FAILED) return -1;
+	if (log->map) munmap(log->map, log->map_size);
+	log->map = map;
+	log->map_size = size;
+	log->capacity = capacity;
+	return 0;
+}
+
+IterLog *iterlog_open(const char *path, long n, long m, int multipliers,
+		      char *err, size_t errlen)
+{
+	IterLog *log = calloc(1, sizeof(IterLog));
+	IterLogHeader *header;
+
+	if (!log)
+	{
+		snprintf(err, errlen, "out of memory");
+		return NULL;
+	}
+	log->n = n;
+	log->m = multipliers ? m : 0;
+	log->multipliers = multipliers;
+	log->record_size = 2 * 8 + 8 * (long long) (log->n + log->m);
+	log->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (log->fd < 0 || grow(log, 16) != 0)
+	{
+		snprintf(err, errlen, "cannot write %s: %s", path, 
+			 strerror(errno));
+		if (log->fd >= 0) close(log->fd);
+		free(log);
+		return NULL;
+	}
+	header = HEADER(log);
+	memcpy(header->magic, ITERLOG_MAGIC, 8);
+	header->version = 1;
+	header->header_size = sizeof(IterLogHeader);
+	header->n = n;
+	header->m = log->m;
+	header->record_size = log->record_size;
+	header->count = 0;
+	header->flags = multipliers ? ITERLOG_MULTIPLIERS : 0;
+	return log;
+}
+
+void iterlog_set_x(IterLog *log, const double *x)
+{
+	if (log->failed) return;
+	memcpy(RECORD(log, HEADER(log)->count) + 16, x, 8 * log->n);
+}
+
+int iterlog_commit(IterLog *log, long iter, double obj)
+{
+	IterLogHeader *header;
+	char *record;
+	long k;
+
+	if (log->failed) return -1;
+	header = HEADER(log);
+	record = RECORD(log, header->count);
+	*(long long*) record = iter;
+	*(double*) (record + 8) = obj;
+	for (k = 0; k < log->m; k++)
+		((double*) (record + 16))[log->n + k] = NAN;
+	header->count++;
+	/* keep room for the next record to be formed in */
+	if (header->count == log->capacity && 
+	    grow(log, 2 * log->capacity) != 0)
+	{
+		log->failed = errno ? errno : ENOSPC;
+		return -1;
+	}
+	return 0;
+}
+
+void iterlog_set_multipliers(IterLog *log, const double *lambda)
+{
+	long long count;
+
+	if (!log->multipliers || log->failed) return;
+	count = HEADER(log)->count;
+	if (count == 0) return;
+	memcpy(RECORD(log, count - 1) + 16 + 8 * log->n, lambda, 8 * log->m);
+}
+
+long iterlog_count(const IterLog *log)
+{
+	return HEADER(log)->count;
+}
+
+int iterlog_close(IterLog *log, char *err, size_t errlen)
+{
+	int r = 0;
+	size_t size = sizeof(IterLogHeader) + 
+		(size_t) HEADER(log)->count * log->record_size;
+
+	if (log->failed)
+	{
+		snprintf(err, errlen, "the iterate log stopped after %lld records: %s",
+			 HEADER(log)->count, strerror(log->failed));
+		r = -1;
+	}
+	munmap(log->map, log->map_size);
+	if (ftruncate(log->fd, size) != 0 && r == 0)
+	{
+		snprintf(err, errlen, "cannot truncate the iterate log: %s",
+			 strerror(errno));
+		r = -1;
+	}
+	close(log->fd);
+	free(log);
+	return r;
+}
+
+void *iterlog_map(const char *path, IterLogHeader *header, size_t *size,
+		  char *err, size_t errlen)
+{
+	struct stat st;
+	void *map;
+	long long room;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		snprintf(err, errlen, "cannot read %s: %s", path, strerror(errno));
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+	if ((size_t) st.st_size < sizeof(IterLogHeader))
+	{
+		snprintf(err, errlen, "%s is not an iterate log", path);
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		snprintf(err, errlen, "cannot map %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	memcpy(header, map, sizeof(IterLogHeader));
+	if (memcmp(header->magic, ITERLOG_MAGIC, 8) != 0 || 
+	    header->version != 1 ||
+	    header->header_size != sizeof(IterLogHeader) ||
+	    header->n < 0 || header->m < 0 ||
+	    header->record_size != 2 * 8 + 8 * (header->n + header->m) ||
+	    header->count < 0)
+	{
+		snprintf(err, errlen, "%s is not an iterate log", path);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	/* a writer may have died before cutting the file to size, or the
+	   file may have been cut short */
+	room = (st.st_size - sizeof(IterLogHeader)) / header->record_size;
+	if (header->count > room) header->count = room;
+	*size = st.st_size;
+	return map;
+}
+
+void iterlog_unmap(void *map, size_t size)
+{
+	munmap(map, size);
+}
@@ -0,0 +1,89 @@
+/* Copyright (c) 2008, Eric You Xu, Washington University
+* All rights reserved.
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the Washington University nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS "AS IS" AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* An append-only log of iterates in a memory-mapped file, see iterlog.c.
+   Nothing in here touches Python. */
+
+#ifndef PY_IPOPT_ITERLOG
+#define PY_IPOPT_ITERLOG
+
+#include <stddef.h>
+
+#define ITERLOG_MAGIC	"PYIPLOG1"
+
+/* The file starts with this header and the records follow. A record is
+   the iteration number (a long long), the objective and then the n
+   entries of x and, with ITERLOG_MULTIPLIERS, the m constraint
+   multipliers, all doubles. record_size is in bytes and count only moves
+   on once a record is complete, so a file cut short by a crash still
+   reads back as everything up to the last whole iteration. */
+typedef struct {
+	char magic[8];
+	int version;
+	int header_size;
+	long long n, m;
+	long long record_size;
+	long long count;
+	long long flags;
+	long long reserved;
+} IterLogHeader;
+
+#define ITERLOG_MULTIPLIERS	1
+
+typedef struct IterLog IterLog;
+
+/* Create (or truncate) path for iterates of n variables and m
+   constraints. Returns NULL with a message in err on failure. */
+IterLog *iterlog_open(const char *path, long n, long m, int multipliers,
+		      char *err, size_t errlen);
+
+/* x of the iterate being formed; the last one given before
+   iterlog_commit is what goes into the record */
+void iterlog_set_x(IterLog *log, const double *x);
+
+/* Complete the record with its iteration number and objective. Returns
+   0, or -1 when the file can't grow, after which the log takes no more
+   records and iterlog_close reports the error. */
+int iterlog_commit(IterLog *log, long iter, double obj);
+
+/* Constraint multipliers of the last complete record, which start out
+   as NaN. Nothing happens without ITERLOG_MULTIPLIERS. */
+void iterlog_set_multipliers(IterLog *log, const double *lambda);
+
+long iterlog_count(const IterLog *log);
+
+/* Cut the file to its records and unmap it. Returns 0, or -1 with a
+   message in err if a record was lost along the way. */
+int iterlog_close(IterLog *log, char *err, size_t errlen);
+
+/* Map a log read-only. Returns the mapping, whose size is in *size, with
+   *header checked and count reduced to the records actually in the file,
+   or NULL with a message in err. Release it with iterlog_unmap. */
+void *iterlog_map(const char *path, IterLogHeader *header, size_t *size,
+		  char *err, size_t errlen);
+void iterlog_unmap(void *map, size_t size);
+
+#endif
@@ -0,0 +1,615 @@
+/* Copyright (c) 2008, Eric You Xu, Washington University
+* All rights reserved.
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the Washington University nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS "AS IS" AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// This file compiles AMPL .nl models to native code
+/* nl_compile() writes C source with four straight-line functions for every
+   expression: values, adjoints, tangents and second order adjoints, i.e.
+   the passes nlmodel.c otherwise interprets node by node. It builds that
+   into a shared object with the system compiler ($CC, or cc) and loads it.
+   Objects are kept in a cache directory under a hash of their source, so
+   a model is only compiled the first time it is seen. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dlfcn.h>
+#include "nlmodel.h"
+
+typedef struct {
+	char *p;
+	size_t len, cap;
+	int failed;
+} Source;
+
+#ifdef __GNUC__
+__attribute__ ((format (printf, 2, 3)))
+#endif
+static void emit(Source *s, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+	if (s->failed) return;
+	for (;;)
+	{
+		va_start(ap, fmt);
+		len = vsnprintf(s->p + s->len, s->cap - s->len, fmt, ap);
+		va_end(ap);
+		if (len >= 0 && s->len + len < s->cap) break;
+		s->cap = s->cap ? 2 * s->cap : 65536;
+		if (!(s->p = (char*) realloc(s->p, s->cap)))
+		{
+			s->failed = 1;
+			return;
+		}
+	}
+	s->len += len;
+}
+
+static const char *number(double c, char *buf)
+{
+	if (isnan(c)) return "(0.0/0.0)";
+	if (isinf(c)) return c > 0 ? "(1.0/0.0)" : "(-1.0/0.0)";
+	sprintf(buf, "%.17g", c);
+	return buf;
+}
+
+static const char *function_name(int op)
+{
+	switch (op)
+	{
+	case OP_FLOOR: return "floor";
+	case OP_CEIL: return "ceil";
+	case OP_ABS: return "fabs";
+	case OP_TANH: return "tanh";
+	case OP_TAN: return "tan";
+	case OP_SQRT: return "sqrt";
+	case OP_SINH: return "sinh";
+	case OP_SIN: return "sin";
+	case OP_LOG10: return "log10";
+	case OP_LOG: return "log";
+	case OP_EXP: return "exp";
+	case OP_COSH: return "cosh";
+	case OP_COS: return "cos";
+	case OP_ATANH: return "atanh";
+	case OP_ATAN: return "atan";
+	case OP_ASINH: return "asinh";
+	case OP_ASIN: return "asin";
+	case OP_ACOSH: return "acosh";
+	case OP_ACOS: return "acos";
+	case OP_REM: return "fmod";
+	case OP_POW: case OP_POW_CONST_EXP: case OP_POW_CONST_BASE:
+		return "pow";
+	case OP_ATAN2: return "atan2";
+	}
+	return NULL;
+}
+
+/* Generated code section */
+
+/* ld() of the generated code is local_derivs() of nlmodel.c; the two
+   must agree */
+static const char prelude[] =
+"#include <math.h>\n"
+"#ifndef M_LN10\n"
+"#define M_LN10 2.30258509299404568402\n"
+"#endif\n"
+"#ifdef __GNUC__\n"
+"__attribute__ ((always_inline))\n"
+"#endif\n"
+"static inline void ld(int op, double a, double b, double r, double *d)\n"
+"{\n"
+"	double s, t;\n"
+"	d[0] = d[1] = d[2] = d[3] = d[4] = 0.;\n"
+"	switch (op)\n"
+"	{\n"
+"	case OP_PLUS: d[0] = 1.; d[1] = 1.; break;\n"
+"	case OP_MINUS: d[0] = 1.; d[1] = -1.; break;\n"
+"	case OP_MULT: d[0] = b; d[1] = a; d[3] = 1.; break;\n"
+"	case OP_DIV:\n"
+"		d[0] = 1. / b; d[1] = -a / (b * b);\n"
+"		d[3] = -1. / (b * b); d[4] = 2. * a / (b * b * b);\n"
+"		break;\n"
+"	case OP_REM: d[0] = 1.; d[1] = -trunc(a / b); break;\n"
+"	case OP_POW: case OP_POW_CONST_EXP: case OP_POW_CONST_BASE:\n"
+"		if (b != 0.) d[0] = b * pow(a, b - 1.);\n"
+"		if (b != 0. && b != 1.) d[2] = b * (b - 1.) * pow(a, b - 2.);\n"
+"		if (a > 0.)\n"
+"		{\n"
+"			t = log(a);\n"
+"			d[1] = t * r; d[3] = pow(a, b - 1.) * (1. + b * t);\n"
+"			d[4] = t * t * r;\n"
+"		}\n"
+"		break;\n"
+"	case OP_POW2: d[0] = 2. * a; d[2] = 2.; break;\n"
+"	case OP_ABS: d[0] = a < 0. ? -1. : 1.; break;\n"
+"	case OP_NEG: d[0] = -1.; break;\n"
+"	case OP_TANH: d[0] = 1. - r * r; d[2] = -2. * r * d[0]; break;\n"
+"	case OP_TAN: d[0] = 1. + r * r; d[2] = 2. * r * d[0]; break;\n"
+"	case OP_SQRT: d[0] = .5 / r; d[2] = -.25 / (r * r * r); break;\n"
+"	case OP_SINH: d[0] = cosh(a); d[2] = r; break;\n"
+"	case OP_SIN: d[0] = cos(a); d[2] = -r; break;\n"
+"	case OP_LOG10: d[0] = 1. / (a * M_LN10); d[2] = -d[0] / a; break;\n"
+"	case OP_LOG: d[0] = 1. / a; d[2] = -1. / (a * a); break;\n"
+"	case OP_EXP: d[0] = r; d[2] = r; break;\n"
+"	case OP_COSH: d[0] = sinh(a); d[2] = r; break;\n"
+"	case OP_COS: d[0] = -sin(a); d[2] = -r; break;\n"
+"	case OP_ATANH: d[0] = 1. / (1. - a * a); d[2] = 2. * a * d[0] * d[0]; break;\n"
+"	case OP_ATAN2:\n"
+"		s = a * a + b * b;\n"
+"		d[0] = b / s; d[1] = -a / s;\n"
+"		d[2] = -2. * a * b / (s * s); d[3] = (a * a - b * b) / (s * s);\n"
+"		d[4] = 2. * a * b / (s * s);\n"
+"		break;\n"
+"	case OP_ATAN: d[0] = 1. / (1. + a * a); d[2] = -2. * a * d[0] * d[0]; break;\n"
+"	case OP_ASINH: d[0] = 1. / sqrt(a * a + 1.); d[2] = -a * d[0] * d[0] * d[0]; break;\n"
+"	case OP_ASIN: d[0] = 1. / sqrt(1. - a * a); d[2] = a * d[0] * d[0] * d[0]; break;\n"
+"	case OP_ACOSH: d[0] = 1. / sqrt(a * a - 1.); d[2] = -a * d[0] * d[0] * d[0]; break;\n"
+"	case OP_ACOS:\n"
+"		t = 1. / sqrt(1. - a * a);\n"
+"		d[0] = -t; d[2] = -a * t * t * t;\n"
+"		break;\n"
+"	}\n"
+"}\n";
+
+#define OPCODE(op) { #op, op }
+static const struct { const char *name; int op; } opcodes[] = {
+	OPCODE(OP_PLUS), OPCODE(OP_MINUS), OPCODE(OP_MULT), OPCODE(OP_DIV),
+	OPCODE(OP_REM), OPCODE(OP_POW), OPCODE(OP_POW2), OPCODE(OP_ABS),
+	OPCODE(OP_NEG), OPCODE(OP_TANH), OPCODE(OP_TAN), OPCODE(OP_SQRT),
+	OPCODE(OP_SINH), OPCODE(OP_SIN), OPCODE(OP_LOG10), OPCODE(OP_LOG),
+	OPCODE(OP_EXP), OPCODE(OP_COSH), OPCODE(OP_COS), OPCODE(OP_ATANH),
+	OPCODE(OP_ATAN2), OPCODE(OP_ATAN), OPCODE(OP_ASINH), OPCODE(OP_ASIN),
+	OPCODE(OP_ACOSH), OPCODE(OP_ACOS), OPCODE(OP_POW_CONST_EXP),
+	OPCODE(OP_POW_CONST_BASE)
+};
+#undef OPCODE
+
+/* The operand a min or max picks, as selected_operand() does: a chain of
+   tests that sets o */
+static void emit_select(Source *s, const NLModel *model, const NLNode *node,
+			int i)
+{
+	int k;
+	for (k = 0; k < node->b; k++)
+		emit(s, "\t%sif (v[%d] == v[%d]) o = %d;\n", k ? "else " : "",
+		     model->args[node->a + k], i, model->args[node->a + k]);
+	emit(s, "\telse o = %d;\n", model->args[node->a]);
+}
+
+/* ld() for a unary or binary node into d */
+static void emit_derivs(Source *s, const NLNode *node, int i)
+{
+	if (nl_arity(node->op) == 2)
+		emit(s, "\tld(%d, v[%d], v[%d], v[%d], d);\n",
+		     node->op, node->a, node->b, i);
+	else
+		emit(s, "\tld(%d, v[%d], 0., v[%d], d);\n", node->op, node->a, i);
+}
+
+static void emit_forward(Source *s, const NLModel *model, int e)
+{
+	const NLNode *node;
+	const char *name;
+	char buf[32];
+	int i, k;
+
+	emit(s, "static void f%d(const double *x, const double *dv, double *v)\n{\n", e);
+	for (i = model->expr_start[e]; i < model->expr_end[e]; i++)
+	{
+		node = &model->nodes[i];
+		switch (node->op)
+		{
+		case NL_NUM: emit(s, "\tv[%d] = %s;\n", i, number(node->c, buf)); break;
+		case NL_VAR: emit(s, "\tv[%d] = x[%d];\n", i, node->a); break;
+		case NL_DEFVAR: emit(s, "\tv[%d] = dv[%d];\n", i, node->a); break;
+		case OP_PLUS: emit(s, "\tv[%d] = v[%d] + v[%d];\n", i, node->a, node->b); break;
+		case OP_MINUS: emit(s, "\tv[%d] = v[%d] - v[%d];\n", i, node->a, node->b); break;
+		case OP_MULT: emit(s, "\tv[%d] = v[%d] * v[%d];\n", i, node->a, node->b); break;
+		case OP_DIV: emit(s, "\tv[%d] = v[%d] / v[%d];\n", i, node->a, node->b); break;
+		case OP_POW2: emit(s, "\tv[%d] = v[%d] * v[%d];\n", i, node->a, node->a); break;
+		case OP_NEG: emit(s, "\tv[%d] = -v[%d];\n", i, node->a); break;
+		case OP_SUM:
+			emit(s, "\tv[%d] = v[%d]", i, model->args[node->a]);
+			for (k = 1; k < node->b; k++)
+				emit(s, " + v[%d]", model->args[node->a + k]);
+			emit(s, ";\n");
+			break;
+		case OP_MIN: case OP_MAX:
+			emit(s, "\tv[%d] = v[%d];\n", i, model->args[node->a]);
+			for (k = 1; k < node->b; k++)
+				emit(s, "\tif (v[%d] %c v[%d]) v[%d] = v[%d];\n",
+				     model->args[node->a + k], node->op == OP_MIN ? '<' : '>',
+				     i, i, model->args[node->a + k]);
+			break;
+		default:
+			name = function_name(node->op);
+			if (nl_arity(node->op) == 2)
+				emit(s, "\tv[%d] = %s(v[%d], v[%d]);\n", i, name,
+				     node->a, node->b);
+			else
+				emit(s, "\tv[%d] = %s(v[%d]);\n", i, name, node->a);
+		}
+	}
+	emit(s, "}\n");
+}
+
+static void emit_reverse(Source *s, const NLModel *model, int e)
+{
+	const NLNode *node;
+	int i, k;
+
+	emit(s, "static void r%d(const double *v, double *adj, double *defadj, "
+	     "double *grad)\n{\n\tdouble d[5];\n\tint o;\n", e);
+	for (i = model->expr_end[e] - 1; i >= model->expr_start[e]; i--)
+	{
+		node = &model->nodes[i];
+		switch (node->op)
+		{
+		case NL_NUM: break;
+		case NL_VAR: emit(s, "\tgrad[%d] += adj[%d];\n", node->a, i); break;
+		case NL_DEFVAR: emit(s, "\tdefadj[%d] += adj[%d];\n", node->a, i); break;
+		case OP_SUM:
+			for (k = 0; k < node->b; k++)
+				emit(s, "\tadj[%d] += adj[%d];\n", model->args[node->a + k], i);
+			break;
+		case OP_MIN: case OP_MAX:
+			emit_select(s, model, node, i);
+			emit(s, "\tadj[o] += adj[%d];\n", i);
+			break;
+		default:
+			emit(s, "\tif (adj[%d] != 0.) {\n", i);
+			emit_derivs(s, node, i);
+			emit(s, "\tadj[%d] += adj[%d] * d[0];\n", node->a, i);
+			if (nl_arity(node->op) == 2)
+				emit(s, "\tadj[%d] += adj[%d] * d[1];\n", node->b, i);
+			emit(s, "\t}\n");
+		}
+	}
+	emit(s, "\t(void) d; (void) o;\n}\n");
+}
+
+static void emit_tangent(Source *s, const NLModel *model, int e)
+{
+	const NLNode *node;
+	int i, k;
+
+	emit(s, "static void t%d(const double *v, const double *defdot, "
+	     "double *dot, int k)\n{\n\tdouble d[5];\n\tint o;\n", e);
+	for (i = model->expr_start[e]; i < model->expr_end[e]; i++)
+	{
+		node = &model->nodes[i];
+		switch (node->op)
+		{
+		case NL_NUM: emit(s, "\tdot[%d] = 0.;\n", i); break;
+		case NL_VAR: emit(s, "\tdot[%d] = k == %d;\n", i, node->a); break;
+		case NL_DEFVAR: emit(s, "\tdot[%d] = defdot[%d];\n", i, node->a); break;
+		case OP_SUM:
+			emit(s, "\tdot[%d] = dot[%d]", i, model->args[node->a]);
+			for (k = 1; k < node->b; k++)
+				emit(s, " + dot[%d]", model->args[node->a + k]);
+			emit(s, ";\n");
+			break;
+		case OP_MIN: case OP_MAX:
+			emit_select(s, model, node, i);
+			emit(s, "\tdot[%d] = dot[o];\n", i);
+			break;
+		default:
+			emit_derivs(s, node, i);
+			if (nl_arity(node->op) == 2)
+				emit(s, "\tdot[%d] = d[0] * dot[%d] + d[1] * dot[%d];\n",
+				     i, node->a, node->b);
+			else
+				emit(s, "\tdot[%d] = d[0] * dot[%d];\n", i, node->a);
+		}
+	}
+	emit(s, "\t(void) d; (void) o; (void) k;\n}\n");
+}
+
+static void emit_hessian(Source *s, const NLModel *model, int e)
+{
+	const NLNode *node;
+	int i, k;
+
+	emit(s, "static void h%d(const double *v, const double *dot, "
+	     "double *adj, double *adjdot, double *defadj, double *defadjdot, "
+	     "double *hv)\n{\n\tdouble d[5], w, wd;\n\tint o;\n", e);
+	for (i = model->expr_end[e] - 1; i >= model->expr_start[e]; i--)
+	{
+		node = &model->nodes[i];
+		switch (node->op)
+		{
+		case NL_NUM: break;
+		case NL_VAR: emit(s, "\thv[%d] += adjdot[%d];\n", node->a, i); break;
+		case NL_DEFVAR:
+			emit(s, "\tdefadj[%d] += adj[%d];\n", node->a, i);
+			emit(s, "\tdefadjdot[%d] += adjdot[%d];\n", node->a, i);
+			break;
+		case OP_SUM:
+			for (k = 0; k < node->b; k++)
+			{
+				emit(s, "\tadj[%d] += adj[%d];\n", model->args[node->a + k], i);
+				emit(s, "\tadjdot[%d] += adjdot[%d];\n", model->args[node->a + k], i);
+			}
+			break;
+		case OP_MIN: case OP_MAX:
+			emit_select(s, model, node, i);
+			emit(s, "\tadj[o] += adj[%d];\n\tadjdot[o] += adjdot[%d];\n", i, i);
+			break;
+		default:
+			emit(s, "\tif (adj[%d] != 0. || adjdot[%d] != 0.) {\n", i, i);
+			emit(s, "\tw = adj[%d];\n\twd = adjdot[%d];\n", i, i);
+			emit_derivs(s, node, i);
+			if (nl_arity(node->op) == 2)
+			{
+				emit(s, "\tadj[%d] += w * d[0];\n", node->a);
+				emit(s, "\tadjdot[%d] += wd * d[0] + w * (d[2] * dot[%d] + "
+				     "d[3] * dot[%d]);\n", node->a, node->a, node->b);
+				emit(s, "\tadj[%d] += w * d[1];\n", node->b);
+				emit(s, "\tadjdot[%d] += wd * d[1] + w * (d[3] * dot[%d] + "
+				     "d[4] * dot[%d]);\n", node->b, node->a, node->b);
+			}
+			else
+			{
+				emit(s, "\tadj[%d] += w * d[0];\n", node->a);
+				emit(s, "\tadjdot[%d] += wd * d[0] + w * d[2] * dot[%d];\n",
+				     node->a, node->a);
+			}
+			emit(s, "\t}\n");
+		}
+	}
+	emit(s, "\t(void) d; (void) o; (void) w; (void) wd;\n}\n");
+}
+
+static void emit_table(Source *s, const NLModel *model, const char *type,
+		       const char *name, char prefix)
+{
+	int e;
+	emit(s, "%s *const nlc_%s[] = {", type, name);
+	for (e = 0; e < model->nexpr; e++)
+		emit(s, "%s%c%d", e == 0 ? "\n\t" : e % 8 ? ", " : ",\n\t",
+		     prefix, e);
+	emit(s, "\n};\n");
+}
+
+static void generate(Source *s, const NLModel *model)
+{
+	unsigned k;
+	int e;
+
+	emit(s, "/* generated by pyipopt from an AMPL .nl model */\n");
+	for (k = 0; k < sizeof(opcodes) / sizeof(opcodes[0]); k++)
+		emit(s, "#define %s %d\n", opcodes[k].name, opcodes[k].op);
+	emit(s, "%s", prelude);
+	emit(s, "typedef void NLForwardFn(const double *, const double *, double *);\n"
+	     "typedef void NLReverseFn(const double *, double *, double *, double *);\n"
+	     "typedef void NLTangentFn(const double *, const double *, double *, int);\n"
+	     "typedef void NLHessianFn(const double *, const double *, double *, "
+	     "double *, double *, double *, double *);\n");
+	for (e = 0; e < model->nexpr; e++)
+	{
+		emit_forward(s, model, e);
+		emit_reverse(s, model, e);
+		emit_tangent(s, model, e);
+		emit_hessian(s, model, e);
+	}
+	emit(s, "const int nlc_nexpr = %d, nlc_nnodes = %d;\n",
+	     model->nexpr, model->nnodes);
+	emit_table(s, model, "NLForwardFn", "forward", 'f');
+	emit_table(s, model, "NLReverseFn", "reverse", 'r');
+	emit_table(s, model, "NLTangentFn", "tangent", 't');
+	emit_table(s, model, "NLHessianFn", "hessian", 'h');
+}
+
+/* Cache section */
+
+/* FNV-1a */
+static unsigned long long hash(const char *p, size_t len)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < len; i++)
+	{
+		h ^= (unsigned char) p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* $PYIPOPT_CACHE, else $XDG_CACHE_HOME/pyipopt, else ~/.cache/pyipopt,
+   else /tmp/pyipopt-<uid> */
+static int default_cache_dir(char *dir, size_t len)
+{
+	const char *p;
+	if ((p = getenv("PYIPOPT_CACHE")) && *p)
+		return snprintf(dir, len, "%s", p) < (int) len;
+	if ((p = getenv("XDG_CACHE_HOME")) && *p)
+		return snprintf(dir, len, "%s/pyipopt", p) < (int) len;
+	if ((p = getenv("HOME")) && *p)
+		return snprintf(dir, len, "%s/.cache/pyipopt", p) < (int) len;
+	return snprintf(dir, len, "/tmp/pyipopt-%ld", (long) getuid()) < 
+		(int) len;
+}
+
+/* mkdir -p, private to the user */
+static int make_dirs(char *dir)
+{
+	char *p;
+	for (p = dir + 1; *p; p++)
+	{
+		if (*p != '/') continue;
+		*p = '\0';
+		if (mkdir(dir, 0700) && errno != EEXIST)
+		{
+			*p = '/';
+			return FALSE;
+		}
+		*p = '/';
+	}
+	return !mkdir(dir, 0700) || errno == EEXIST;
+}
+
+/* Whatever is in the cache gets loaded into the process, so it and the
+   directory must be the user's own and not writable by anyone else */
+static int trusted(const char *path, int is_dir)
+{
+	struct stat st;
+	if ((is_dir ? stat(path, &st) : lstat(path, &st)) != 0) return FALSE;
+	if (is_dir ? !S_ISDIR(st.st_mode) : !S_ISREG(st.st_mode))
+	{
+		errno = EPERM;
+		return FALSE;
+	}
+	if (st.st_uid != getuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+	{
+		errno = EPERM;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static int write_file(const char *path, const char *p, size_t len)
+{
+	FILE *fp = fopen(path, "w");
+	if (!fp) return FALSE;
+	if (fwrite(p, 1, len, fp) != len)
+	{
+		fclose(fp);
+		return FALSE;
+	}
+	return fclose(fp) == 0;
+}
+
+/* Compile and load section */
+
+#define FAIL(...) do { snprintf(err, errlen, __VA_ARGS__); goto error; } while (0)
+
+int nl_compile(NLModel *model, const char *cache_dir, char *err,
+	       size_t errlen)
+{
+	Source src;
+	NLCompiled *compiled = NULL;
+	char dir[1024], so[1200], tmp[1200], c[1200], log[1200], *cmd = NULL;
+	const char *cc;
+	unsigned long long h;
+	const int *nexpr, *nnodes;
+	void *handle = NULL;
+	size_t len;
+
+	memset(&src, 0, sizeof(src));
+	if (model->compiled) return 0;
+	generate(&src, model);
+	if (src.failed) FAIL("out of memory");
+	h = hash(src.p, src.len);
+
+	if (cache_dir)
+	{
+		if (snprintf(dir, sizeof(dir), "%s", cache_dir) >= (int) sizeof(dir))
+			FAIL("cache directory name is too long");
+	}
+	else if (!default_cache_dir(dir, sizeof(dir)))
+		FAIL("cache directory name is too long");
+	if (strchr(dir, '\''))
+		FAIL("cache directory name must not contain quotes");
+	if (!make_dirs(dir))
+		FAIL("cannot create %s: %s", dir, strerror(errno));
+	if (!trusted(dir, TRUE))
+		FAIL("refusing cache directory %s: it must be a directory "
+		     "of your own that others cannot write to", dir);
+	snprintf(so, sizeof(so), "%s/nl-%016llx.so", dir, h);
+
+	if (access(so, R_OK) != 0)
+	{
+		/* private names until the object is complete, so that several
+		   processes can compile the same model at once */
+		snprintf(c, sizeof(c), "%s/nl-%016llx-%d.c", dir, h, (int) getpid());
+		snprintf(tmp, sizeof(tmp), "%s/nl-%016llx-%d.so", dir, h, (int) getpid());
+		snprintf(log, sizeof(log), "%s/nl-%016llx-%d.log", dir, h, (int) getpid());
+		if (!write_file(c, src.p, src.len))
+			FAIL("cannot write %s: %s", c, strerror(errno));
+		if (!(cc = getenv("CC")) || !*cc) cc = "cc";
+		len = strlen(cc) + strlen(c) + strlen(tmp) + strlen(log) + 128;
+		if (!(cmd = (char*) malloc(len))) FAIL("out of memory");
+		snprintf(cmd, len, "%s -O2 -fno-math-errno -fPIC -shared -o '%s' '%s' "
+			 "-lm >'%s' 2>&1", cc, tmp, c, log);
+		if (system(cmd) != 0)
+		{
+			unlink(tmp);
+			FAIL("compiling %s failed, see %s", c, log);
+		}
+		/* whatever the umask, or trusted() turns it down */
+		if (chmod(tmp, 0700) || rename(tmp, so))
+		{
+			unlink(tmp);
+			FAIL("cannot create %s: %s", so, strerror(errno));
+		}
+		unlink(c);
+		unlink(log);
+	}
+
+	if (!trusted(so, FALSE))
+		FAIL("refusing to load %s: it must be a file of your own "
+		     "that others cannot write to", so);
+	if (!(handle = dlopen(so, RTLD_NOW | RTLD_LOCAL)))
+		FAIL("%s", dlerror());
+	if (!(compiled = (NLCompiled*) calloc(1, sizeof(NLCompiled))))
+		FAIL("out of memory");
+	nexpr = (const int*) dlsym(handle, "nlc_nexpr");
+	nnodes = (const int*) dlsym(handle, "nlc_nnodes");
+	compiled->forward = (NLForwardFn *const *) dlsym(handle, "nlc_forward");
+	compiled->reverse = (NLReverseFn *const *) dlsym(handle, "nlc_reverse");
+	compiled->tangent = (NLTangentFn *const *) dlsym(handle, "nlc_tangent");
+	compiled->hessian = (NLHessianFn *const *) dlsym(handle, "nlc_hessian");
+	if (!nexpr || !nnodes || !compiled->forward || !compiled->reverse ||
+	    !compiled->tangent || !compiled->hessian)
+		FAIL("%s is not a compiled model", so);
+	if (*nexpr != model->nexpr || *nnodes != model->nnodes)
+		FAIL("%s was compiled from a different model", so);
+	compiled->handle = handle;
+	model->compiled = compiled;
+	free(src.p);
+	free(cmd);
+	return 0;
+error:
+	if (handle) dlclose(handle);
+	free(compiled);
+	free(src.p);
+	free(cmd);
+	return -1;
+}
+#undef FAIL
+
+void nl_uncompile(NLModel *model)
+{
+	if (!model->compiled) return;
+	dlclose(model->compiled->handle);
+	free(model->compiled);
+	model->compiled = NULL;
+}
@@ -0,0 +1,1972 @@
+/* Copyright (c) 2008, Eric You Xu, Washington University
+* All rights reserved.
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the Washington University nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS "AS IS" AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// This file reads AMPL .nl files and evaluates them for Ipopt in C
+/* Text (g) and binary (b) files are read; both are mapped into memory
+   rather than copied, and in the binary format every field after the
+   header is a native int or double (4 and 8 bytes). The expression of every defined
+   variable (V), constraint (C) and objective (O) segment is kept as a run
+   of nodes in postfix order; a reference to a defined variable is a single
+   node, so expressions that share one form a DAG. Values are computed by
+   one forward pass over the nodes, derivatives by a reverse pass over the
+   expression in question followed by the defined variables it depends on,
+   and Hessian columns by a tangent pass followed by the same reverse pass
+   carrying tangents along. The linear parts (J, G and the linear terms of
+   V) are added on top. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "nlmodel.h"
+
+int nl_arity(int op)
+{
+	switch (op)
+	{
+	case OP_PLUS: case OP_MINUS: case OP_MULT: case OP_DIV: case OP_REM:
+	case OP_POW: case OP_ATAN2: case OP_POW_CONST_EXP:
+	case OP_POW_CONST_BASE:
+		return 2;
+	case OP_FLOOR: case OP_CEIL: case OP_ABS: case OP_NEG: case OP_TANH:
+	case OP_TAN: case OP_SQRT: case OP_SINH: case OP_SIN: case OP_LOG10:
+	case OP_LOG: case OP_EXP: case OP_COSH: case OP_COS: case OP_ATANH:
+	case OP_ATAN: case OP_ASINH: case OP_ASIN: case OP_ACOSH: case OP_ACOS:
+	case OP_POW2:
+		return 1;
+	case OP_MIN: case OP_MAX: case OP_SUM:
+		return -1;
+	}
+	return 0;
+}
+
+/* Reader section */
+
+typedef struct {
+	char *p, *end, *start;
+	int line;
+	int binary;		/* past the header of a b file */
+	char *err;
+	size_t errlen;
+} NLReader;
+
+#ifdef __GNUC__
+__attribute__ ((format (printf, 2, 3)))
+#endif
+static int fail(NLReader *r, const char *fmt, ...);
+
+static int fail(NLReader *r, const char *fmt, ...)
+{
+	va_list ap;
+	int len = r->binary ?
+		snprintf(r->err, r->errlen, "offset %ld: ", (long) (r->p - r->start)) :
+		snprintf(r->err, r->errlen, "line %d: ", r->line);
+	if (len < 0 || (size_t) len >= r->errlen) return FALSE;
+	va_start(ap, fmt);
+	vsnprintf(r->err + len, r->errlen - len, fmt, ap);
+	va_end(ap);
+	return FALSE;
+}
+
+static void next_line(NLReader *r)
+{
+	if (r->binary) return;
+	while (r->p < r->end && *r->p != '\n') r->p++;
+	if (r->p < r->end) r->p++;
+	r->line++;
+}
+
+static int at_eol(NLReader *r)
+{
+	while (r->p < r->end && (*r->p == ' ' || *r->p == '\t' || *r->p == '\r'))
+		r->p++;
+	return r->p >= r->end || *r->p == '\n' || *r->p == '#';
+}
+
+/* Binary fields, size bytes in native byte order */
+static int read_raw(NLReader *r, void *v, size_t size)
+{
+	if ((size_t) (r->end - r->p) < size)
+		return fail(r, "unexpected end of file");
+	memcpy(v, r->p, size);
+	r->p += size;
+	return TRUE;
+}
+
+static int read_long(NLReader *r, long *v)
+{
+	char *e;
+	if (r->binary)
+	{
+		int i = 0;
+		if (!read_raw(r, &i, sizeof(int))) return FALSE;
+		*v = i;
+		return TRUE;
+	}
+	if (at_eol(r)) return fail(r, "expected an integer");
+	*v = strtol(r->p, &e, 10);
+	if (e == r->p) return fail(r, "expected an integer");
+	r->p = e;
+	return TRUE;
+}
+
+static int read_double(NLReader *r, double *v)
+{
+	char *e;
+	if (r->binary) return read_raw(r, v, sizeof(double));
+	if (at_eol(r)) return fail(r, "expected a number");
+	*v = strtod(r->p, &e);
+	if (e == r->p) return fail(r, "expected a number");
+	r->p = e;
+	return TRUE;
+}
+
+/* Up to count integers from the current header line */
+static int read_header_line(NLReader *r, long *v, int count)
+{
+	int i;
+	for (i = 0; i < count; i++) v[i] = 0;
+	for (i = 0; i < count && !at_eol(r); i++)
+		if (!read_long(r, &v[i])) return FALSE;
+	next_line(r);
+	return TRUE;
+}
+
+/* Model building section */
+
+static int grow(void **buf, int *cap, int need, size_t size)
+{
+	void *p;
+	int newcap;
+	if (need <= *cap) return TRUE;
+	newcap = *cap ? *cap : 256;
+	while (newcap < need) newcap *= 2;
+	p = realloc(*buf, size * newcap);
+	if (!p) return FALSE;
+	*buf = p;
+	*cap = newcap;
+	return TRUE;
+}
+
+static int push_node(NLModel *model, int op, int a, int b, double c)
+{
+	NLNode *node;
+	if (!grow((void**) &model->nodes, &model->node_cap, model->nnodes + 1,
+		  sizeof(NLNode)))
+		return -1;
+	node = &model->nodes[model->nnodes];
+	node->op = op;
+	node->a = a;
+	node->b = b;
+	node->c = c;
+	return model->nnodes++;
+}
+
+typedef struct {
+	NLReader reader;
+	int *defpos;		/* position of defined variable i, or -1 */
+	int ndefined;
+} NLParse;
+
+static int parse_expr(NLModel *model, NLParse *ps, int *node)
+{
+	NLReader *r = &ps->reader;
+	long op, i, count;
+	double v;
+	char c;
+	int *operands, k, a, b;
+
+	if (r->p >= r->end) return fail(r, "unexpected end of file");
+	c = *r->p++;
+	switch (c)
+	{
+	case 'n': case 's': case 'l':
+		if (r->binary && c == 's')
+		{
+			short h = 0;
+			if (!read_raw(r, &h, sizeof(short))) return FALSE;
+			v = h;
+		}
+		else if (r->binary && c == 'l')
+		{
+			if (!read_long(r, &i)) return FALSE;
+			v = i;
+		}
+		else if (!read_double(r, &v))
+			return FALSE;
+		next_line(r);
+		*node = push_node(model, NL_NUM, 0, 0, v);
+		break;
+	case 'v':
+		if (!read_long(r, &i)) return FALSE;
+		next_line(r);
+		if (i >= 0 && i < model->n)
+			*node = push_node(model, NL_VAR, i, 0, 0.);
+		else if (i >= model->n && i < model->n + model->ndef &&
+			 ps->defpos[i - model->n] >= 0)
+			*node = push_node(model, NL_DEFVAR,
+					  ps->defpos[i - model->n], 0, 0.);
+		else
+			return fail(r, "undefined variable v%ld", i);
+		break;
+	case 'o':
+		if (!read_long(r, &op)) return FALSE;
+		next_line(r);
+		switch (nl_arity(op))
+		{
+		case 1:
+			if (!parse_expr(model, ps, &a)) return FALSE;
+			*node = push_node(model, op, a, 0, 0.);
+			break;
+		case 2:
+			if (!parse_expr(model, ps, &a)) return FALSE;
+			if (!parse_expr(model, ps, &b)) return FALSE;
+			*node = push_node(model, op, a, b, 0.);
+			break;
+		case -1:
+			if (!read_long(r, &count)) return FALSE;
+			next_line(r);
+			if (count < 1) return fail(r, "empty operand list");
+			operands = (int*) malloc(sizeof(int) * count);
+			if (!operands) return fail(r, "out of memory");
+			for (k = 0; k < count; k++)
+				if (!parse_expr(model, ps, &operands[k]))
+				{
+					free(operands);
+					return FALSE;
+				}
+			if (!grow((void**) &model->args, &model->arg_cap,
+				  model->nargs + count, sizeof(int)))
+			{
+				free(operands);
+				return fail(r, "out of memory");
+			}
+			memcpy(model->args + model->nargs, operands,
+			       sizeof(int) * count);
+			free(operands);
+			*node = push_node(model, op, model->nargs, count, 0.);
+			model->nargs += count;
+			break;
+		default:
+			return fail(r, "operator o%ld is not supported", op);
+		}
+		break;
+	case 'f':
+		return fail(r, "imported functions are not supported");
+	default:
+		return fail(r, "unexpected '%c' in an expression", c);
+	}
+	if (*node < 0) return fail(r, "out of memory");
+	return TRUE;
+}
+
+/* Parse one expression into expression slot e */
+static int parse_root(NLModel *model, NLParse *ps, int e)
+{
+	int root;
+	model->expr_start[e] = model->nnodes;
+	if (!parse_expr(model, ps, &root)) return FALSE;
+	model->expr_end[e] = model->nnodes;
+	return TRUE;
+}
+
+/* "i value" pairs, the body of the x, d and S segments; the values of
+   integer suffixes are ints in a binary file */
+static int read_pairs(NLReader *r, long count, double *dest, long size,
+		      int integer)
+{
+	long k, i, l;
+	double v;
+	for (k = 0; k < count; k++)
+	{
+		if (!read_long(r, &i)) return FALSE;
+		if (integer && r->binary)
+		{
+			if (!read_long(r, &l)) return FALSE;
+			v = l;
+		}
+		else if (!read_double(r, &v))
+			return FALSE;
+		if (dest)
+		{
+			if (i < 0 || i >= size)
+				return fail(r, "index %ld out of range", i);
+			dest[i] = v;
+		}
+		next_line(r);
+	}
+	return TRUE;
+}
+
+/* The r and b segments */
+static int read_bounds(NLReader *r, int count, double *lo, double *hi)
+{
+	int i;
+	long type;
+	double a = 0., b = 0.;
+	for (i = 0; i < count; i++)
+	{
+		/* the type is a digit in either format */
+		if (r->binary)
+		{
+			if (r->p >= r->end) return fail(r, "unexpected end of file");
+			type = *r->p++ - '0';
+		}
+		else if (!read_long(r, &type))
+			return FALSE;
+		lo[i] = -NL_INFINITY;
+		hi[i] = NL_INFINITY;
+		switch (type)
+		{
+		case 0:
+			if (!read_double(r, &a) || !read_double(r, &b))
+				return FALSE;
+			lo[i] = a;
+			hi[i] = b;
+			break;
+		case 1:
+			if (!read_double(r, &b)) return FALSE;
+			hi[i] = b;
+			break;
+		case 2:
+			if (!read_double(r, &a)) return FALSE;
+			lo[i] = a;
+			break;
+		case 3:
+			break;
+		case 4:
+			if (!read_double(r, &a)) return FALSE;
+			lo[i] = hi[i] = a;
+			break;
+		default:
+			return fail(r, "complementarity constraints are "
+				    "not supported");
+		}
+		next_line(r);
+	}
+	return TRUE;
+}
+
+/* Work out for each expression which defined variables it depends on,
+   latest first, which is the order the reverse pass needs them in */
+static int collect_deps(NLModel *model)
+{
+	int e, i, k, d, count = 0, cap = 0, *mark;
+	NLNode *node;
+
+	model->dep_start = (int*) malloc(sizeof(int) * (model->nexpr + 1));
+	mark = (int*) malloc(sizeof(int) * (model->ndef + 1));
+	if (!model->dep_start || !mark)
+	{
+		free(mark);
+		return FALSE;
+	}
+	for (d = 0; d < model->ndef; d++) mark[d] = -1;
+
+	for (e = 0; e < model->nexpr; e++)
+	{
+		model->dep_start[e] = count;
+		for (i = model->expr_start[e]; i < model->expr_end[e]; i++)
+		{
+			node = &model->nodes[i];
+			if (node->op != NL_DEFVAR) continue;
+			mark[node->a] = e;
+			/* a defined variable is defined before it is used, so
+			   its own dependencies are already known */
+			for (k = model->dep_start[node->a];
+			     k < model->dep_start[node->a + 1]; k++)
+				mark[model->deps[k]] = e;
+		}
+		for (d = model->ndef - 1; d >= 0; d--)
+		{
+			if (mark[d] != e) continue;
+			if (!grow((void**) &model->deps, &cap, count + 1,
+				  sizeof(int)))
+			{
+				free(mark);
+				return FALSE;
+			}
+			model->deps[count++] = d;
+		}
+	}
+	model->dep_start[model->nexpr] = count;
+	free(mark);
+	return TRUE;
+}
+
+/* Hessian sparsity. Every node is classified as constant, linear or
+   nonlinear in x. Sums, negations and scalings of a nonlinear expression
+   are split into their terms, defined variables included, and each
+   nonlinear term couples all the variables it depends on. The structure
+   is the union of those dense blocks, lower triangle, stored by column. */
+
+#define KIND_CONST	0
+#define KIND_LINEAR	1
+#define KIND_NONLINEAR	2
+
+static int node_kind(const NLModel *model, const NLNode *node,
+		     const char *kind, const char *defkind)
+{
+	int k, r = KIND_CONST;
+	switch (node->op)
+	{
+	case NL_NUM: return KIND_CONST;
+	case NL_VAR: return KIND_LINEAR;
+	case NL_DEFVAR: return defkind[node->a];
+	case OP_PLUS: case OP_MINUS:
+		return kind[node->a] > kind[node->b] ? kind[node->a] : kind[node->b];
+	case OP_NEG: return kind[node->a];
+	case OP_SUM:
+		for (k = 0; k < node->b; k++)
+			if (kind[model->args[node->a + k]] > r)
+				r = kind[model->args[node->a + k]];
+		return r;
+	case OP_MULT:
+		if (kind[node->a] == KIND_CONST) return kind[node->b];
+		if (kind[node->b] == KIND_CONST) return kind[node->a];
+		return KIND_NONLINEAR;
+	case OP_DIV:
+		if (kind[node->b] == KIND_CONST) return kind[node->a];
+		return KIND_NONLINEAR;
+	}
+	switch (nl_arity(node->op))
+	{
+	case 2: if (kind[node->b] != KIND_CONST) return KIND_NONLINEAR;
+		/* fall through */
+	case 1: return kind[node->a] == KIND_CONST ? KIND_CONST : KIND_NONLINEAR;
+	}
+	for (k = 0; k < node->b; k++)
+		if (kind[model->args[node->a + k]] != KIND_CONST)
+			return KIND_NONLINEAR;
+	return KIND_CONST;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+	long long x = *(const long long*) a, y = *(const long long*) b;
+	return x < y ? -1 : x > y;
+}
+
+typedef struct {
+	int *stack, stack_cap;
+	int *list, list_cap, nlist;
+	int *mark, stamp;
+	long long *pairs;
+	int npairs, pair_cap;
+} HessScan;
+
+static int scan_push(HessScan *s, int *top, int node)
+{
+	if (!grow((void**) &s->stack, &s->stack_cap, *top + 1, sizeof(int)))
+		return FALSE;
+	s->stack[(*top)++] = node;
+	return TRUE;
+}
+
+/* Add variable v to the current list unless it is there already */
+static int scan_add(HessScan *s, int v)
+{
+	if (s->mark[v] == s->stamp) return TRUE;
+	s->mark[v] = s->stamp;
+	if (!grow((void**) &s->list, &s->list_cap, s->nlist + 1, sizeof(int)))
+		return FALSE;
+	s->list[s->nlist++] = v;
+	return TRUE;
+}
+
+/* Variables the subtree below node depends on, added to the list */
+static int subtree_vars(NLModel *model, HessScan *s, int node)
+{
+	const NLNode *p;
+	int top = 0, k;
+	if (!scan_push(s, &top, node)) return FALSE;
+	while (top > 0)
+	{
+		p = &model->nodes[s->stack[--top]];
+		if (p->op == NL_VAR)
+		{
+			if (!scan_add(s, p->a)) return FALSE;
+		}
+		else if (p->op == NL_DEFVAR)
+		{
+			for (k = model->hvar_start[p->a]; k < model->hvar_start[p->a + 1]; k++)
+				if (!scan_add(s, model->hvars[k])) return FALSE;
+		}
+		else switch (nl_arity(p->op))
+		{
+		case 2: if (!scan_push(s, &top, p->b)) return FALSE;
+			/* fall through */
+		case 1: if (!scan_push(s, &top, p->a)) return FALSE;
+			break;
+		case -1:
+			for (k = 0; k < p->b; k++)
+				if (!scan_push(s, &top, model->args[p->a + k]))
+					return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static int collect_hessian(NLModel *model)
+{
+	HessScan s;
+	char *kind = NULL, *defkind = NULL;
+	int *elems = NULL, elem_cap = 0, nelems, top;
+	int e, i, k, l, count = 0, cap = 0, ok = FALSE;
+	long long key, last;
+	Index nnz;
+
+	memset(&s, 0, sizeof(s));
+	kind = (char*) malloc(model->nnodes + 1);
+	defkind = (char*) malloc(model->ndef + 1);
+	s.mark = (int*) calloc(model->n + 1, sizeof(int));
+	model->hvar_start = (int*) malloc(sizeof(int) * (model->nexpr + 1));
+	model->hess_start = (Index*) calloc(model->n + 1, sizeof(Index));
+	if (!kind || !defkind || !s.mark || !model->hvar_start ||
+	    !model->hess_start)
+		goto done;
+
+	/* hvars of a defined variable: everything it depends on; of a
+	   constraint or the objective: the variables of its nonlinear terms,
+	   the directions its Hessian is seeded with */
+	for (e = 0; e < model->nexpr; e++)
+	{
+		int start = model->expr_start[e], end = model->expr_end[e];
+		for (i = start; i < end; i++)
+			kind[i] = node_kind(model, &model->nodes[i], kind, defkind);
+		model->hvar_start[e] = count;
+		s.stamp++;
+		s.nlist = 0;
+		if (e < model->ndef)
+		{
+			defkind[e] = end > start ? kind[end - 1] : KIND_CONST;
+			if (model->def_lin_start[e+1] > model->def_lin_start[e] &&
+			    defkind[e] == KIND_CONST)
+				defkind[e] = KIND_LINEAR;
+			for (k = model->def_lin_start[e]; k < model->def_lin_start[e+1]; k++)
+				if (!scan_add(&s, model->def_lin_var[k])) goto done;
+			if (end > start && !subtree_vars(model, &s, end - 1))
+				goto done;
+		}
+		else if (end > start && kind[end - 1] == KIND_NONLINEAR)
+		{
+			/* split into nonlinear terms */
+			nelems = 0;
+			top = 0;
+			if (!scan_push(&s, &top, end - 1)) goto done;
+			while (top > 0)
+			{
+				int t = s.stack[--top];
+				const NLNode *p = &model->nodes[t];
+				if (kind[t] != KIND_NONLINEAR) continue;
+				switch (p->op)
+				{
+				case OP_PLUS: case OP_MINUS:
+					if (!scan_push(&s, &top, p->a) ||
+					    !scan_push(&s, &top, p->b))
+						goto done;
+					continue;
+				case OP_NEG:
+					if (!scan_push(&s, &top, p->a)) goto done;
+					continue;
+				case OP_SUM:
+					for (k = 0; k < p->b; k++)
+						if (!scan_push(&s, &top, model->args[p->a + k]))
+							goto done;
+					continue;
+				case OP_MULT:
+					if (kind[p->a] == KIND_CONST || kind[p->b] == KIND_CONST)
+					{
+						if (!scan_push(&s, &top, kind[p->a] == KIND_CONST ?
+							       p->b : p->a))
+							goto done;
+						continue;
+					}
+					break;
+				case OP_DIV:
+					if (kind[p->b] == KIND_CONST)
+					{
+						if (!scan_push(&s, &top, p->a)) goto done;
+						continue;
+					}
+					break;
+				case NL_DEFVAR:
+					l = model->expr_end[p->a];
+					if (l > model->expr_start[p->a])
+					{
+						if (!scan_push(&s, &top, l - 1)) goto done;
+						continue;
+					}
+					break;
+				}
+				if (!grow((void**) &elems, &elem_cap, nelems + 1,
+					  sizeof(int)))
+					goto done;
+				elems[nelems++] = t;
+			}
+
+			/* each term couples its own variables */
+			for (l = 0; l < nelems; l++)
+			{
+				int first = s.nlist, a, b;
+				s.stamp++;
+				if (!subtree_vars(model, &s, elems[l])) goto done;
+				for (a = first; a < s.nlist; a++)
+					for (b = first; b < s.nlist; b++)
+					{
+						if (s.list[a] < s.list[b]) continue;
+						if (!grow((void**) &s.pairs, &s.pair_cap,
+							  s.npairs + 1, sizeof(long long)))
+							goto done;
+						s.pairs[s.npairs++] = (long long) s.list[b] *
+							model->n + s.list[a];
+					}
+			}
+			/* the same variable can occur in several terms */
+			s.stamp++;
+			k = s.nlist;
+			s.nlist = 0;
+			for (l = 0; l < k; l++)
+				if (s.mark[s.list[l]] != s.stamp)
+				{
+					s.mark[s.list[l]] = s.stamp;
+					s.list[s.nlist++] = s.list[l];
+				}
+		}
+		if (!grow((void**) &model->hvars, &cap, count + s.nlist + 1,
+			  sizeof(int)))
+			goto done;
+		memcpy(model->hvars + count, s.list, sizeof(int) * s.nlist);
+		count += s.nlist;
+	}
+	model->hvar_start[model->nexpr] = count;
+
+	/* sorted by column, then row, without duplicates */
+	qsort(s.pairs, s.npairs, sizeof(long long), compare_keys);
+	nnz = 0;
+	last = -1;
+	for (l = 0; l < s.npairs; l++)
+		if ((key = s.pairs[l]) != last)
+			s.pairs[nnz++] = last = key;
+	model->nnzh = nnz;
+	model->hess_row = (Index*) malloc(sizeof(Index) * (nnz + 1));
+	if (!model->hess_row) goto done;
+	for (l = 0; l < nnz; l++)
+	{
+		model->hess_row[l] = (Index) (s.pairs[l] % model->n);
+		model->hess_start[s.pairs[l] / model->n + 1]++;
+	}
+	for (i = 0; i < model->n; i++)
+		model->hess_start[i+1] += model->hess_start[i];
+	ok = TRUE;
+done:
+	free(kind);
+	free(defkind);
+	free(elems);
+	free(s.stack);
+	free(s.list);
+	free(s.mark);
+	free(s.pairs);
+	return ok;
+}
+
+void nl_free(NLModel *model)
+{
+	if (!model) return;
+	nl_uncompile(model);
+	free(model->nodes);
+	free(model->args);
+	free(model->expr_start);
+	free(model->expr_end);
+	free(model->dep_start);
+	free(model->deps);
+	free(model->def_lin_start);
+	free(model->def_lin_var);
+	free(model->def_lin_coef);
+	free(model->jac_start);
+	free(model->jac_col);
+	free(model->jac_coef);
+	free(model->grad_var);
+	free(model->grad_coef);
+	free(model->x_L);
+	free(model->x_U);
+	free(model->g_L);
+	free(model->g_U);
+	free(model->x0);
+	free(model->x);
+	free(model->val);
+	free(model->defval);
+	free(model->adj);
+	free(model->defadj);
+	free(model->work);
+	free(model->hvar_start);
+	free(model->hvars);
+	free(model->hess_start);
+	free(model->hess_row);
+	free(model->dot);
+	free(model->adjdot);
+	free(model->defdot);
+	free(model->defadjdot);
+	free(model->hwork);
+	free(model);
+}
+
+size_t nl_bytes(const NLModel *model)
+{
+	size_t ints, indices, doubles;
+	int nlin = model->def_lin_start ? model->def_lin_start[model->ndef] : 0;
+
+	ints = 3 * (model->nexpr + 1) + 2 * (model->ndef + 1) + 
+		model->arg_cap + nlin + model->grad_count;
+	if (model->dep_start) ints += model->dep_start[model->nexpr];
+	if (model->hvar_start) ints += model->hvar_start[model->nexpr];
+	indices = (model->m + 1) + (model->n + 1) + 2 * model->nnzj + 
+		model->nnzh;
+	doubles = 6 * (model->n + 1) + 2 * (model->m + 1) + model->nnzj + 
+		nlin + model->grad_count + 4 * (model->nnodes + 1) + 
+		4 * (model->ndef + 1);
+	return sizeof(NLModel) + sizeof(NLNode) * model->node_cap + 
+		sizeof(int) * ints + sizeof(Index) * indices + 
+		sizeof(double) * doubles;
+}
+
+/* The whole file, mapped into memory. strtol and strtod need something
+   that stops them at the end: when the file ends exactly on a page
+   boundary it is read into a buffer with a terminating zero instead. */
+typedef struct {
+	char *buf;
+	size_t size;
+	int mapped;
+} NLFile;
+
+static int map_file(const char *path, NLFile *f)
+{
+	struct stat st;
+	long page = sysconf(_SC_PAGESIZE);
+	ssize_t got;
+	size_t done = 0;
+	int fd = open(path, O_RDONLY);
+
+	memset(f, 0, sizeof(NLFile));
+	if (fd < 0) return FALSE;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return FALSE;
+	}
+	f->size = st.st_size;
+	if (f->size > 0 && page > 0 && f->size % page != 0)
+	{
+		f->buf = (char*) mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (f->buf != MAP_FAILED)
+		{
+			madvise(f->buf, f->size, MADV_SEQUENTIAL);
+			f->mapped = 1;
+			close(fd);
+			return TRUE;
+		}
+	}
+	if (!(f->buf = (char*) malloc(f->size + 1)))
+	{
+		close(fd);
+		return FALSE;
+	}
+	while (done < f->size && (got = read(fd, f->buf + done, f->size - done)) > 0)
+		done += got;
+	close(fd);
+	if (done != f->size)
+	{
+		free(f->buf);
+		f->buf = NULL;
+		return FALSE;
+	}
+	f->buf[f->size] = '\0';
+	return TRUE;
+}
+
+static void unmap_file(NLFile *f)
+{
+	if (!f->buf) return;
+	if (f->mapped)
+		munmap(f->buf, f->size);
+	else
+		free(f->buf);
+	f->buf = NULL;
+}
+
+/* What the arith field of the header says for this machine */
+static int native_arith(void)
+{
+	union { int i; char c; } u;
+	u.i = 1;
+	return u.c ? 1 : 2;
+}
+
+#define ALLOC(ptr, type, count)						\
+	do								\
+	{								\
+		ptr = (type*) calloc((count) + 1, sizeof(type));	\
+		if (!ptr) { fail(r, "out of memory"); goto error; }	\
+	} while(0)
+
+NLModel *nl_read(const char *path, char *err, size_t errlen)
+{
+	NLModel *model;
+	NLFile file;
+
+	if (errlen) err[0] = '\0';
+	if (!map_file(path, &file))
+	{
+		snprintf(err, errlen, "cannot read %s", path);
+		return NULL;
+	}
+	model = nl_parse(file.buf, file.size, err, errlen);
+	unmap_file(&file);
+	return model;
+}
+
+NLModel *nl_parse(const char *buf, size_t size, char *err, size_t errlen)
+{
+	NLModel *model = NULL;
+	NLParse ps;
+	NLReader *r = &ps.reader;
+	char c;
+	long h[10], i, j, k, kind, count, lin_count = 0;
+	int e, lin_cap = 0, nnz = 0, binary;
+	int *jac_count = NULL;
+	double v;
+
+	memset(&ps, 0, sizeof(ps));
+	r->err = err;
+	r->errlen = errlen;
+	r->line = 1;
+	if (errlen) err[0] = '\0';
+
+	r->p = r->start = (char*) buf;
+	r->end = (char*) buf + size;
+
+	model = (NLModel*) calloc(1, sizeof(NLModel));
+	if (!model) { fail(r, "out of memory"); goto error; }
+
+	/* header: ten lines of text, the first one says which format */
+	if (size == 0 || (*r->p != 'g' && *r->p != 'b'))
+	{
+		fail(r, "not an .nl file");
+		goto error;
+	}
+	binary = *r->p == 'b';
+	next_line(r);
+	if (!read_header_line(r, h, 6)) goto error;
+	model->n = h[0];
+	model->m = h[1];
+	if (model->n <= 0 || model->m < 0)
+	{
+		fail(r, "bad problem size");
+		goto error;
+	}
+	for (k = 0; k < 7; k++)
+	{
+		long line[6];
+		if (!read_header_line(r, line, 6)) goto error;
+		if (k == 3 && line[1] > 0)
+		{
+			fail(r, "imported functions are not supported");
+			goto error;
+		}
+		if (k == 3 && binary && line[2] != 0 && line[2] != native_arith())
+		{
+			fail(r, "binary file from a machine with a different "
+			     "byte order");
+			goto error;
+		}
+		if (k == 5) model->nnzj = line[0];
+	}
+	if (!read_header_line(r, h, 5)) goto error;
+	r->binary = binary;
+	model->ndef = h[0] + h[1] + h[2] + h[3] + h[4];
+	model->nexpr = model->ndef + model->m + 1;
+	model->sense = 1.;
+
+	ALLOC(ps.defpos, int, model->ndef);
+	for (k = 0; k < model->ndef; k++) ps.defpos[k] = -1;
+	ALLOC(model->expr_start, int, model->nexpr);
+	ALLOC(model->expr_end, int, model->nexpr);
+	ALLOC(model->def_lin_start, int, model->ndef);
+	ALLOC(model->x_L, double, model->n);
+	ALLOC(model->x_U, double, model->n);
+	ALLOC(model->g_L, double, model->m);
+	ALLOC(model->g_U, double, model->m);
+	ALLOC(model->x0, double, model->n);
+	ALLOC(jac_count, int, model->m);
+	ALLOC(model->jac_start, Index, model->m);
+	ALLOC(model->jac_col, Index, model->nnzj);
+	ALLOC(model->jac_coef, double, model->nnzj);
+	for (k = 0; k < model->n; k++)
+	{
+		model->x_L[k] = -NL_INFINITY;
+		model->x_U[k] = NL_INFINITY;
+	}
+	/* constraints without a C segment, and a missing objective, are 0 */
+	for (e = 0; e < model->nexpr; e++)
+		model->expr_start[e] = model->expr_end[e] = 0;
+
+	while (r->p < r->end)
+	{
+		c = *r->p++;
+		switch (c)
+		{
+		case 'V':
+			if (!read_long(r, &i) || !read_long(r, &count) ||
+			    (r->binary && !read_long(r, &kind)))
+				goto error;
+			next_line(r);
+			i -= model->n;
+			if (i < 0 || i >= model->ndef || ps.defpos[i] >= 0)
+			{
+				fail(r, "bad defined variable");
+				goto error;
+			}
+			e = ps.ndefined;
+			model->def_lin_start[e] = lin_count;
+			if (!grow((void**) &model->def_lin_var, &lin_cap,
+				  lin_count + count, sizeof(int)) ||
+			    !(model->def_lin_coef = (double*) realloc(
+				      model->def_lin_coef,
+				      sizeof(double) * (lin_cap + 1))))
+			{
+				fail(r, "out of memory");
+				goto error;
+			}
+			for (k = 0; k < count; k++, lin_count++)
+			{
+				if (!read_long(r, &j) || !read_double(r, &v))
+					goto error;
+				if (j < 0 || j >= model->n)
+				{
+					fail(r, "bad variable in a linear term");
+					goto error;
+				}
+				model->def_lin_var[lin_count] = j;
+				model->def_lin_coef[lin_count] = v;
+				next_line(r);
+			}
+			if (!parse_root(model, &ps, e)) goto error;
+			ps.defpos[i] = ps.ndefined++;
+			break;
+		case 'C':
+			if (!read_long(r, &i)) goto error;
+			next_line(r);
+			if (i < 0 || i >= model->m)
+			{
+				fail(r, "bad constraint number");
+				goto error;
+			}
+			if (!parse_root(model, &ps, model->ndef + i)) goto error;
+			break;
+		case 'O':
+			if (!read_long(r, &i) || !read_long(r, &k)) goto error;
+			next_line(r);
+			if (i == 0)
+			{
+				model->sense = k ? -1. : 1.;
+				if (!parse_root(model, &ps, model->ndef + model->m))
+					goto error;
+			}
+			else
+			{
+				/* only the first objective is used */
+				int keep = model->nnodes, keep_args = model->nargs;
+				int root;
+				if (!parse_expr(model, &ps, &root)) goto error;
+				model->nnodes = keep;
+				model->nargs = keep_args;
+			}
+			break;
+		case 'L':
+			fail(r, "logical constraints are not supported");
+			goto error;
+		case 'F':
+			fail(r, "imported functions are not supported");
+			goto error;
+		case 'S':
+			if (!read_long(r, &kind) || !read_long(r, &count))
+				goto error;
+			/* the name; a length and the characters if binary */
+			if (r->binary && (!read_long(r, &k) || k < 0 ||
+					  k > r->end - r->p))
+			{
+				fail(r, "bad suffix name");
+				goto error;
+			}
+			if (r->binary) r->p += k;
+			next_line(r);
+			if (!read_pairs(r, count, NULL, 0, !(kind & 4)))
+				goto error;
+			break;
+		case 'd':
+			if (!read_long(r, &count)) goto error;
+			next_line(r);
+			if (!read_pairs(r, count, NULL, 0, 0)) goto error;
+			break;
+		case 'x':
+			if (!read_long(r, &count)) goto error;
+			next_line(r);
+			if (!read_pairs(r, count, model->x0, model->n, 0))
+				goto error;
+			break;
+		case 'r':
+			next_line(r);
+			if (!read_bounds(r, model->m, model->g_L, model->g_U))
+				goto error;
+			break;
+		case 'b':
+			next_line(r);
+			if (!read_bounds(r, model->n, model->x_L, model->x_U))
+				goto error;
+			break;
+		case 'k':
+			/* column counts of the Jacobian; the J segments
+			   give the structure row by row instead */
+			if (!read_long(r, &count)) goto error;
+			next_line(r);
+			if (!r->binary)
+			{
+				for (k = 0; k < count; k++) next_line(r);
+				break;
+			}
+			/* native ints like every other field. The counts are
+			   cumulative, so they must be nondecreasing and end up
+			   no higher than nnzj; 8 byte counts read this way
+			   alternate with their zero high halves and are turned
+			   down here instead of throwing the rest of the file
+			   out of step */
+			if (count != model->n - 1 || 
+			    count > (r->end - r->p) / (long) sizeof(int))
+			{
+				fail(r, "bad column counts");
+				goto error;
+			}
+			for (k = 0, j = 0; k < count; k++)
+			{
+				int cumulative = 0;
+				if (!read_raw(r, &cumulative, sizeof(int)))
+					goto error;
+				if (cumulative < j || cumulative > model->nnzj)
+				{
+					fail(r, "column counts are not native "
+					     "ints (8 byte counts are not "
+					     "supported)");
+					goto error;
+				}
+				j = cumulative;
+			}
+			break;
+		case 'J':
+			if (!read_long(r, &i) || !read_long(r, &count))
+				goto error;
+			next_line(r);
+			if (i < 0 || i >= model->m || jac_count[i] ||
+			    nnz + count > model->nnzj)
+			{
+				fail(r, "bad Jacobian segment");
+				goto error;
+			}
+			/* J segments may come in any order; the rows are laid
+			   out in the order they appear and jac_start fixed up
+			   below */
+			model->jac_start[i] = nnz;
+			jac_count[i] = count;
+			for (k = 0; k < count; k++, nnz++)
+			{
+				if (!read_long(r, &j) || !read_double(r, &v))
+					goto error;
+				if (j < 0 || j >= model->n)
+				{
+					fail(r, "bad variable in a linear term");
+					goto error;
+				}
+				model->jac_col[nnz] = j;
+				model->jac_coef[nnz] = v;
+				next_line(r);
+			}
+			break;
+		case 'G':
+			if (!read_long(r, &i) || !read_long(r, &count))
+				goto error;
+			next_line(r);
+			if (i != 0)
+			{
+				if (!read_pairs(r, count, NULL, 0, 0)) goto error;
+				break;
+			}
+			ALLOC(model->grad_var, int, count);
+			ALLOC(model->grad_coef, double, count);
+			model->grad_count = count;
+			for (k = 0; k < count; k++)
+			{
+				if (!read_long(r, &j) || !read_double(r, &v))
+					goto error;
+				if (j < 0 || j >= model->n)
+				{
+					fail(r, "bad variable in a linear term");
+					goto error;
+				}
+				model->grad_var[k] = j;
+				model->grad_coef[k] = v;
+				next_line(r);
+			}
+			break;
+		case '\n': case '\r': case ' ':
+			if (c == '\n') r->line++;
+			break;
+		default:
+			fail(r, "unknown segment '%c'", c);
+			goto error;
+		}
+	}
+	if (nnz != model->nnzj || ps.ndefined != model->ndef)
+	{
+		fail(r, "file is incomplete");
+		goto error;
+	}
+	model->def_lin_start[model->ndef] = lin_count;
+
+	/* rows in order: rewrite the Jacobian if J segments were shuffled */
+	for (i = 1; i < model->m; i++)
+		if (model->jac_start[i] != model->jac_start[i-1] + jac_count[i-1])
+			break;
+	if (i < model->m)
+	{
+		Index *col = NULL, at = 0;
+		double *coef = NULL;
+		ALLOC(col, Index, model->nnzj);
+		coef = (double*) malloc(sizeof(double) * (model->nnzj + 1));
+		if (!coef) { free(col); fail(r, "out of memory"); goto error; }
+		for (i = 0; i < model->m; i++)
+		{
+			memcpy(col + at, model->jac_col + model->jac_start[i],
+			       sizeof(Index) * jac_count[i]);
+			memcpy(coef + at, model->jac_coef + model->jac_start[i],
+			       sizeof(double) * jac_count[i]);
+			model->jac_start[i] = at;
+			at += jac_count[i];
+		}
+		free(model->jac_col);
+		free(model->jac_coef);
+		model->jac_col = col;
+		model->jac_coef = coef;
+	}
+	model->jac_start[model->m] = model->nnzj;
+	if (model->m == 0) model->jac_start[0] = 0;
+
+	if (!collect_deps(model) || !collect_hessian(model))
+	{
+		fail(r, "out of memory");
+		goto error;
+	}
+
+	ALLOC(model->x, double, model->n);
+	ALLOC(model->val, double, model->nnodes);
+	ALLOC(model->adj, double, model->nnodes);
+	ALLOC(model->defval, double, model->ndef);
+	ALLOC(model->defadj, double, model->ndef);
+	ALLOC(model->work, double, model->n);
+	ALLOC(model->dot, double, model->nnodes);
+	ALLOC(model->adjdot, double, model->nnodes);
+	ALLOC(model->defdot, double, model->ndef);
+	ALLOC(model->defadjdot, double, model->ndef);
+	ALLOC(model->hwork, double, model->n);
+
+	free(jac_count);
+	free(ps.defpos);
+	return model;
+error:
+	free(jac_count);
+	free(ps.defpos);
+	nl_free(model);
+	return NULL;
+}
+#undef ALLOC
+
+/* Evaluation section */
+
+static double eval_node(const NLNode *node, const double *val,
+			const int *args, const double *x, const double *defval)
+{
+	double a = 0., b = 0., r;
+	int k;
+	switch (nl_arity(node->op))
+	{
+	case 2: b = val[node->b];	/* fall through */
+	case 1: a = val[node->a];
+	}
+	switch (node->op)
+	{
+	case NL_NUM: return node->c;
+	case NL_VAR: return x[node->a];
+	case NL_DEFVAR: return defval[node->a];
+	case OP_PLUS: return a + b;
+	case OP_MINUS: return a - b;
+	case OP_MULT: return a * b;
+	case OP_DIV: return a / b;
+	case OP_REM: return fmod(a, b);
+	case OP_POW: case OP_POW_CONST_EXP: case OP_POW_CONST_BASE:
+		return pow(a, b);
+	case OP_POW2: return a * a;
+	case OP_FLOOR: return floor(a);
+	case OP_CEIL: return ceil(a);
+	case OP_ABS: return fabs(a);
+	case OP_NEG: return -a;
+	case OP_TANH: return tanh(a);
+	case OP_TAN: return tan(a);
+	case OP_SQRT: return sqrt(a);
+	case OP_SINH: return sinh(a);
+	case OP_SIN: return sin(a);
+	case OP_LOG10: return log10(a);
+	case OP_LOG: return log(a);
+	case OP_EXP: return exp(a);
+	case OP_COSH: return cosh(a);
+	case OP_COS: return cos(a);
+	case OP_ATANH: return atanh(a);
+	case OP_ATAN2: return atan2(a, b);
+	case OP_ATAN: return atan(a);
+	case OP_ASINH: return asinh(a);
+	case OP_ASIN: return asin(a);
+	case OP_ACOSH: return acosh(a);
+	case OP_ACOS: return acos(a);
+	case OP_SUM:
+		r = 0.;
+		for (k = 0; k < node->b; k++) r += val[args[node->a + k]];
+		return r;
+	case OP_MIN:
+		r = val[args[node->a]];
+		for (k = 1; k < node->b; k++)
+			if (val[args[node->a + k]] < r) r = val[args[node->a + k]];
+		return r;
+	case OP_MAX:
+		r = val[args[node->a]];
+		for (k = 1; k < node->b; k++)
+			if (val[args[node->a + k]] > r) r = val[args[node->a + k]];
+		return r;
+	}
+	return 0.;
+}
+
+static void forward_expr(NLModel *model, int e)
+{
+	int i;
+	if (model->compiled)
+	{
+		model->compiled->forward[e](model->x, model->defval, model->val);
+		return;
+	}
+	for (i = model->expr_start[e]; i < model->expr_end[e]; i++)
+		model->val[i] = eval_node(&model->nodes[i], model->val,
+					  model->args, model->x, model->defval);
+}
+
+static double expr_value(NLModel *model, int e)
+{
+	if (model->expr_end[e] == model->expr_start[e]) return 0.;
+	return model->val[model->expr_end[e] - 1];
+}
+
+/* One forward pass over everything at x */
+static void nl_forward(NLModel *model, const Number *x, Bool new_x)
+{
+	int d, k;
+	if (!new_x && model->have_x) return;
+	memcpy(model->x, x, sizeof(double) * model->n);
+	for (d = 0; d < model->ndef; d++)
+	{
+		double v;
+		forward_expr(model, d);
+		v = expr_value(model, d);
+		for (k = model->def_lin_start[d]; k < model->def_lin_start[d+1]; k++)
+			v += model->def_lin_coef[k] * model->x[model->def_lin_var[k]];
+		model->defval[d] = v;
+	}
+	for (d = model->ndef; d < model->nexpr; d++)
+		forward_expr(model, d);
+	model->have_x = 1;
+}
+
+/* Push seed * d(expr e)/d(node) down to the leaves of e, adding the
+   derivatives with respect to x into grad and those with respect to the
+   defined variables into defadj */
+static void reverse_expr(NLModel *model, int e, double seed, double *grad)
+{
+	const double *val = model->val;
+	double *adj = model->adj, w, a, b;
+	int i, k, start = model->expr_start[e], end = model->expr_end[e];
+	NLNode *node;
+
+	if (end == start) return;
+	memset(adj + start, 0, sizeof(double) * (end - start));
+	adj[end - 1] = seed;
+	if (model->compiled)
+	{
+		model->compiled->reverse[e](val, adj, model->defadj, grad);
+		return;
+	}
+	for (i = end - 1; i >= start; i--)
+	{
+		if ((w = adj[i]) == 0.) continue;
+		node = &model->nodes[i];
+		a = nl_arity(node->op) > 0 ? val[node->a] : 0.;
+		b = nl_arity(node->op) == 2 ? val[node->b] : 0.;
+		switch (node->op)
+		{
+		case NL_NUM: break;
+		case NL_VAR: grad[node->a] += w; break;
+		case NL_DEFVAR: model->defadj[node->a] += w; break;
+		case OP_PLUS: adj[node->a] += w; adj[node->b] += w; break;
+		case OP_MINUS: adj[node->a] += w; adj[node->b] -= w; break;
+		case OP_MULT: adj[node->a] += w * b; adj[node->b] += w * a; break;
+		case OP_DIV:
+			adj[node->a] += w / b;
+			adj[node->b] -= w * a / (b * b);
+			break;
+		case OP_REM:
+			adj[node->a] += w;
+			adj[node->b] -= w * trunc(a / b);
+			break;
+		case OP_POW: case OP_POW_CONST_EXP: case OP_POW_CONST_BASE:
+			if (b != 0.) adj[node->a] += w * b * pow(a, b - 1.);
+			if (a > 0.) adj[node->b] += w * log(a) * val[i];
+			break;
+		case OP_POW2: adj[node->a] += w * 2. * a; break;
+		case OP_FLOOR: case OP_CEIL: break;
+		case OP_ABS: adj[node->a] += a < 0. ? -w : w; break;
+		case OP_NEG: adj[node->a] -= w; break;
+		case OP_TANH: adj[node->a] += w * (1. - val[i] * val[i]); break;
+		case OP_TAN: adj[node->a] += w * (1. + val[i] * val[i]); break;
+		case OP_SQRT: adj[node->a] += w * .5 / val[i]; break;
+		case OP_SINH: adj[node->a] += w * cosh(a); break;
+		case OP_SIN: adj[node->a] += w * cos(a); break;
+		case OP_LOG10: adj[node->a] += w / (a * M_LN10); break;
+		case OP_LOG: adj[node->a] += w / a; break;
+		case OP_EXP: adj[node->a] += w * val[i]; break;
+		case OP_COSH: adj[node->a] += w * sinh(a); break;
+		case OP_COS: adj[node->a] -= w * sin(a); break;
+		case OP_ATANH: adj[node->a] += w / (1. - a * a); break;
+		case OP_ATAN2:
+			adj[node->a] += w * b / (a * a + b * b);
+			adj[node->b] -= w * a / (a * a + b * b);
+			break;
+		case OP_ATAN: adj[node->a] += w / (1. + a * a); break;
+		case OP_ASINH: adj[node->a] += w / sqrt(a * a + 1.); break;
+		case OP_ASIN: adj[node->a] += w / sqrt(1. - a * a); break;
+		case OP_ACOSH: adj[node->a] += w / sqrt(a * a - 1.); break;
+		case OP_ACOS: adj[node->a] -= w / sqrt(1. - a * a); break;
+		case OP_SUM:
+			for (k = 0; k < node->b; k++)
+				adj[model->args[node->a + k]] += w;
+			break;
+		case OP_MIN: case OP_MAX:
+			/* the first operand that attains the value */
+			for (k = 0; k < node->b; k++)
+				if (val[model->args[node->a + k]] == val[i])
+				{
+					adj[model->args[node->a + k]] += w;
+					break;
+				}
+			break;
+		}
+	}
+}
+
+/* Gradient of expression e with seed, including what flows through the
+   defined variables it uses, added into grad */
+static void gradient_expr(NLModel *model, int e, double seed, double *grad)
+{
+	int k, l, d;
+	for (k = model->dep_start[e]; k < model->dep_start[e+1]; k++)
+		model->defadj[model->deps[k]] = 0.;
+	reverse_expr(model, e, seed, grad);
+	/* latest definition first: a defined variable can only pass its
+	   adjoint on to ones defined before it */
+	for (k = model->dep_start[e]; k < model->dep_start[e+1]; k++)
+	{
+		double w;
+		d = model->deps[k];
+		if ((w = model->defadj[d]) == 0.) continue;
+		for (l = model->def_lin_start[d]; l < model->def_lin_start[d+1]; l++)
+			grad[model->def_lin_var[l]] += w * model->def_lin_coef[l];
+		reverse_expr(model, d, w, grad);
+	}
+}
+
+static int finite_values(const Number *v, Index count)
+{
+	Index i;
+	for (i = 0; i < count; i++)
+		if (!isfinite(v[i])) return FALSE;
+	return TRUE;
+}
+
+/* Hessian section: forward over reverse. A tangent pass with direction
+   e_k followed by a reverse pass that carries the tangent of every adjoint
+   along gives column k of the Hessian of an expression. */
+
+/* First and second derivatives of a unary or binary node with respect to
+   its operands a and b, given its value r: d[0] = dr/da, d[1] = dr/db,
+   d[2] = d2r/da2, d[3] = d2r/dadb, d[4] = d2r/db2 */
+static void local_derivs(int op, double a, double b, double r, double *d)
+{
+	double s, t;
+	d[0] = d[1] = d[2] = d[3] = d[4] = 0.;
+	switch (op)
+	{
+	case OP_PLUS: d[0] = 1.; d[1] = 1.; break;
+	case OP_MINUS: d[0] = 1.; d[1] = -1.; break;
+	case OP_MULT: d[0] = b; d[1] = a; d[3] = 1.; break;
+	case OP_DIV:
+		d[0] = 1. / b;
+		d[1] = -a / (b * b);
+		d[3] = -1. / (b * b);
+		d[4] = 2. * a / (b * b * b);
+		break;
+	case OP_REM: d[0] = 1.; d[1] = -trunc(a / b); break;
+	case OP_POW: case OP_POW_CONST_EXP: case OP_POW_CONST_BASE:
+		if (b != 0.) d[0] = b * pow(a, b - 1.);
+		if (b != 0. && b != 1.) d[2] = b * (b - 1.) * pow(a, b - 2.);
+		if (a > 0.)
+		{
+			t = log(a);
+			d[1] = t * r;
+			d[3] = pow(a, b - 1.) * (1. + b * t);
+			d[4] = t * t * r;
+		}
+		break;
+	case OP_POW2: d[0] = 2. * a; d[2] = 2.; break;
+	case OP_ABS: d[0] = a < 0. ? -1. : 1.; break;
+	case OP_NEG: d[0] = -1.; break;
+	case OP_TANH: d[0] = 1. - r * r; d[2] = -2. * r * d[0]; break;
+	case OP_TAN: d[0] = 1. + r * r; d[2] = 2. * r * d[0]; break;
+	case OP_SQRT: d[0] = .5 / r; d[2] = -.25 / (r * r * r); break;
+	case OP_SINH: d[0] = cosh(a); d[2] = r; break;
+	case OP_SIN: d[0] = cos(a); d[2] = -r; break;
+	case OP_LOG10: d[0] = 1. / (a * M_LN10); d[2] = -d[0] / a; break;
+	case OP_LOG: d[0] = 1. / a; d[2] = -1. / (a * a); break;
+	case OP_EXP: d[0] = r; d[2] = r; break;
+	case OP_COSH: d[0] = sinh(a); d[2] = r; break;
+	case OP_COS: d[0] = -sin(a); d[2] = -r; break;
+	case OP_ATANH:
+		d[0] = 1. / (1. - a * a);
+		d[2] = 2. * a * d[0] * d[0];
+		break;
+	case OP_ATAN2:
+		s = a * a + b * b;
+		d[0] = b / s;
+		d[1] = -a / s;
+		d[2] = -2. * a * b / (s * s);
+		d[3] = (a * a - b * b) / (s * s);
+		d[4] = 2. * a * b / (s * s);
+		break;
+	case OP_ATAN:
+		d[0] = 1. / (1. + a * a);
+		d[2] = -2. * a * d[0] * d[0];
+		break;
+	case OP_ASINH:
+		d[0] = 1. / sqrt(a * a + 1.);
+		d[2] = -a * d[0] * d[0] * d[0];
+		break;
+	case OP_ASIN:
+		d[0] = 1. / sqrt(1. - a * a);
+		d[2] = a * d[0] * d[0] * d[0];
+		break;
+	case OP_ACOSH:
+		d[0] = 1. / sqrt(a * a - 1.);
+		d[2] = -a * d[0] * d[0] * d[0];
+		break;
+	case OP_ACOS:
+		t = 1. / sqrt(1. - a * a);
+		d[0] = -t;
+		d[2] = -a * t * t * t;
+		break;
+	}
+}
+
+/* The operand of a min or max that attains its value, as in reverse_expr */
+static int selected_operand(const NLModel *model, const NLNode *node, int i)
+{
+	int k;
+	for (k = 0; k < node->b; k++)
+		if (model->val[model->args[node->a + k]] == model->val[i])
+			return model->args[node->a + k];
+	return model->args[node->a];
+}
+
+/* Derivative of every node of expression e along e_k */
+static void tangent_expr(NLModel *model, int e, int k)
+{
+	const double *val = model->val;
+	double *dot = model->dot, d[5];
+	int i, j;
+	NLNode *node;
+
+	if (model->compiled)
+	{
+		model->compiled->tangent[e](val, model->defdot, dot, k);
+		return;
+	}
+	for (i = model->expr_start[e]; i < model->expr_end[e]; i++)
+	{
+		node = &model->nodes[i];
+		switch (node->op)
+		{
+		case NL_NUM: dot[i] = 0.; break;
+		case NL_VAR: dot[i] = node->a == k ? 1. : 0.; break;
+		case NL_DEFVAR: dot[i] = model->defdot[node->a]; break;
+		case OP_SUM:
+			dot[i] = 0.;
+			for (j = 0; j < node->b; j++)
+				dot[i] += dot[model->args[node->a + j]];
+			break;
+		case OP_MIN: case OP_MAX:
+			dot[i] = dot[selected_operand(model, node, i)];
+			break;
+		default:
+			local_derivs(node->op, val[node->a],
+				     nl_arity(node->op) == 2 ? val[node->b] : 0., val[i], d);
+			dot[i] = d[0] * dot[node->a];
+			if (nl_arity(node->op) == 2) dot[i] += d[1] * dot[node->b];
+		}
+	}
+}
+
+/* reverse_expr with the tangents of the adjoints carried along; seed and
+   seed_dot go to the root, second derivatives are added into hv */
+static void hessian_reverse(NLModel *model, int e, double seed,
+			    double seed_dot, double *hv)
+{
+	const double *val = model->val, *dot = model->dot;
+	double *adj = model->adj, *adjdot = model->adjdot, w, wd, ad, bd, d[5];
+	int i, j, o, start = model->expr_start[e], end = model->expr_end[e];
+	NLNode *node;
+
+	if (end == start) return;
+	memset(adj + start, 0, sizeof(double) * (end - start));
+	memset(adjdot + start, 0, sizeof(double) * (end - start));
+	adj[end - 1] = seed;
+	adjdot[end - 1] = seed_dot;
+	if (model->compiled)
+	{
+		model->compiled->hessian[e](val, dot, adj, adjdot, model->defadj,
+					    model->defadjdot, hv);
+		return;
+	}
+	for (i = end - 1; i >= start; i--)
+	{
+		w = adj[i];
+		wd = adjdot[i];
+		if (w == 0. && wd == 0.) continue;
+		node = &model->nodes[i];
+		switch (node->op)
+		{
+		case NL_NUM: break;
+		case NL_VAR: hv[node->a] += wd; break;
+		case NL_DEFVAR:
+			model->defadj[node->a] += w;
+			model->defadjdot[node->a] += wd;
+			break;
+		case OP_SUM:
+			for (j = 0; j < node->b; j++)
+			{
+				adj[model->args[node->a + j]] += w;
+				adjdot[model->args[node->a + j]] += wd;
+			}
+			break;
+		case OP_MIN: case OP_MAX:
+			o = selected_operand(model, node, i);
+			adj[o] += w;
+			adjdot[o] += wd;
+			break;
+		default:
+			local_derivs(node->op, val[node->a],
+				     nl_arity(node->op) == 2 ? val[node->b] : 0., val[i], d);
+			ad = dot[node->a];
+			bd = nl_arity(node->op) == 2 ? dot[node->b] : 0.;
+			adj[node->a] += w * d[0];
+			adjdot[node->a] += wd * d[0] + w * (d[2] * ad + d[3] * bd);
+			if (nl_arity(node->op) == 2)
+			{
+				adj[node->b] += w * d[1];
+				adjdot[node->b] += wd * d[1] + w * (d[3] * ad + d[4] * bd);
+			}
+		}
+	}
+}
+
+/* seed times column k of the Hessian of expression e, added into hv */
+static void hessian_column(NLModel *model, int e, int k, double seed,
+			   double *hv)
+{
+	int j, l, d;
+	/* tangents of the defined variables, earliest first */
+	for (j = model->dep_start[e+1] - 1; j >= model->dep_start[e]; j--)
+	{
+		double v;
+		d = model->deps[j];
+		tangent_expr(model, d, k);
+		v = model->expr_end[d] > model->expr_start[d] ?
+			model->dot[model->expr_end[d] - 1] : 0.;
+		for (l = model->def_lin_start[d]; l < model->def_lin_start[d+1]; l++)
+			if (model->def_lin_var[l] == k) v += model->def_lin_coef[l];
+		model->defdot[d] = v;
+		model->defadj[d] = model->defadjdot[d] = 0.;
+	}
+	tangent_expr(model, e, k);
+	hessian_reverse(model, e, seed, 0., hv);
+	for (j = model->dep_start[e]; j < model->dep_start[e+1]; j++)
+	{
+		double w, wd;
+		d = model->deps[j];
+		w = model->defadj[d];
+		wd = model->defadjdot[d];
+		if (w == 0. && wd == 0.) continue;
+		for (l = model->def_lin_start[d]; l < model->def_lin_start[d+1]; l++)
+			hv[model->def_lin_var[l]] += wd * model->def_lin_coef[l];
+		hessian_reverse(model, d, w, wd, hv);
+	}
+}
+
+/* Zero every entry of hv that expression e can have written */
+static void clear_columns(NLModel *model, int e, double *hv)
+{
+	int j, l, d, i;
+	for (j = model->dep_start[e]; j <= model->dep_start[e+1]; j++)
+	{
+		d = j < model->dep_start[e+1] ? model->deps[j] : e;
+		for (i = model->expr_start[d]; i < model->expr_end[d]; i++)
+			if (model->nodes[i].op == NL_VAR)
+				hv[model->nodes[i].a] = 0.;
+		if (d < model->ndef)
+			for (l = model->def_lin_start[d]; l < model->def_lin_start[d+1]; l++)
+				hv[model->def_lin_var[l]] = 0.;
+	}
+}
+
+/* Callback section */
+
+Bool nl_eval_f(Index n, Number *x, Bool new_x,
+	       Number *obj_value, UserDataPtr user_data)
+{
+	NLModel *model = (NLModel*) user_data;
+	double f;
+	int k;
+	nl_forward(model, x, new_x);
+	f = expr_value(model, model->ndef + model->m);
+	for (k = 0; k < model->grad_count; k++)
+		f += model->grad_coef[k] * x[model->grad_var[k]];
+	*obj_value = model->sense * f;
+	return isfinite(*obj_value);
+}
+
+Bool nl_eval_grad_f(Index n, Number *x, Bool new_x,
+		    Number *grad_f, UserDataPtr user_data)
+{
+	NLModel *model = (NLModel*) user_data;
+	Index i;
+	int k;
+	nl_forward(model, x, new_x);
+	memset(grad_f, 0, sizeof(Number) * n);
+	gradient_expr(model, model->ndef + model->m, 1., grad_f);
+	for (k = 0; k < model->grad_count; k++)
+		grad_f[model->grad_var[k]] += model->grad_coef[k];
+	if (model->sense < 0.)
+		for (i = 0; i < n; i++) grad_f[i] = -grad_f[i];
+	return finite_values(grad_f, n);
+}
+
+Bool nl_eval_g(Index n, Number *x, Bool new_x,
+	       Index m, Number *g, UserDataPtr user_data)
+{
+	NLModel *model = (NLModel*) user_data;
+	Index i, k;
+	nl_forward(model, x, new_x);
+	for (i = 0; i < m; i++)
+	{
+		double v = expr_value(model, model->ndef + i);
+		for (k = model->jac_start[i]; k < model->jac_start[i+1]; k++)
+			v += model->jac_coef[k] * x[model->jac_col[k]];
+		g[i] = v;
+	}
+	return finite_values(g, m);
+}
+
+Bool nl_eval_jac_g(Index n, Number *x, Bool new_x,
+		   Index m, Index nele_jac,
+		   Index *iRow, Index *jCol, Number *values,
+		   UserDataPtr user_data)
+{
+	NLModel *model = (NLModel*) user_data;
+	double *grad = model->work;
+	Index i, k;
+
+	if (values == NULL)
+	{
+		for (i = 0; i < m; i++)
+			for (k = model->jac_start[i]; k < model->jac_start[i+1]; k++)
+			{
+				iRow[k] = i;
+				jCol[k] = model->jac_col[k];
+			}
+		return TRUE;
+	}
+
+	nl_forward(model, x, new_x);
+	for (i = 0; i < m; i++)
+	{
+		int e = model->ndef + i;
+		if (model->expr_end[e] == model->expr_start[e])
+		{
+			/* linear row */
+			for (k = model->jac_start[i]; k < model->jac_start[i+1]; k++)
+				values[k] = model->jac_coef[k];
+			continue;
+		}
+		gradient_expr(model, e, 1., grad);
+		for (k = model->jac_start[i]; k < model->jac_start[i+1]; k++)
+		{
+			values[k] = model->jac_coef[k] + grad[model->jac_col[k]];
+			grad[model->jac_col[k]] = 0.;
+		}
+	}
+	return finite_values(values, nele_jac);
+}
+
+Bool nl_eval_h(Index n, Number *x, Bool new_x, Number obj_factor,
+	       Index m, Number *lambda, Bool new_lambda,
+	       Index nele_hess, Index *iRow, Index *jCol,
+	       Number *values, UserDataPtr user_data)
+{
+	NLModel *model = (NLModel*) user_data;
+	double *hv = model->hwork, w;
+	Index i, k, l;
+	int e;
+
+	if (values == NULL)
+	{
+		for (k = 0; k < n; k++)
+			for (l = model->hess_start[k]; l < model->hess_start[k+1]; l++)
+			{
+				iRow[l] = model->hess_row[l];
+				jCol[l] = k;
+			}
+		return TRUE;
+	}
+
+	nl_forward(model, x, new_x);
+	memset(values, 0, sizeof(Number) * nele_hess);
+	for (e = model->ndef; e < model->nexpr; e++)
+	{
+		i = e - model->ndef;
+		w = i < m ? lambda[i] : obj_factor * model->sense;
+		if (w == 0.) continue;
+		for (l = model->hvar_start[e]; l < model->hvar_start[e+1]; l++)
+		{
+			k = model->hvars[l];
+			hessian_column(model, e, k, w, hv);
+			for (i = model->hess_start[k]; i < model->hess_start[k+1]; i++)
+				values[i] += hv[model->hess_row[i]];
+			clear_columns(model, e, hv);
+		}
+	}
+	return finite_values(values, nele_hess);
+}
+
+/* Batched evaluation section
+
+   The same forward pass as nl_forward, but every node holds a block of
+   NL_BLOCK values, one per point, so each operator runs as a short loop
+   over contiguous doubles that the compiler can vectorize (-O3, and with
+   a vector libm for the transcendental ones). The tape is walked once per
+   block instead of once per point. Each block of points is first
+   transposed so that a variable, too, is a contiguous run of values. */
+
+#define NL_BLOCK	64
+
+#define BATCH_UNARY(expr) \
+	for (j = 0; j < nb; j++) { double a = A[j]; r[j] = (expr); } \
+	break
+#define BATCH_BINARY(expr) \
+	for (j = 0; j < nb; j++) { double a = A[j], b = B[j]; r[j] = (expr); } \
+	break
+
+static void batch_node(const NLModel *model, int i, double *val,
+		       const double *X, int nb, const double *defval)
+{
+	const NLNode *node = &model->nodes[i];
+	double *r = val + (size_t) i * NL_BLOCK;
+	const double *A = NULL, *B = NULL, *o;
+	int j, k;
+
+	switch (nl_arity(node->op))
+	{
+	case 2: B = val + (size_t) node->b * NL_BLOCK;	/* fall through */
+	case 1: A = val + (size_t) node->a * NL_BLOCK;
+	}
+	switch (node->op)
+	{
+	case NL_NUM:
+		for (j = 0; j < nb; j++) r[j] = node->c;
+		break;
+	case NL_VAR:
+		memcpy(r, X + (size_t) node->a * NL_BLOCK, sizeof(double) * nb);
+		break;
+	case NL_DEFVAR:
+		memcpy(r, defval + (size_t) node->a * NL_BLOCK, sizeof(double) * nb);
+		break;
+	case OP_PLUS: BATCH_BINARY(a + b);
+	case OP_MINUS: BATCH_BINARY(a - b);
+	case OP_MULT: BATCH_BINARY(a * b);
+	case OP_DIV: BATCH_BINARY(a / b);
+	case OP_REM: BATCH_BINARY(fmod(a, b));
+	case OP_POW: case OP_POW_CONST_EXP: case OP_POW_CONST_BASE:
+		BATCH_BINARY(pow(a, b));
+	case OP_POW2: BATCH_UNARY(a * a);
+	case OP_FLOOR: BATCH_UNARY(floor(a));
+	case OP_CEIL: BATCH_UNARY(ceil(a));
+	case OP_ABS: BATCH_UNARY(fabs(a));
+	case OP_NEG: BATCH_UNARY(-a);
+	case OP_TANH: BATCH_UNARY(tanh(a));
+	case OP_TAN: BATCH_UNARY(tan(a));
+	case OP_SQRT: BATCH_UNARY(sqrt(a));
+	case OP_SINH: BATCH_UNARY(sinh(a));
+	case OP_SIN: BATCH_UNARY(sin(a));
+	case OP_LOG10: BATCH_UNARY(log10(a));
+	case OP_LOG: BATCH_UNARY(log(a));
+	case OP_EXP: BATCH_UNARY(exp(a));
+	case OP_COSH: BATCH_UNARY(cosh(a));
+	case OP_COS: BATCH_UNARY(cos(a));
+	case OP_ATANH: BATCH_UNARY(atanh(a));
+	case OP_ATAN2: BATCH_BINARY(atan2(a, b));
+	case OP_ATAN: BATCH_UNARY(atan(a));
+	case OP_ASINH: BATCH_UNARY(asinh(a));
+	case OP_ASIN: BATCH_UNARY(asin(a));
+	case OP_ACOSH: BATCH_UNARY(acosh(a));
+	case OP_ACOS: BATCH_UNARY(acos(a));
+	case OP_SUM: case OP_MIN: case OP_MAX:
+		o = val + (size_t) model->args[node->a] * NL_BLOCK;
+		memcpy(r, o, sizeof(double) * nb);
+		for (k = 1; k < node->b; k++)
+		{
+			o = val + (size_t) model->args[node->a + k] * NL_BLOCK;
+			if (node->op == OP_SUM)
+				for (j = 0; j < nb; j++) r[j] += o[j];
+			else if (node->op == OP_MIN)
+				for (j = 0; j < nb; j++) r[j] = o[j] < r[j] ? o[j] : r[j];
+			else
+				for (j = 0; j < nb; j++) r[j] = o[j] > r[j] ? o[j] : r[j];
+		}
+		if (node->b == 0)
+			for (j = 0; j < nb; j++) r[j] = 0.;
+		break;
+	default:
+		for (j = 0; j < nb; j++) r[j] = 0.;
+	}
+}
+#undef BATCH_UNARY
+#undef BATCH_BINARY
+
+int nl_eval_batch(const NLModel *model, const double *X, int count,
+		  double *F, double *G)
+{
+	double *val, *defval, *v, *Xb;
+	int b0, nb, d, i, j, k;
+
+	val = malloc(sizeof(double) * NL_BLOCK *
+		     ((size_t) model->nnodes + model->ndef + model->n + 1));
+	if (!val) return -1;
+	defval = val + (size_t) model->nnodes * NL_BLOCK;
+	Xb = defval + (size_t) model->ndef * NL_BLOCK;
+
+	for (b0 = 0; b0 < count; b0 += NL_BLOCK)
+	{
+		nb = count - b0 < NL_BLOCK ? count - b0 : NL_BLOCK;
+		for (j = 0; j < nb; j++)
+			for (i = 0; i < model->n; i++)
+				Xb[(size_t) i * NL_BLOCK + j] = X[(size_t) (b0 + j) * model->n + i];
+		for (d = 0; d < model->nexpr; d++)
+		{
+			int start = model->expr_start[d], end = model->expr_end[d];
+			for (i = start; i < end; i++)
+				batch_node(model, i, val, Xb, nb, defval);
+			if (d < model->ndef)
+				v = defval + (size_t) d * NL_BLOCK;
+			else
+				v = Xb + (size_t) model->n * NL_BLOCK;
+			if (end > start)
+				memcpy(v, val + (size_t) (end - 1) * NL_BLOCK,
+				       sizeof(double) * nb);
+			else
+				memset(v, 0, sizeof(double) * nb);
+
+			/* linear parts, then scatter into the outputs */
+			if (d < model->ndef)
+			{
+				for (k = model->def_lin_start[d]; k < model->def_lin_start[d+1]; k++)
+				{
+					const double *xk = Xb + (size_t) model->def_lin_var[k] * NL_BLOCK;
+					for (j = 0; j < nb; j++)
+						v[j] += model->def_lin_coef[k] * xk[j];
+				}
+			}
+			else if (d < model->ndef + model->m)
+			{
+				i = d - model->ndef;
+				for (k = model->jac_start[i]; k < model->jac_start[i+1]; k++)
+				{
+					const double *xk = Xb + (size_t) model->jac_col[k] * NL_BLOCK;
+					for (j = 0; j < nb; j++)
+						v[j] += model->jac_coef[k] * xk[j];
+				}
+				for (j = 0; j < nb; j++)
+					G[(size_t) (b0 + j) * model->m + i] = v[j];
+			}
+			else
+			{
+				for (k = 0; k < model->grad_count; k++)
+				{
+					const double *xk = Xb + (size_t) model->grad_var[k] * NL_BLOCK;
+					for (j = 0; j < nb; j++)
+						v[j] += model->grad_coef[k] * xk[j];
+				}
+				for (j = 0; j < nb; j++)
+					F[b0 + j] = model->sense * v[j];
+			}
+		}
+	}
+	free(val);
+	return 0;
+}
@@ -0,0 +1,204 @@
+/* Copyright (c) 2008, Eric You Xu, Washington University
+* All rights reserved.
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the Washington University nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS "AS IS" AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Native evaluation of AMPL .nl models, see nlmodel.c. Nothing in here
+   touches Python, so these callbacks can run with the GIL released. */
+
+#ifndef PY_IPOPT_NLMODEL
+#define PY_IPOPT_NLMODEL
+
+#include <stddef.h>
+#include "IpStdCInterface.h"
+
+/* Node opcodes are AMPL's own (o2 is a product, o54 a sum, ...) */
+#define OP_PLUS		0
+#define OP_MINUS	1
+#define OP_MULT		2
+#define OP_DIV		3
+#define OP_REM		4
+#define OP_POW		5
+#define OP_MIN		11
+#define OP_MAX		12
+#define OP_FLOOR	13
+#define OP_CEIL		14
+#define OP_ABS		15
+#define OP_NEG		16
+#define OP_TANH		37
+#define OP_TAN		38
+#define OP_SQRT		39
+#define OP_SINH		40
+#define OP_SIN		41
+#define OP_LOG10	42
+#define OP_LOG		43
+#define OP_EXP		44
+#define OP_COSH		45
+#define OP_COS		46
+#define OP_ATANH	47
+#define OP_ATAN2	48
+#define OP_ATAN		49
+#define OP_ASINH	50
+#define OP_ASIN		51
+#define OP_ACOSH	52
+#define OP_ACOS		53
+#define OP_SUM		54
+#define OP_POW_CONST_EXP	74
+#define OP_POW2		75
+#define OP_POW_CONST_BASE	76
+
+/* and these are the leaves */
+#define NL_NUM		80	/* constant, value in c */
+#define NL_VAR		82	/* variable a */
+#define NL_DEFVAR	83	/* defined variable a, in order of definition */
+
+/* Anything at or beyond this is infinite for Ipopt */
+#define NL_INFINITY	1e20
+
+typedef struct {
+	int op;
+	int a, b;	/* operand nodes, or offset and count into args */
+	double c;
+} NLNode;
+
+/* A model compiled by nl_compile: one function per expression for each of
+   the passes over it, see nlcompile.c */
+typedef void NLForwardFn(const double *x, const double *defval, double *val);
+typedef void NLReverseFn(const double *val, double *adj, double *defadj,
+			 double *grad);
+typedef void NLTangentFn(const double *val, const double *defdot,
+			 double *dot, int k);
+typedef void NLHessianFn(const double *val, const double *dot, double *adj,
+			 double *adjdot, double *defadj, double *defadjdot,
+			 double *hv);
+
+typedef struct {
+	void *handle;
+	NLForwardFn *const *forward;
+	NLReverseFn *const *reverse;
+	NLTangentFn *const *tangent;
+	NLHessianFn *const *hessian;
+} NLCompiled;
+
+/* One expression is a contiguous run of nodes in postfix order, so every
+   operand comes before the node that uses it and the root is last.
+   Expressions 0..ndef-1 are the defined variables (V segments) in the
+   order they were defined, ndef..ndef+m-1 the constraint bodies and
+   ndef+m the objective. */
+typedef struct NLModel {
+	int n, m;
+	int ndef;
+	int nexpr;
+	Index nnzj;
+	double sense;		/* 1 to minimize, -1 to maximize */
+
+	NLNode *nodes;
+	int nnodes, node_cap;
+	int *args;
+	int nargs, arg_cap;
+	int *expr_start, *expr_end;
+
+	/* defined variables each expression depends on, directly or not,
+	   latest definition first */
+	int *dep_start, *deps;
+
+	/* linear parts: of the defined variables, of the constraints (the J
+	   segments, which also give the Jacobian structure row by row) and of
+	   the objective (G segment) */
+	int *def_lin_start, *def_lin_var;
+	double *def_lin_coef;
+	Index *jac_start, *jac_col;
+	double *jac_coef;
+	int grad_count;
+	int *grad_var;
+	double *grad_coef;
+
+	double *x_L, *x_U, *g_L, *g_U, *x0;
+
+	/* Hessian of the Lagrangian, lower triangle stored by column: rows
+	   hess_row[hess_start[k]..hess_start[k+1]-1] of column k. hvars lists
+	   for each expression the variables its Hessian is seeded with */
+	Index nnzh;
+	Index *hess_start, *hess_row;
+	int *hvar_start, *hvars;
+
+	/* evaluation state for the point in x */
+	double *x;
+	int have_x;
+	double *val;		/* value of every node */
+	double *defval;		/* value of every defined variable */
+	double *adj;		/* adjoint of every node */
+	double *defadj;
+	double *work;		/* dense gradient, length n */
+	double *dot;		/* tangent of every node */
+	double *adjdot;		/* tangent of every adjoint */
+	double *defdot, *defadjdot;
+	double *hwork;		/* Hessian column, length n */
+
+	NLCompiled *compiled;	/* or NULL to interpret the nodes */
+} NLModel;
+
+/* 1 or 2 for unary and binary operators, -1 for n-ary, 0 otherwise */
+int nl_arity(int op);
+
+NLModel *nl_read(const char *path, char *err, size_t errlen);
+/* The same for a file already in memory. Text must be followed by a
+   byte that ends a number, such as a terminating zero. */
+NLModel *nl_parse(const char *buf, size_t size, char *err, size_t errlen);
+void nl_free(NLModel *model);
+/* About how much memory the model holds, compiled code not counted */
+size_t nl_bytes(const NLModel *model);
+
+/* Ipopt callbacks, user_data is the NLModel */
+Bool nl_eval_f(Index n, Number *x, Bool new_x,
+	       Number *obj_value, UserDataPtr user_data);
+Bool nl_eval_grad_f(Index n, Number *x, Bool new_x,
+		    Number *grad_f, UserDataPtr user_data);
+Bool nl_eval_g(Index n, Number *x, Bool new_x,
+	       Index m, Number *g, UserDataPtr user_data);
+Bool nl_eval_jac_g(Index n, Number *x, Bool new_x,
+		   Index m, Index nele_jac,
+		   Index *iRow, Index *jCol, Number *values,
+		   UserDataPtr user_data);
+Bool nl_eval_h(Index n, Number *x, Bool new_x, Number obj_factor,
+	       Index m, Number *lambda, Bool new_lambda,
+	       Index nele_hess, Index *iRow, Index *jCol,
+	       Number *values, UserDataPtr user_data);
+
+/* Compile the model to native code and use that from now on. The object
+   is cached in cache_dir, or in $PYIPOPT_CACHE or ~/.cache/pyipopt when
+   that is NULL; a directory or object that is not the user's own, or is
+   writable by others, is refused. Returns 0, or -1 with a message in
+   err. */
+int nl_compile(NLModel *model, const char *cache_dir, char *err,
+	       size_t errlen);
+void nl_uncompile(NLModel *model);
+
+/* f and g at count points at once. X holds the points row by row (count
+   by n), F gets count objective values and G count rows of m constraint
+   values. Returns 0, or -1 when out of memory. */
+int nl_eval_batch(const NLModel *model, const double *X, int count,
+		  double *F, double *G);
+
+#endif
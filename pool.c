@@ -0,0 +1,185 @@
+/* Copyright (c) 2008, Eric You Xu, Washington University
+* All rights reserved.
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the Washington University nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS "AS IS" AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// This file has the thread pool behind blocked constraint evaluation
+/* Workers sleep on a condition variable until pool_run publishes a run,
+   then take tasks off a shared counter until there are none left, so a
+   thread that finishes its blocks early goes on with whatever is still
+   waiting instead of idling. The calling thread takes tasks as well. A
+   run is over when every task is done and every worker that joined it
+   has let go of the counter; only then can the next run reset it. */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pool.h"
+
+struct ThreadPool {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;		/* a new run or shutdown */
+	pthread_cond_t idle;		/* the run may be finished */
+	pthread_t *workers;
+	int nworkers;
+
+	/* the current run, changed under lock */
+	unsigned long generation;
+	PoolTask *fn;
+	void *arg;
+	int ntasks;
+	int busy;			/* workers inside the current run */
+	int shutdown;
+
+	/* taken without the lock */
+	volatile int next;
+	volatile int done;
+	volatile int failed;
+};
+
+static void run_tasks(ThreadPool *pool, PoolTask *fn, void *arg, int ntasks)
+{
+	int task;
+	while ((task = __sync_fetch_and_add(&pool->next, 1)) < ntasks)
+	{
+		if (!fn(arg, task))
+			pool->failed = 1;
+		__sync_fetch_and_add(&pool->done, 1);
+	}
+}
+
+static void *worker(void *p)
+{
+	ThreadPool *pool = (ThreadPool*) p;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;)
+	{
+		while (!pool->shutdown && pool->generation == seen)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if (pool->shutdown) break;
+		seen = pool->generation;
+		PoolTask *fn = pool->fn;
+		void *arg = pool->arg;
+		int ntasks = pool->ntasks;
+		pool->busy++;
+		pthread_mutex_unlock(&pool->lock);
+
+		run_tasks(pool, fn, arg, ntasks);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+ThreadPool *pool_create(int threads)
+{
+	int i;
+	ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+	if (!pool) return NULL;
+	if (threads < 1) threads = 1;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	pool->workers = malloc(sizeof(pthread_t) * threads);
+	if (!pool->workers)
+	{
+		pool_free(pool);
+		return NULL;
+	}
+	for (i = 0; i < threads - 1; i++)
+	{
+		if (pthread_create(&pool->workers[i], NULL, worker, pool))
+		{
+			pool_free(pool);
+			return NULL;
+		}
+		pool->nworkers++;
+	}
+	return pool;
+}
+
+void pool_free(ThreadPool *pool)
+{
+	int i;
+	if (!pool) return;
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nworkers; i++)
+		pthread_join(pool->workers[i], NULL);
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
+
+int pool_run(ThreadPool *pool, int ntasks, PoolTask *fn, void *arg)
+{
+	int task, ok = 1;
+
+	/* not worth waking anybody for */
+	if (pool->nworkers == 0 || ntasks < 2)
+	{
+		for (task = 0; task < ntasks; task++)
+			ok = fn(arg, task) && ok;
+		return ok;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	/* a worker that woke too late for the last run may still be in it */
+	while (pool->busy > 0)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->ntasks = ntasks;
+	pool->next = 0;
+	pool->done = 0;
+	pool->failed = 0;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	run_tasks(pool, fn, arg, ntasks);
+
+	/* the tasks still running belong to workers, which are busy */
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy > 0 || pool->done < ntasks)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	ok = !pool->failed;
+	pthread_mutex_unlock(&pool->lock);
+	return ok;
+}
+
+int pool_default_threads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n < 1 ? 1 : (int) n;
+}
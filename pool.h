@@ -0,0 +1,50 @@
+/* Copyright (c) 2008, Eric You Xu, Washington University
+* All rights reserved.
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the Washington University nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS "AS IS" AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* A small pool of worker threads for running independent tasks, see
+   pool.c. Nothing in here touches Python. */
+
+#ifndef PY_IPOPT_POOL
+#define PY_IPOPT_POOL
+
+/* One task of a run; returns nonzero on success */
+typedef int PoolTask(void *arg, int task);
+
+typedef struct ThreadPool ThreadPool;
+
+/* A pool of threads-1 workers; the thread calling pool_run is the last
+   one. Returns NULL when out of memory or threads can't be started. */
+ThreadPool *pool_create(int threads);
+void pool_free(ThreadPool *pool);
+
+/* Run fn(arg, 0..ntasks-1) on the pool and wait for all of them. Returns
+   nonzero if every task succeeded. Runs on one pool don't overlap. */
+int pool_run(ThreadPool *pool, int ntasks, PoolTask *fn, void *arg);
+
+/* Number of processors online, at least 1 */
+int pool_default_threads(void);
+
+#endif
@@ -25,28 +25,193 @@
 */
 
 #include "hook.h"
+#include "nlmodel.h"
+#include "pool.h"
+#include "iterlog.h"
 
 
 
 /* Object Section */
+
+/* The problems alive, linked through the objects, all under the GIL */
+static problem *live_head = NULL;
+
+static void live_add(problem *p)
+{
+	p->live_prev = NULL;
+	p->live_next = live_head;
+	if (live_head) live_head->live_prev = p;
+	live_head = p;
+}
+
+static void live_remove(problem *p)
+{
+	if (p->live_prev) p->live_prev->live_next = p->live_next;
+	else live_head = p->live_next;
+	if (p->live_next) p->live_next->live_prev = p->live_prev;
+}
+
 // sig of this is void foo(PyO*)
 static void problem_dealloc(PyObject* self)
 {
 	problem* temp = (problem*)self;
+	live_remove(temp);
+	if (temp->nlp) FreeIpoptProblem(temp->nlp);
+	if (temp->data) clear_dispatch_data(temp->data);
 	free(temp->data);
-	return;
+	PyObject_Del(self);
 }
 
-PyObject* solve (PyObject* self, PyObject* args);
+PyObject* solve (PyObject* self, PyObject* args, PyObject* keywds);
 PyObject* close_model (PyObject* self, PyObject* args);
+PyObject* enter_model (PyObject* self, PyObject* args);
+PyObject* add_block (PyObject* self, PyObject* args, PyObject* keywds);
+PyObject* set_threads (PyObject* self, PyObject* args);
+PyObject* get_stats (PyObject* self, PyObject* args);
+PyObject* set_timeline (PyObject* self, PyObject* args);
+PyObject* timeline_json (PyObject* self, PyObject* args);
+PyObject* set_intermediate (PyObject* self, PyObject* args);
+PyObject* set_bounds (PyObject* self, PyObject* args, PyObject* keywds);
 
-static char PYIPOPT_SOLVE_DOC[] = "solve(x) -> (x, ml, mu, obj)\n \
+static char PYIPOPT_SOLVE_DOC[] = "solve(x[, userdata, log, log_multipliers, deadline, max_evals, mult_g, mult_xL, mult_xU, out, memory]) -> dict\n \
         \n \
         Call Ipopt to solve problem created before and return  \n \
         a tuple that contains final solution x, upper and lower\n \
-        bound for multiplier and final objective function obj. ";
+        bound for multiplier and final objective function obj. \n \
+        x may be omitted for problems made by create_from_nl. \n \
+        log=path appends every accepted iterate (iteration, objective \n \
+        and x) to a memory-mapped file, see read_log; with \n \
+        log_multipliers=True the constraint multipliers go in as well. \n \
+        deadline (seconds) and max_evals (evaluations, structure calls \n \
+        not counted) stop the solve from C once they run out. They \n \
+        are checked before each callback and at each iteration, so a \n \
+        callback that blocks overruns the deadline until it returns; the \n \
+        result then has the last accepted x and its objective, and \n \
+        status is Deadline_Exceeded or Evaluation_Budget_Exceeded. g \n \
+        and the multipliers are NaN if the stop came mid-iteration. \n \
+        mult_g, mult_xL and mult_xU start Ipopt from given multipliers \n \
+        (set warm_start_init_point to yes for it to use them). They \n \
+        must be contiguous float64 arrays, are updated in place and \n \
+        come back as the result's, so a previous result can be fed \n \
+        straight back in. \n \
+        out=problem.result() makes Ipopt write into that object's arrays \n \
+        instead, which is returned in place of a dict; solving again \n \
+        from out.x with out=out allocates nothing. \n \
+        memory=True adds memory: peak_rss_delta, how far the resident \n \
+        set grew above its size at the start in bytes (None where it \n \
+        can't be told, which includes another memory=True solve having \n \
+        started meanwhile, since the peak is process-wide), callbacks, \n \
+        the count and bytes of the numpy arrays each eval_* callback \n \
+        allocated, and kkt_matrix_nonzeros, an estimate of the nonzeros \n \
+        of the matrix Ipopt factors worked out from the problem's sizes. \n \
+        It leaves out fill-in, so the factor itself is larger; Ipopt \n \
+        doesn't report that through its C interface. \n \
+        history holds one array per quantity Ipopt reports each \n \
+        iteration: iter, obj, inf_pr, inf_du, mu, d_norm, \n \
+        regularization_size, alpha_du, alpha_pr, ls_trials and alg_mod. ";
+
+static char PYIPOPT_CLOSE_DOC[] = "After all the solving, close the model\n \
+        \n \
+        This frees Ipopt's problem and lets go of the callbacks, the \n \
+        userdata and every buffer; the problem can't be solved again. \n \
+        Leaving a with block closes the problem as well. ";
+
+static char PYIPOPT_ADD_BLOCK_DOC[] = "add_block(rows, nonzeros, eval_g, eval_jac_g[, user_data])\n \
+        \n \
+        Evaluate the constraint rows rows = (start, end) and the Jacobian \n \
+        nonzeros nonzeros = (start, end) with C functions of their own, \n \
+        given in any of the forms create() accepts. Once there are blocks \n \
+        they replace eval_g and eval_jac_g, so together they must cover \n \
+        every row and every nonzero exactly once. \n \
+        eval_g is called with m set to the number of rows in the block and \n \
+        g pointing at its first row; eval_jac_g with nele_jac set to the \n \
+        number of nonzeros and values pointing at the first of them, and \n \
+        the structure call gives rows counted from the block's first row. \n \
+        The blocks of one call run in parallel, see threads(). ";
+
+static char PYIPOPT_STATS_DOC[] = "stats([reset]) -> dict\n \
+        \n \
+        Counters kept since the problem was created or last reset. There \n \
+        is a dict for each of eval_f, eval_grad_f, eval_g, eval_jac_g and \n \
+        eval_h with calls, new_x (calls with a new x), structure (calls \n \
+        for the sparsity structure), time and max_time (wall seconds, \n \
+        Python included) and bytes (copied into Ipopt's buffers), and one \n \
+        for solve with the same for IpoptSolve. callback_time is the total \n \
+        time of the callbacks, so solve time minus callback_time is what \n \
+        Ipopt spent itself. reset=True clears the counters after reading. ";
+
+static char PYIPOPT_TIMELINE_DOC[] = "timeline(capacity)\n \
+        \n \
+        Record a timestamped event for every callback, apply_new and \n \
+        eval_all call and every IpoptSolve from now on, keeping the latest \n \
+        capacity of them in a buffer allocated here. 0 turns it off and \n \
+        drops what was recorded. See timeline_json(). ";
 
-static char PYIPOPT_CLOSE_DOC[] = "After all the solving, close the model\n";
+static char PYIPOPT_TIMELINE_JSON_DOC[] = "timeline_json() -> str\n \
+        \n \
+        The recorded events in Chrome's trace event format, for \n \
+        chrome://tracing or Perfetto. Times are in microseconds from the \n \
+        first event kept; otherData.dropped says how many older events \n \
+        the buffer had no room for. ";
+
+static char PYIPOPT_INTERMEDIATE_DOC[] = "intermediate(callback[, every])\n \
+        \n \
+        Call callback(alg_mod, iter_count, obj_value, inf_pr, inf_du, mu, \n \
+        d_norm, regularization_size, alpha_du, alpha_pr, ls_trials) on \n \
+        every every-th iteration (default 1). Returning False stops the \n \
+        solve; an exception stops it and is raised by solve(). The other \n \
+        iterations never enter Python. None removes the callback. The \n \
+        userdata and params= follow as for the other callbacks. ";
+
+static char PYIPOPT_SET_BOUNDS_DOC[] = "set_bounds([xl, xu, gl, gu])\n \
+        \n \
+        Replace any of the variable and constraint bounds of the problem. \n \
+        Everything else stays: the callbacks, the sparsity structures \n \
+        already fetched, the options and the statistics, so the next \n \
+        solve starts without calling Python for the structure again. \n \
+        See also problem.params, an array every Python callback gets as \n \
+        the keyword argument params, for other data that changes between \n \
+        solves. ";
+
+static char PYIPOPT_THREADS_DOC[] = "threads(k)\n \
+        \n \
+        Run constraint blocks on k threads, or one per processor for 0 \n \
+        (the default). ";
+
+/* Keep an option that was accepted, so that set_bounds() can set it again
+   on the new IpoptProblem; steals value */
+static int remember_option(DispatchData *data, const char *name,
+			   PyObject *value)
+{
+	int r;
+	if (!value) return -1;
+	if (!data->options && !(data->options = PyDict_New()))
+	{
+		Py_DECREF(value);
+		return -1;
+	}
+	r = PyDict_SetItemString(data->options, name, value);
+	Py_DECREF(value);
+	return r;
+}
+
+/* The options go into the OptionsList IpoptSolve reads from, so none of
+   the setters may run while another thread is solving the problem */
+static IpoptProblem option_nlp(problem *temp)
+{
+	if (temp->nlp == NULL)
+	{
+		PyErr_SetString(PyExc_ValueError, "the problem has been closed");
+		return NULL;
+	}
+	if (temp->in_solve)
+	{
+		PyErr_SetString(PyExc_RuntimeError, 
+				"cannot set options while the problem is being solved");
+		return NULL;
+	}
+	return (IpoptProblem)(temp->nlp);
+}
 
 static char PYIPOPT_ADD_STR_OPTION_DOC[] = "Set the String option for Ipopt. See the document for Ipopt for more information.\n";
 
@@ -54,7 +219,8 @@ static char PYIPOPT_ADD_STR_OPTION_DOC[] = "Set the String option for Ipopt. See
 PyObject *add_str_option(PyObject *self, PyObject *args)
 {
   	problem* temp = (problem*)self; 	
-  	IpoptProblem nlp = (IpoptProblem)(temp->nlp);
+  	IpoptProblem nlp = option_nlp(temp);
+  	if (nlp == NULL) return NULL;
   	
   	char* param;
   	char* value;
@@ -69,6 +235,8 @@ PyObject *add_str_option(PyObject *self, PyObject *args)
   	ret = AddIpoptStrOption(nlp, (char*) param, value);
 	if (ret) 
 	{
+		if (remember_option(temp->data, param, PyString_FromString(value)) < 0)
+			return NULL;
 		Py_INCREF(Py_True);
 		return Py_True;
 	}
@@ -85,7 +253,8 @@ static char PYIPOPT_ADD_INT_OPTION_DOC[] = "Set the Int option for Ipopt. See th
 PyObject *add_int_option(PyObject *self, PyObject *args)
 {
   	problem* temp = (problem*)self; 	
-  	IpoptProblem nlp = (IpoptProblem)(temp->nlp);
+  	IpoptProblem nlp = option_nlp(temp);
+  	if (nlp == NULL) return NULL;
   	
   	char* param;
   	int value;
@@ -101,6 +270,8 @@ PyObject *add_int_option(PyObject *self, PyObject *args)
   	ret = AddIpoptIntOption(nlp, (char*) param, value);
 	if (ret) 
 	{
+		if (remember_option(temp->data, param, PyInt_FromLong(value)) < 0)
+			return NULL;
 		Py_INCREF(Py_True);
 		return Py_True;
 	}
@@ -117,7 +288,8 @@ static char PYIPOPT_ADD_NUM_OPTION_DOC[] = "Set the Number/double option for Ipo
 PyObject *add_num_option(PyObject *self, PyObject *args)
 {
   	problem* temp = (problem*)self; 	
-  	IpoptProblem nlp = (IpoptProblem)(temp->nlp);
+  	IpoptProblem nlp = option_nlp(temp);
+  	if (nlp == NULL) return NULL;
   	
   	char* param;
   	double value = 1.;
@@ -132,6 +304,8 @@ PyObject *add_num_option(PyObject *self, PyObject *args)
  	ret = AddIpoptNumOption(nlp, (char*) param, value);
 	if (ret) 
 	{
+		if (remember_option(temp->data, param, PyFloat_FromDouble(value)) < 0)
+			return NULL;
 		Py_INCREF(Py_True);
 		return Py_True;
 	}
@@ -144,22 +318,194 @@ PyObject *add_num_option(PyObject *self, PyObject *args)
 
 
 
+/* The result of solve(out=): attributes, or keys as in the dict solve()
+   returns otherwise */
+static PyObject *result_item(result *self, const char *name)
+{
+	PyObject *item = NULL;
+	if (strcmp(name, "x") == 0) item = (PyObject*) self->x;
+	else if (strcmp(name, "mult_xL") == 0) item = (PyObject*) self->mult_xL;
+	else if (strcmp(name, "mult_xU") == 0) item = (PyObject*) self->mult_xU;
+	else if (strcmp(name, "mult_g") == 0) item = (PyObject*) self->mult_g;
+	else if (strcmp(name, "g") == 0) item = (PyObject*) self->g;
+	else if (strcmp(name, "f") == 0) return PyFloat_FromDouble(self->f);
+	else if (strcmp(name, "memory") == 0) 
+		item = self->memory ? self->memory : Py_None;
+	else if (strcmp(name, "status") == 0)
+	{
+		if (self->status) return PyString_FromString(self->status);
+		item = Py_None;
+	}
+	if (item) Py_INCREF(item);
+	return item;
+}
+
+static PyObject *result_getattr(PyObject *self, char *name)
+{
+	PyObject *item = result_item((result*) self, name);
+	if (!item) 
+		PyErr_Format(PyExc_AttributeError, 
+			     "result has no attribute '%s'", name);
+	return item;
+}
+
+static PyObject *result_subscript(PyObject *self, PyObject *key)
+{
+	PyObject *item = NULL;
+	if (PyString_Check(key))
+		item = result_item((result*) self, PyString_AS_STRING(key));
+	if (!item) PyErr_SetObject(PyExc_KeyError, key);
+	return item;
+}
+
+static void result_dealloc(PyObject *self)
+{
+	result *temp = (result*) self;
+	Py_XDECREF(temp->x);
+	Py_XDECREF(temp->mult_xL);
+	Py_XDECREF(temp->mult_xU);
+	Py_XDECREF(temp->mult_g);
+	Py_XDECREF(temp->g);
+	Py_XDECREF(temp->memory);
+	PyObject_Del(self);
+}
+
+static PyMappingMethods result_as_mapping = {
+	0,				/*mp_length*/
+	result_subscript,		/*mp_subscript*/
+	0,				/*mp_ass_subscript*/
+};
+
+PyTypeObject ResultType = {
+    PyObject_HEAD_INIT(&PyType_Type)
+    0,                         /*ob_size*/
+    "pyipopt.Result",          /*tp_name*/
+    sizeof(result),            /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    result_dealloc,            /*tp_dealloc*/
+    0,                         /*tp_print*/
+    result_getattr,            /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    &result_as_mapping,        /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Preallocated output of solve(out=)", /* tp_doc */
+};
+
+static char PYIPOPT_RESULT_DOC[] = "result() -> Result\n \
+        \n \
+        Output arrays for solve(x0, out=result), allocated once: x, \n \
+        mult_xL, mult_xU, mult_g and g, all zero to start with, plus f \n \
+        and status after a solve. They read as attributes or as keys \n \
+        like the dict solve() returns otherwise, without history. ";
+
+PyObject *new_result(PyObject *self, PyObject *args)
+{
+	problem *temp = (problem*) self;
+	npy_intp dX[1] = {temp->n};
+	npy_intp dL[1] = {temp->m};
+	result *r;
+
+	if (!PyArg_ParseTuple(args, ":result")) return NULL;
+	r = PyObject_NEW(result, &ResultType);
+	if (!r) return NULL;
+	r->f = 0;
+	r->status = NULL;
+	r->memory = NULL;
+	r->x = (PyArrayObject*) PyArray_ZEROS(1, dX, PyArray_DOUBLE, 0);
+	r->mult_xL = (PyArrayObject*) PyArray_ZEROS(1, dX, PyArray_DOUBLE, 0);
+	r->mult_xU = (PyArrayObject*) PyArray_ZEROS(1, dX, PyArray_DOUBLE, 0);
+	r->mult_g = (PyArrayObject*) PyArray_ZEROS(1, dL, PyArray_DOUBLE, 0);
+	r->g = (PyArrayObject*) PyArray_ZEROS(1, dL, PyArray_DOUBLE, 0);
+	if (!r->x || !r->mult_xL || !r->mult_xU || !r->mult_g || !r->g)
+	{
+		Py_DECREF(r);
+		return NULL;
+	}
+	return (PyObject*) r;
+}
+
 PyMethodDef problem_methods[] = {
-	{ "solve", 	solve, METH_VARARGS, PYIPOPT_SOLVE_DOC},
+	{ "solve", 	(PyCFunction)solve, METH_VARARGS | METH_KEYWORDS, PYIPOPT_SOLVE_DOC},
 	{ "close",  close_model, METH_VARARGS, PYIPOPT_CLOSE_DOC}, 
+	{ "__enter__", enter_model, METH_VARARGS, NULL},
+	{ "__exit__", close_model, METH_VARARGS, PYIPOPT_CLOSE_DOC},
 	{ "int_option", add_int_option, METH_VARARGS, PYIPOPT_ADD_INT_OPTION_DOC},
 	{ "str_option", add_str_option, METH_VARARGS, PYIPOPT_ADD_STR_OPTION_DOC},
 	{ "num_option", add_num_option, METH_VARARGS, PYIPOPT_ADD_NUM_OPTION_DOC},
+	{ "add_block", (PyCFunction)add_block, METH_VARARGS | METH_KEYWORDS, PYIPOPT_ADD_BLOCK_DOC},
+	{ "threads", set_threads, METH_VARARGS, PYIPOPT_THREADS_DOC},
+	{ "stats", get_stats, METH_VARARGS, PYIPOPT_STATS_DOC},
+	{ "timeline", set_timeline, METH_VARARGS, PYIPOPT_TIMELINE_DOC},
+	{ "timeline_json", timeline_json, METH_VARARGS, PYIPOPT_TIMELINE_JSON_DOC},
+	{ "intermediate", set_intermediate, METH_VARARGS, PYIPOPT_INTERMEDIATE_DOC},
+	{ "set_bounds", (PyCFunction)set_bounds, METH_VARARGS | METH_KEYWORDS, PYIPOPT_SET_BOUNDS_DOC},
+	{ "result", new_result, METH_VARARGS, PYIPOPT_RESULT_DOC},
 	{NULL, NULL},
 };
 
 PyObject *problem_getattr(PyObject* self, char* attrname)
 { 
 	PyObject *result = NULL;
+	DispatchData *data = ((problem*) self)->data;
+	if (strcmp(attrname, "params") == 0)
+	{
+		result = data->params ? data->params : Py_None;
+		Py_INCREF(result);
+		return result;
+	}
     result = Py_FindMethod(problem_methods, self, attrname);
     return result;
 }
 
+/* Only params can be set. It is kept as given when it already is a
+   contiguous float64 array, so changing it in place between solves is
+   enough; anything else is converted. */
+int problem_setattr(PyObject* self, char* attrname, PyObject *value)
+{
+	problem *temp = (problem*) self;
+	DispatchData *data = temp->data;
+	PyObject *params = NULL, *kw = NULL;
+
+	if (strcmp(attrname, "params") != 0)
+	{
+		PyErr_Format(PyExc_AttributeError, 
+			     "cannot set attribute '%s' of a problem", attrname);
+		return -1;
+	}
+	if (temp->in_solve)
+	{
+		PyErr_SetString(PyExc_RuntimeError, 
+				"cannot change params while the problem is being solved");
+		return -1;
+	}
+	if (value != NULL && value != Py_None)
+	{
+		params = PyArray_FROM_OTF(value, NPY_DOUBLE, NPY_CARRAY);
+		if (!params) return -1;
+		kw = Py_BuildValue("{sO}", "params", params);
+		if (!kw)
+		{
+			Py_DECREF(params);
+			return -1;
+		}
+	}
+	Py_XDECREF(data->params);
+	data->params = params;
+	Py_XDECREF(data->params_kw);
+	data->params_kw = kw;
+	return 0;
+}
+
 PyTypeObject IpoptProblemType = {
     PyObject_HEAD_INIT(&PyType_Type)
     0,                         /*ob_size*/
@@ -169,7 +515,7 @@ PyTypeObject IpoptProblemType = {
     problem_dealloc,           /*tp_dealloc*/
     0,                         /*tp_print*/
     problem_getattr,           /*tp_getattr*/
-    0,                         /*tp_setattr*/
+    problem_setattr,           /*tp_setattr*/
     0,                         /*tp_compare*/
     0,                         /*tp_repr*/
     0,                         /*tp_as_number*/
@@ -183,8 +529,48 @@ PyTypeObject IpoptProblemType = {
     0,                         /*tp_as_buffer*/
     Py_TPFLAGS_DEFAULT,        /*tp_flags*/
     "The IPOPT problem object in python", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    problem_methods,           /* tp_methods, for with's __enter__ and __exit__ */
 };
 
+static Number *copy_numbers(const Number *from, Index len)
+{
+	/* one more so that a problem without constraints gets a buffer */
+	Number *to = (Number*) malloc(sizeof(Number) * (len + 1));
+	if (to) memcpy(to, from, sizeof(Number) * len);
+	return to;
+}
+
+/* An IpoptProblem made from what data keeps: the bounds, the callbacks
+   and the options set on it so far. NULL when out of memory. */
+static IpoptProblem new_nlp(Index n, DispatchData *data)
+{
+	Py_ssize_t pos = 0;
+	PyObject *name, *value;
+	IpoptProblem nlp = CreateIpoptProblem(n, data->x_L, data->x_U,
+				data->m, data->g_L, data->g_U, data->nele_jac,
+				data->nele_hess, 0, &eval_f, &eval_g, 
+				&eval_grad_f, &eval_jac_g, &eval_h);
+	if (!nlp) return NULL;
+	SetIntermediateCallback(nlp, &intermediate_cb);
+	while (data->options && PyDict_Next(data->options, &pos, &name, &value))
+	{
+		char *key = PyString_AS_STRING(name);
+		if (PyString_Check(value))
+			AddIpoptStrOption(nlp, key, PyString_AS_STRING(value));
+		else if (PyInt_Check(value))
+			AddIpoptIntOption(nlp, key, PyInt_AS_LONG(value));
+		else
+			AddIpoptNumOption(nlp, key, PyFloat_AS_DOUBLE(value));
+	}
+	return nlp;
+}
+
 static char PYIPOPT_CREATE_DOC[] = "create(n, xl, xu, m, gl, gu, nnzj, nnzh, eval_f, eval_grad_f, eval_g, eval_jac_g) -> Boolean\n \
         \n \
         Create a problem instance and return True if succeed  \n \
@@ -205,6 +591,7 @@ static char PYIPOPT_CREATE_DOC[] = "create(n, xl, xu, m, gl, gu, nnzj, nnzh, eva
         	it takes one single argument x as input vector \n \
         eval_grad_f calculates gradient for objective function \n \
         eval_g calculates the constraint values and return an array \n \
+        	eval_g and eval_jac_g may be None if add_block gives the constraints \n \
         eval_jac_g calculates the Jacobi matrix. It takes two arguments, \n \
         	the first is the variable x and the second is a Boolean flag \n \
         	if the flag is true, it supposed to return a tuple (row, col) \n \
@@ -213,9 +600,168 @@ static char PYIPOPT_CREATE_DOC[] = "create(n, xl, xu, m, gl, gu, nnzj, nnzh, eva
         		with length nnzj \n \
         eval_h calculates the hessian matrix, it's optional. \n \
         	if omitted, please set nnzh to 0 and Ipopt will use approximated hessian \n \
-        	which will make the convergence slower. ";
+        	which will make the convergence slower. \n \
+        apply_new is called with x whenever Ipopt moves to a new point, optional. \n \
+        \n \
+        The userdata given to solve(), if any, comes after the arguments \n \
+        above, except for apply_new. Once problem.params is set, every \n \
+        Python callback, apply_new, eval_all and the intermediate hook \n \
+        included, also gets params=problem.params as a keyword argument: \n \
+        	eval_f(x[, userdata], params=...), \n \
+        	eval_jac_g(x, False[, out][, userdata], params=...) \n \
+        \n \
+        The x and lambda arrays passed to the callbacks are views over Ipopt's \n \
+        own buffers and are only valid during the call; copy them to keep them. \n \
+        \n \
+        inplace=True switches eval_grad_f, eval_g, eval_jac_g and eval_h (for \n \
+        	the values call) to write their result into an extra out argument \n \
+        	instead of returning a new array: \n \
+        		eval_grad_f(x, out), eval_g(x, out), \n \
+        		eval_jac_g(x, False, out), \n \
+        		eval_h(x, lagrange, obj_factor, False, out) \n \
+        	out is a view over Ipopt's buffer, assign into it with out[:] = ... \n \
+        	and anything the callback returns is ignored. \n \
+        \n \
+        eval_all(x, need) computes several results in one pass, optional. \n \
+        	need is a bit mask of pyipopt.NEED_F, NEED_GRAD_F, NEED_G and \n \
+        	NEED_JAC_G and it returns a dict with at least the asked for \n \
+        	entries among 'f', 'grad_f', 'g' and 'jac_g'. Everything it \n \
+        	returns is cached until x changes and the other callbacks are \n \
+        	answered from that cache, so eval_f, eval_grad_f and eval_g can \n \
+        	be None. eval_jac_g is still used for the structure call, \n \
+        	unless jac_structure is given as well. \n \
+        \n \
+        jac_structure=(row, col) and hess_structure=(row, col) give the \n \
+        	sparsity structures up front, optional. Both are checked and \n \
+        	stored once and eval_jac_g / eval_h are then only called for \n \
+        	values. The index arrays may be int32 or int64 in either byte \n \
+        	order; the structure calls accept the same. \n \
+        \n \
+        The values calls of eval_jac_g and eval_h may also return a \n \
+        	scipy.sparse matrix (csr, csc or coo) whose entries lie in the \n \
+        	declared structure; they are put in structure order through a \n \
+        	map worked out on the first call and again whenever the \n \
+        	pattern changes. \n \
+        \n \
+        Any of eval_f, eval_grad_f, eval_g, eval_jac_g and eval_h may be a \n \
+        	C function instead, with the signature from IpStdCInterface.h: \n \
+        	a PyCapsule, an integer address (cffi: \n \
+        	int(ffi.cast(\"uintptr_t\", fp))), a ctypes CFUNCTYPE object or \n \
+        	a numba cfunc. These are called directly by Ipopt without the \n \
+        	GIL. user_data=, given the same way, is the opaque pointer they \n \
+        	receive as their last argument. ";
         	
-static PyObject *create(PyObject *obj, PyObject *args)
+/* The address of a C function or pointer passed from Python: a PyCapsule,
+   an integer address (e.g. int(ffi.cast("uintptr_t", fp)) from cffi), a
+   ctypes function pointer or c_void_p, or anything with an integer
+   address attribute such as a numba cfunc. Returns 1 and sets *address
+   for those, 0 for anything else (a Python callable) and -1 on error. */
+static int native_address(PyObject *obj, void **address)
+{
+	static PyObject *cfuncptr = NULL, *voidp = NULL, *cast = NULL;
+	PyObject *value = NULL;
+
+	if (PyCapsule_CheckExact(obj))
+	{
+		*address = PyCapsule_GetPointer(obj, PyCapsule_GetName(obj));
+		return *address ? 1 : -1;
+	}
+	if ((PyInt_Check(obj) || PyLong_Check(obj)) && !PyBool_Check(obj))
+	{
+		*address = PyLong_AsVoidPtr(obj);
+		return PyErr_Occurred() ? -1 : 1;
+	}
+	if (cast == NULL)
+	{
+		PyObject *ctypes = PyImport_ImportModule("ctypes");
+		if (ctypes)
+		{
+			cfuncptr = PyObject_GetAttrString(ctypes, "_CFuncPtr");
+			voidp = PyObject_GetAttrString(ctypes, "c_void_p");
+			cast = PyObject_GetAttrString(ctypes, "cast");
+			Py_DECREF(ctypes);
+		}
+		if (!cfuncptr || !voidp || !cast)
+		{
+			/* no ctypes, so no ctypes objects either */
+			Py_CLEAR(cfuncptr);
+			Py_CLEAR(voidp);
+			Py_CLEAR(cast);
+			cast = Py_None;
+			Py_INCREF(cast);
+		}
+		PyErr_Clear();
+	}
+	if (cast != Py_None && PyObject_IsInstance(obj, cfuncptr) == 1)
+	{
+		PyObject *p = PyObject_CallFunctionObjArgs(cast, obj, voidp, NULL);
+		if (!p) return -1;
+		value = PyObject_GetAttrString(p, "value");
+		Py_DECREF(p);
+	}
+	else if (cast != Py_None && PyObject_IsInstance(obj, voidp) == 1)
+		value = PyObject_GetAttrString(obj, "value");
+	else if (PyObject_HasAttrString(obj, "address"))
+	{
+		value = PyObject_GetAttrString(obj, "address");
+		if (value && !PyInt_Check(value) && !PyLong_Check(value))
+		{
+			Py_DECREF(value);
+			return 0;
+		}
+	}
+	else
+		return 0;
+	if (!value) return -1;
+	*address = value == Py_None ? NULL : PyLong_AsVoidPtr(value);
+	Py_DECREF(value);
+	return PyErr_Occurred() ? -1 : 1;
+}
+
+/* Sort one callback argument: a C function goes into *fn and the object
+   into owner, a Python callable stays in *obj */
+static int split_callback(PyObject **obj, void **fn, PyObject *owner)
+{
+	int rc;
+	if (*obj == NULL || *obj == Py_None) return 0;
+	rc = native_address(*obj, fn);
+	if (rc < 0) return -1;
+	if (rc == 0) return 0;
+	if (*fn == NULL)
+	{
+		PyErr_SetString(PyExc_ValueError, "NULL function pointer");
+		return -1;
+	}
+	if (PyList_Append(owner, *obj)) return -1;
+	*obj = NULL;
+	return 0;
+}
+
+/* create() takes references to the Python objects it keeps only once it
+   has succeeded; until then they are borrowed from its arguments */
+static void take_borrowed(DispatchData *data)
+{
+	Py_XINCREF(data->eval_f_python);
+	Py_XINCREF(data->eval_grad_f_python);
+	Py_XINCREF(data->eval_g_python);
+	Py_XINCREF(data->eval_jac_g_python);
+	Py_XINCREF(data->eval_h_python);
+	Py_XINCREF(data->apply_new_python);
+	Py_XINCREF(data->eval_all_python);
+}
+
+static void forget_borrowed(DispatchData *data)
+{
+	data->eval_f_python = NULL;
+	data->eval_grad_f_python = NULL;
+	data->eval_g_python = NULL;
+	data->eval_jac_g_python = NULL;
+	data->eval_h_python = NULL;
+	data->apply_new_python = NULL;
+	data->eval_all_python = NULL;
+}
+
+static PyObject *create(PyObject *obj, PyObject *args, PyObject *keywds)
 {
 	PyObject *f; 
 	PyObject *gradf;
@@ -223,6 +769,11 @@ static PyObject *create(PyObject *obj, PyObject *args)
 	PyObject *jacg;
 	PyObject *h = NULL;
 	PyObject *applynew = NULL;
+	PyObject *evalall = NULL;
+	PyObject *jacstruct = NULL;
+	PyObject *hessstruct = NULL;
+	PyObject *userptr = NULL;
+	void *address;
 	
 	DispatchData myowndata;
 	
@@ -237,24 +788,29 @@ static PyObject *create(PyObject *obj, PyObject *args)
 	
 	int nele_jac;
 	int nele_hess;
+	int inplace = 0;
 	
 	double* xldata, *xudata;
 	double* gldata, *gudata;
 	
-	double result;
 	int i;
+	Number* x_L = NULL;                  /* lower bounds on x */
+	Number* x_U = NULL;                  /* upper bounds on x */
+	Number* g_L = NULL;                  /* lower bounds on g */
+	Number* g_U = NULL;                  /* upper bounds on g */
     
-	// Init the myowndata field
-	myowndata.eval_f_python = NULL;
-	myowndata.eval_grad_f_python = NULL; 
-	myowndata.eval_g_python = NULL;
-	myowndata.eval_jac_g_python = NULL;
-	myowndata.eval_h_python = NULL;
-	myowndata.apply_new_python = NULL;
-	myowndata.userdata = NULL;
+	// Init the myowndata field, every pointer in it starts out NULL
+	memset(&myowndata, 0, sizeof(DispatchData));
     
+	static char *kwlist[] = {"n", "xl", "xu", "m", "gl", "gu", 
+				 "nnzj", "nnzh", "eval_f", "eval_grad_f",
+				 "eval_g", "eval_jac_g", "eval_h", "apply_new",
+				 "inplace", "eval_all", "jac_structure",
+				 "hess_structure", "user_data", NULL};
+
 	// "O!", &PyArray_Type &a_x 
-	if (!PyArg_ParseTuple(args, "iO!O!iO!O!iiOOOO|OO", 
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "iO!O!iO!O!iiOOOO|OOiOOOO", 
+			      kwlist,
 			      &n, &PyArray_Type, &xL, 
 			      &PyArray_Type, &xU, 
 			      &m, 
@@ -262,19 +818,77 @@ static PyObject *create(PyObject *obj, PyObject *args)
 			      &PyArray_Type, &gU,
 			      &nele_jac, &nele_hess,
 			      &f, &gradf, &g, &jacg, 
-			      &h, &applynew)) 
+			      &h, &applynew, &inplace, &evalall,
+			      &jacstruct, &hessstruct, &userptr)) 
 	{
 		return NULL;
 	}    
+	myowndata.inplace = inplace ? 1 : 0;
+
+	/* with eval_all the separate value callbacks become optional */
+	if (evalall == Py_None) evalall = NULL;
+	if (evalall != NULL)
+	{
+		if (!PyCallable_Check(evalall))
+		{
+			PyErr_SetString(PyExc_TypeError, 
+					"Need a callable object for function eval_all.");
+			return NULL;
+		}
+		if (f == Py_None) f = NULL;
+		if (gradf == Py_None) gradf = NULL;
+		if (g == Py_None) g = NULL;
+		myowndata.eval_all_python = evalall;
+	}
+	if (jacstruct == Py_None) jacstruct = NULL;
+	if (hessstruct == Py_None) hessstruct = NULL;
+	/* a known structure and eval_all leave nothing for eval_jac_g to do */
+	if (evalall != NULL && jacstruct != NULL && jacg == Py_None) jacg = NULL;
+	/* constraint blocks (add_block) can stand in for these two */
+	if (g == Py_None) g = NULL;
+	if (jacg == Py_None) jacg = NULL;
+	if (h == Py_None) h = NULL;
+
+	/* C functions are installed as they are and never see Python */
+	if (!(myowndata.native.owner = PyList_New(0))) return NULL;
+#define NATIVE(obj, field, type)					\
+	do								\
+	{								\
+		address = NULL;						\
+		if (split_callback(&obj, &address, myowndata.native.owner))	\
+			goto fail;					\
+		myowndata.native.field = (type) address;		\
+	} while (0)
+	NATIVE(f, eval_f, Eval_F_CB);
+	NATIVE(gradf, eval_grad_f, Eval_Grad_F_CB);
+	NATIVE(g, eval_g, Eval_G_CB);
+	NATIVE(jacg, eval_jac_g, Eval_Jac_G_CB);
+	NATIVE(h, eval_h, Eval_H_CB);
+#undef NATIVE
+	if (userptr != NULL && userptr != Py_None)
+	{
+		int rc = native_address(userptr, &address);
+		if (rc < 0) goto fail;
+		if (rc == 0)
+		{
+			PyErr_SetString(PyExc_TypeError, 
+					"user_data must be a pointer (capsule, int or ctypes)");
+			goto fail;
+		}
+		myowndata.native.user_data = address;
+		if (PyList_Append(myowndata.native.owner, userptr)) goto fail;
+	}
         
-	if (!PyCallable_Check(f)     ||
-	    !PyCallable_Check(gradf) || 
-	    !PyCallable_Check(g)     ||
-	    !PyCallable_Check(jacg))
+	if ((f && !PyCallable_Check(f))         ||
+	    (gradf && !PyCallable_Check(gradf)) || 
+	    (g && !PyCallable_Check(g))         ||
+	    (jacg && !PyCallable_Check(jacg))   ||
+	    (!f && !evalall && !myowndata.native.eval_f)          ||
+	    (!gradf && !evalall && !myowndata.native.eval_grad_f))
 	{
 		PyErr_SetString(PyExc_TypeError, 
 				"Need a callable object for function!");
-		return NULL;
+		goto fail;
 	}
 	myowndata.eval_f_python      = f;
 	myowndata.eval_grad_f_python = gradf;
@@ -283,18 +897,25 @@ static PyObject *create(PyObject *obj, PyObject *args)
 	// logger("D field assigned %p\n", &myowndata);
 	// logger("D field assigned %p\n",myowndata.eval_jac_g_python );
 		
+	if (applynew == Py_None) applynew = NULL;
 	if (h !=NULL )
 	{
 		if (!PyCallable_Check(h))
 		{
 			PyErr_SetString(PyExc_TypeError, 
 					"Need a callable object for function h.");
-			return NULL;
+			goto fail;
 		}
 		myowndata.eval_h_python	= h;
 	}
-	else
+	else if (!myowndata.native.eval_h)
 	{
+		if (hessstruct != NULL)
+		{
+			PyErr_SetString(PyExc_ValueError, 
+					"hess_structure needs an eval_h function");
+			goto fail;
+		}
 		logger("[PyIPOPT] Ipopt will use Hessian approximation.\n");
 	}
 
@@ -304,23 +925,47 @@ static PyObject *create(PyObject *obj, PyObject *args)
 		{
 			PyErr_SetString(PyExc_TypeError, 
 					"Need a callable object for function applynew.");
-			return NULL;
+			goto fail;
 		}
 		myowndata.apply_new_python = applynew;
 	}
-		
-	Number* x_L = NULL;                  /* lower bounds on x */
-	Number* x_U = NULL;                  /* upper bounds on x */
-	Number* g_L = NULL;                  /* lower bounds on g */
-	Number* g_U = NULL;                  /* upper bounds on g */
     
 	if (n<0) {
 		PyErr_SetString(PyExc_ValueError, "Input dimension must be greater than 1");
-		return NULL;
+		goto fail;
 	}
 	if (m<0) {
 		PyErr_SetString(PyExc_ValueError, "Number of constraints be positive or zero");
-		return NULL;
+		goto fail;
+	}
+	myowndata.m = m;
+	myowndata.nele_jac = nele_jac;
+
+	if (jacstruct != NULL)
+	{
+		myowndata.jac_structure = convert_structure(jacstruct, nele_jac,
+							m, n, "jac_structure");
+		if (!myowndata.jac_structure) goto fail;
+	}
+	if (hessstruct != NULL)
+	{
+		myowndata.hess_structure = convert_structure(hessstruct, nele_hess,
+							n, n, "hess_structure");
+		if (!myowndata.hess_structure) goto fail;
+	}
+
+	if (evalall != NULL)
+	{
+		Number *cache = (Number*)malloc(sizeof(Number)*(2*n + m + nele_jac + 1));
+		if (!cache)
+		{
+			PyErr_SetString(PyExc_SystemError, "Cannot allocate memory");
+			goto fail;
+		}
+		myowndata.cache_x = cache;
+		myowndata.cache_grad_f = cache + n;
+		myowndata.cache_g = cache + 2*n;
+		myowndata.cache_jac = cache + 2*n + m;
 	}
 			
 	x_L = (Number*)malloc(sizeof(Number)*n);
@@ -328,7 +973,7 @@ static PyObject *create(PyObject *obj, PyObject *args)
 	if (!x_L || !x_U)
 	{
 		PyErr_SetString(PyExc_SystemError, "Cannot allocate memory");
-		return NULL;
+		goto fail;
 	}
     
 	xldata = (double*)xL->data;
@@ -343,7 +988,7 @@ static PyObject *create(PyObject *obj, PyObject *args)
 	if (!g_L || !g_U)
 	{
 		PyErr_SetString(PyExc_SystemError, "Cannot allocate memory");
-		return NULL;
+		goto fail;
 	}
 		
 	gldata = (double*)gL->data;
@@ -357,162 +1002,1172 @@ static PyObject *create(PyObject *obj, PyObject *args)
 
 	/* create the Ipopt Problem */
 	  	
-	int C_indexstyle = 0;
 	logger("[PyIPOPT] nele_hess is %d\n", nele_hess);
-	IpoptProblem thisnlp = CreateIpoptProblem(n, x_L, x_U, m, g_L, g_U, nele_jac, nele_hess, C_indexstyle,  &eval_f, &eval_g, &eval_grad_f,  &eval_jac_g, &eval_h);
+	myowndata.nele_hess = nele_hess;
+	/* kept for set_bounds() from here on */
+	myowndata.x_L = x_L;
+	myowndata.x_U = x_U;
+	myowndata.g_L = g_L;
+	myowndata.g_U = g_U;
+	x_L = x_U = g_L = g_U = NULL;
+	IpoptProblem thisnlp = new_nlp(n, &myowndata);
 	logger("[PyIPOPT] Problem created");
 		
 	// AddIpoptStrOption(thisnlp, "max_iter", 200);
 		
 	problem *object = NULL;
+	DispatchData *dp = NULL;
 		
 	object = PyObject_NEW(problem , &IpoptProblemType);
-	if (!object) return NULL;
+	dp = malloc(sizeof(DispatchData));
+	if (!thisnlp || !object || !dp)
+	{
+		if (thisnlp) FreeIpoptProblem(thisnlp);
+		// not filled in or on the live list yet, problem_dealloc
+		// must not see it
+		if (object) PyObject_Del(object);
+		free(dp);
+		PyErr_NoMemory();
+		goto fail;
+	}
 		
 	object->nlp = thisnlp;
 	object->n = n;
 	object->m = m;
-	DispatchData *dp = malloc(sizeof(DispatchData));
+	object->in_solve = 0;
+	object->in_batch = 0;
+	take_borrowed(&myowndata);
 	memcpy((void*)dp, (void*)&myowndata, sizeof(DispatchData));
 	object->data = dp;
-				
-      	free(x_L);
+	live_add(object);
+	return (PyObject *)object;
+fail:
+	forget_borrowed(&myowndata);
+	clear_dispatch_data(&myowndata);
+	free(x_L);
 	free(x_U);
 	free(g_L);
 	free(g_U);
-	return (PyObject *)object;
-}
-
-static PyObject *pyexctype = NULL, *pyexcval = NULL, *pyexctb = NULL;
-static PyObject *PyExc_SolveError = NULL, *PyExc_SolveExceedMaxIter = NULL;
-
-void save_python_exception(void)
-{
-	PyObject *exc = NULL, *val = NULL, *tb = NULL;
-	PyErr_Fetch(&exc, &val, &tb);
-	if (NULL == exc) return;
-	PyErr_NormalizeException(&exc, &val, &tb);
-	Py_XDECREF(pyexctype);
-	Py_XDECREF(pyexcval);
-	Py_XDECREF(pyexctb);
-	pyexctype = exc;
-	pyexcval = val;
-	pyexctb = tb;
+	return NULL;
 }
 
-int restore_python_exception(void)
-{
-	if (!pyexctype) return FALSE;
-	PyErr_Restore(pyexctype, pyexcval, pyexctb);
-	pyexctype=pyexcval=pyexctb=NULL;
-	return TRUE;
-}
+static char PYIPOPT_CREATE_FROM_NL_DOC[] = "create_from_nl(path[, compile[, cache_dir]]) -> problem\n \
+        \n \
+        Read an AMPL .nl file (text or binary) and create a problem that \n \
+        is evaluated entirely in C; no Python code runs while it is solved. \n \
+        The bounds and the starting point come from the file, and solve() \n \
+        called without x0 starts from that point. Exact Hessians are \n \
+        computed by automatic differentiation, with the sparsity pattern \n \
+        worked out once when the file is read. \n \
+        With compile=True the model is turned into C, built with the \n \
+        system compiler ($CC, or cc) and loaded, instead of interpreting \n \
+        its expression graph. Built models are cached in cache_dir \n \
+        (default $PYIPOPT_CACHE or ~/.cache/pyipopt) under a hash of the \n \
+        model, so each model is only compiled once. The directory and \n \
+        what is loaded from it must belong to you and not be writable by \n \
+        group or others. ";
 
-PyObject *solve(PyObject *self, PyObject *args)
+static PyObject *create_from_nl(PyObject *obj, PyObject *args, PyObject *keywds)
 {
+	char *path;
+	char *cache_dir = NULL;
+	int compile = 0, rc = 0;
+	char err[512];
+	NLModel *model;
+	DispatchData myowndata;
+	problem *object = NULL;
+	DispatchData *dp = NULL;
 
+	static char *kwlist[] = {"path", "compile", "cache_dir", NULL};
 
-    enum ApplicationReturnStatus status; /* Solve return code */
-    int i;
-	
-	
-  	/* Return values */
-  	problem* temp = (problem*)self;
-	const int n=temp->n;
-	const int m=temp->m;
-  	
-  	IpoptProblem nlp = (IpoptProblem)(temp->nlp);
-  	DispatchData* bigfield = (DispatchData*)(temp->data);
-  	
-  	npy_intp dX[1] = {n};
-  	npy_intp dL[1] = {m};
-  	
-  	PyArrayObject *x, *mL, *mU, *lambda, *con;
-  	Number obj;                          /* objective value */
-  	
-	PyArrayObject *x0;
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "s|iz", kwlist,
+					 &path, &compile, &cache_dir)) 
+		return NULL;
 
-	
-	PyObject* myuserdata = NULL;
-	
-	if (!PyArg_ParseTuple(args, "O!|O", &PyArray_Type, &x0, &myuserdata)) 
+	Py_BEGIN_ALLOW_THREADS
+	model = nl_read(path, err, sizeof(err));
+	if (model && compile)
+		rc = nl_compile(model, cache_dir, err, sizeof(err));
+	Py_END_ALLOW_THREADS
+	if (!model)
 	{
+		PyErr_Format(PyExc_ValueError, "%s: %s", path, err);
 		return NULL;
 	}
-	
-	if (myuserdata != NULL)
-	{
-		bigfield->userdata = myuserdata;
-		logger("[PyIPOPT] User specified data field to callback function.\n");
-	}
-		
-	if (nlp == NULL)
+	if (rc)
 	{
-		PyErr_SetString(PyExc_ValueError, "nlp objective passed to solve is NULL. Problem created?");
+		nl_free(model);
+		PyErr_Format(PyExc_RuntimeError, "%s: %s", path, err);
 		return NULL;
 	}
- 	
-	/* set some options */
-  	
-  	// AddIpoptNumOption(nlp, "tol", 1e-8);
-  	// AddIpoptStrOption(nlp, "mu_strategy", "adaptive");
-  	if (bigfield->eval_h_python == NULL)
-  	{
-  		AddIpoptStrOption(nlp, "hessian_approximation","limited-memory");
-		//logger("Can't find eval_h callback function\n");
+
+	memset(&myowndata, 0, sizeof(DispatchData));
+	myowndata.m = model->m;
+	myowndata.nele_jac = model->nnzj;
+	myowndata.nl = model;
+	myowndata.native.eval_f = &nl_eval_f;
+	myowndata.native.eval_grad_f = &nl_eval_grad_f;
+	myowndata.native.eval_g = &nl_eval_g;
+	myowndata.native.eval_jac_g = &nl_eval_jac_g;
+	myowndata.native.eval_h = &nl_eval_h;
+	myowndata.native.user_data = model;
+	myowndata.native.free_user_data = (void (*)(UserDataPtr)) &nl_free;
+	myowndata.nele_hess = model->nnzh;
+	myowndata.x_L = copy_numbers(model->x_L, model->n);
+	myowndata.x_U = copy_numbers(model->x_U, model->n);
+	myowndata.g_L = copy_numbers(model->g_L, model->m);
+	myowndata.g_U = copy_numbers(model->g_U, model->m);
+
+	IpoptProblem thisnlp = NULL;
+	if (myowndata.x_L && myowndata.x_U && myowndata.g_L && myowndata.g_U)
+		thisnlp = new_nlp(model->n, &myowndata);
+	object = PyObject_NEW(problem , &IpoptProblemType);
+	dp = malloc(sizeof(DispatchData));
+	if (!thisnlp || !object || !dp)
+	{
+		if (thisnlp) FreeIpoptProblem(thisnlp);
+		// not filled in or on the live list yet, problem_dealloc
+		// must not see it
+		if (object) PyObject_Del(object);
+		free(dp);
+		clear_dispatch_data(&myowndata);
+		return PyErr_NoMemory();
 	}
-  	/* allocate space for the initial point and set the values */
+	memcpy((void*)dp, (void*)&myowndata, sizeof(DispatchData));
+	object->nlp = thisnlp;
+	object->n = model->n;
+	object->m = model->m;
+	object->in_solve = 0;
+	object->in_batch = 0;
+	object->data = dp;
+	live_add(object);
+	return (PyObject *)object;
+}
+
+static char PYIPOPT_NL_EVAL_BATCH_DOC[] = "nl_eval_batch(problem, X) -> (f, g)\n \
+        \n \
+        Evaluate a problem made by create_from_nl at many points at once. \n \
+        X is a (B, n) array with one point per row; the result is f, an \n \
+        array of B objective values, and g, a (B, m) array of constraint \n \
+        values. The expression graph is walked once per block of points, \n \
+        which is much faster than evaluating the points one by one. ";
+
+static PyObject *nl_eval_batch_py(PyObject *obj, PyObject *args)
+{
+	problem *p;
+	PyObject *xobj;
+	PyArrayObject *X = NULL, *F = NULL, *G = NULL;
+	NLModel *model;
+	npy_intp dims[2];
+	int rc;
+
+	if (!PyArg_ParseTuple(args, "O!O", &IpoptProblemType, &p, &xobj)) 
+		return NULL;
+	model = p->data ? p->data->nl : NULL;
+	if (!model)
+	{
+		PyErr_SetString(PyExc_ValueError,
+				"problem was not created by create_from_nl");
+		return NULL;
+	}
+	X = (PyArrayObject*) PyArray_FROMANY(xobj, NPY_DOUBLE, 2, 2, NPY_IN_ARRAY);
+	if (!X) return NULL;
+	if (X->dimensions[1] != model->n)
+	{
+		PyErr_Format(PyExc_ValueError, "X must have %d columns", model->n);
+		goto error;
+	}
+	dims[0] = X->dimensions[0];
+	dims[1] = model->m;
+	F = (PyArrayObject*) PyArray_SimpleNew(1, dims, PyArray_DOUBLE);
+	G = (PyArrayObject*) PyArray_SimpleNew(2, dims, PyArray_DOUBLE);
+	if (!F || !G) goto error;
+
+	/* close() and set_bounds() wait for this to come back to 0 */
+	p->in_batch++;
+	Py_BEGIN_ALLOW_THREADS
+	rc = nl_eval_batch(model, (double*) X->data, (int) dims[0],
+			   (double*) F->data, (double*) G->data);
+	Py_END_ALLOW_THREADS
+	p->in_batch--;
+	if (rc)
+	{
+		PyErr_NoMemory();
+		goto error;
+	}
+	Py_DECREF(X);
+	return Py_BuildValue("NN", F, G);
+error:
+	Py_XDECREF(X);
+	Py_XDECREF(F);
+	Py_XDECREF(G);
+	return NULL;
+}
+
+PyObject *add_block(PyObject *self, PyObject *args, PyObject *keywds)
+{
+	problem *temp = (problem*) self;
+	DispatchData *data = temp->data;
+	Index row_start, row_end, nz_start, nz_end;
+	PyObject *g, *jacg, *userptr = NULL;
+	void *fn_g = NULL, *fn_jac = NULL, *address = NULL;
+	ConstraintBlock *blocks, *b;
+	int i, rc;
+
+	static char *kwlist[] = {"rows", "nonzeros", "eval_g", "eval_jac_g",
+				 "user_data", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "(ii)(ii)OO|O:add_block",
+					 kwlist, &row_start, &row_end,
+					 &nz_start, &nz_end, &g, &jacg,
+					 &userptr))
+		return NULL;
+	if (temp->in_solve)
+	{
+		PyErr_SetString(PyExc_RuntimeError, 
+				"cannot add blocks while the problem is being solved");
+		return NULL;
+	}
+	if (row_start < 0 || row_end < row_start || row_end > temp->m ||
+	    nz_start < 0 || nz_end < nz_start || nz_end > data->nele_jac)
+	{
+		PyErr_SetString(PyExc_ValueError, "block is out of range");
+		return NULL;
+	}
+	for (i = 0; i < data->nblocks; i++)
+	{
+		b = &data->blocks[i];
+		if ((row_start < b->row_end && b->row_start < row_end) ||
+		    (nz_start < b->nz_end && b->nz_start < nz_end))
+		{
+			PyErr_Format(PyExc_ValueError, 
+				     "block overlaps block %d", i);
+			return NULL;
+		}
+	}
+
+	if ((rc = native_address(g, &fn_g)) > 0)
+		rc = native_address(jacg, &fn_jac);
+	if (rc <= 0)
+	{
+		if (rc == 0)
+			PyErr_SetString(PyExc_TypeError, 
+					"add_block needs C functions for eval_g and eval_jac_g");
+		return NULL;
+	}
+	if (userptr == Py_None) userptr = NULL;
+	if (userptr != NULL)
+	{
+		if ((rc = native_address(userptr, &address)) <= 0)
+		{
+			if (rc == 0)
+				PyErr_SetString(PyExc_TypeError, 
+						"user_data must be a pointer (capsule, int or ctypes)");
+			return NULL;
+		}
+	}
+
+	/* keep whatever the addresses came from */
+	if (!data->native.owner && !(data->native.owner = PyList_New(0)))
+		return NULL;
+	if (PyList_Append(data->native.owner, g) ||
+	    PyList_Append(data->native.owner, jacg) ||
+	    (userptr && PyList_Append(data->native.owner, userptr)))
+		return NULL;
+
+	blocks = realloc(data->blocks, 
+			 sizeof(ConstraintBlock) * (data->nblocks + 1));
+	if (!blocks) return PyErr_NoMemory();
+	data->blocks = blocks;
+	b = &blocks[data->nblocks++];
+	b->row_start = row_start;
+	b->row_end = row_end;
+	b->nz_start = nz_start;
+	b->nz_end = nz_end;
+	b->eval_g = (Eval_G_CB) fn_g;
+	b->eval_jac_g = (Eval_Jac_G_CB) fn_jac;
+	b->user_data = address;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+PyObject *set_threads(PyObject *self, PyObject *args)
+{
+	problem *temp = (problem*) self;
+	int threads;
+
+	if (!PyArg_ParseTuple(args, "i:threads", &threads))
+		return NULL;
+	if (threads < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "threads must be 0 or more");
+		return NULL;
+	}
+	if (temp->in_solve)
+	{
+		PyErr_SetString(PyExc_RuntimeError, 
+				"cannot change threads while the problem is being solved");
+		return NULL;
+	}
+	/* the pool is made again with the new size on first use */
+	temp->data->threads = threads;
+	pool_free(temp->data->pool);
+	temp->data->pool = NULL;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+PyObject *get_stats(PyObject *self, PyObject *args)
+{
+	static const char *names[NSTATS] = {"eval_f", "eval_grad_f", 
+		"eval_g", "eval_jac_g", "eval_h", "solve"};
+	problem *temp = (problem*) self;
+	CallStats *stats = temp->data->stats;
+	PyObject *result, *entry;
+	double callback_time = 0.;
+	int reset = 0, i;
+
+	if (!PyArg_ParseTuple(args, "|i:stats", &reset))
+		return NULL;
+	if (reset && temp->in_solve)
+	{
+		PyErr_SetString(PyExc_RuntimeError, 
+				"cannot reset the counters while the problem is being solved");
+		return NULL;
+	}
+	if (!(result = PyDict_New())) return NULL;
+	for (i = 0; i < NSTATS; i++)
+	{
+		entry = Py_BuildValue("{slslslsdsdsL}", 
+				      "calls", stats[i].calls,
+				      "new_x", stats[i].new_x,
+				      "structure", stats[i].structure,
+				      "time", stats[i].time,
+				      "max_time", stats[i].max_time,
+				      "bytes", stats[i].bytes);
+		if (!entry || PyDict_SetItemString(result, names[i], entry))
+			goto error;
+		Py_DECREF(entry);
+		if (i != STAT_SOLVE) callback_time += stats[i].time;
+	}
+	if (!(entry = PyFloat_FromDouble(callback_time)) ||
+	    PyDict_SetItemString(result, "callback_time", entry))
+		goto error;
+	Py_DECREF(entry);
+	if (reset) memset(stats, 0, sizeof(CallStats) * NSTATS);
+	return result;
+error:
+	Py_XDECREF(entry);
+	Py_DECREF(result);
+	return NULL;
+}
+
+/* Ipopt has no way to change the bounds of an IpoptProblem, so a new one
+   is made from the kept bounds and options; the DispatchData, with the
+   structures and everything else cached, stays as it is */
+PyObject *set_bounds(PyObject *self, PyObject *args, PyObject *keywds)
+{
+	problem *temp = (problem*) self;
+	DispatchData *data = temp->data;
+	PyObject *given[4] = {Py_None, Py_None, Py_None, Py_None};
+	PyArrayObject *arr[4] = {NULL, NULL, NULL, NULL};
+	Number *target[4], *saved = NULL;
+	Index len[4];
+	IpoptProblem nlp;
+	int i, total = 0;
+	static char *kwlist[] = {"xl", "xu", "gl", "gu", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "|OOOO:set_bounds", 
+					 kwlist, &given[0], &given[1], 
+					 &given[2], &given[3]))
+		return NULL;
+	if (temp->nlp == NULL)
+	{
+		PyErr_SetString(PyExc_ValueError, "the problem has been closed");
+		return NULL;
+	}
+	if (temp->in_solve || temp->in_batch)
+	{
+		PyErr_SetString(PyExc_RuntimeError, 
+				"cannot change bounds while the problem is being solved or evaluated");
+		return NULL;
+	}
+	target[0] = data->x_L;
+	target[1] = data->x_U;
+	target[2] = data->g_L;
+	target[3] = data->g_U;
+	len[0] = len[1] = temp->n;
+	len[2] = len[3] = temp->m;
+	for (i = 0; i < 4; i++)
+	{
+		if (given[i] == Py_None) continue;
+		arr[i] = (PyArrayObject*) PyArray_FROMANY(given[i], NPY_DOUBLE,
+							  1, 1, NPY_IN_ARRAY);
+		if (!arr[i]) goto error;
+		if (PyArray_DIM(arr[i], 0) != len[i])
+		{
+			PyErr_Format(PyExc_ValueError, "%s must have %d elements",
+				     kwlist[i], (int) len[i]);
+			goto error;
+		}
+		total += len[i];
+	}
+
+	/* the old bounds come back if the new problem can't be made */
+	saved = (Number*) malloc(sizeof(Number) * (total + 1));
+	if (!saved)
+	{
+		PyErr_NoMemory();
+		goto error;
+	}
+	for (i = 0, total = 0; i < 4; i++)
+	{
+		if (!arr[i]) continue;
+		memcpy(saved + total, target[i], sizeof(Number) * len[i]);
+		memcpy(target[i], arr[i]->data, sizeof(Number) * len[i]);
+		total += len[i];
+	}
+	nlp = new_nlp(temp->n, data);
+	if (!nlp)
+	{
+		for (i = 0, total = 0; i < 4; i++)
+		{
+			if (!arr[i]) continue;
+			memcpy(target[i], saved + total, sizeof(Number) * len[i]);
+			total += len[i];
+		}
+		PyErr_NoMemory();
+		goto error;
+	}
+	FreeIpoptProblem(temp->nlp);
+	temp->nlp = nlp;
+	free(saved);
+	for (i = 0; i < 4; i++)
+		Py_XDECREF(arr[i]);
+	Py_INCREF(Py_None);
+	return Py_None;
+error:
+	free(saved);
+	for (i = 0; i < 4; i++)
+		Py_XDECREF(arr[i]);
+	return NULL;
+}
+
+PyObject *set_intermediate(PyObject *self, PyObject *args)
+{
+	problem *temp = (problem*) self;
+	DispatchData *data = temp->data;
+	PyObject *callback;
+	int every = 1;
+
+	if (!PyArg_ParseTuple(args, "O|i:intermediate", &callback, &every))
+		return NULL;
+	if (callback != Py_None && !PyCallable_Check(callback))
+	{
+		PyErr_SetString(PyExc_TypeError, 
+				"Need a callable object for function intermediate.");
+		return NULL;
+	}
+	if (every < 1)
+	{
+		PyErr_SetString(PyExc_ValueError, "every must be 1 or more");
+		return NULL;
+	}
+	if (temp->in_solve)
+	{
+		PyErr_SetString(PyExc_RuntimeError, 
+				"cannot change the callback while the problem is being solved");
+		return NULL;
+	}
+	Py_CLEAR(data->intermediate_python);
+	if (callback != Py_None)
+	{
+		Py_INCREF(callback);
+		data->intermediate_python = callback;
+	}
+	data->intermediate_every = every;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+PyObject *set_timeline(PyObject *self, PyObject *args)
+{
+	problem *temp = (problem*) self;
+	Timeline *timeline = &temp->data->timeline;
+	TimelineEvent *events = NULL;
+	long capacity;
+
+	if (!PyArg_ParseTuple(args, "l:timeline", &capacity))
+		return NULL;
+	if (capacity < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "capacity must be 0 or more");
+		return NULL;
+	}
+	if (temp->in_solve)
+	{
+		PyErr_SetString(PyExc_RuntimeError, 
+				"cannot change the timeline while the problem is being solved");
+		return NULL;
+	}
+	if (capacity > 0 && 
+	    !(events = (TimelineEvent*) malloc(sizeof(TimelineEvent) * capacity)))
+		return PyErr_NoMemory();
+	free(timeline->events);
+	timeline->events = events;
+	timeline->capacity = capacity;
+	timeline->count = 0;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+PyObject *timeline_json(PyObject *self, PyObject *args)
+{
+	static const char *names[NEVENTS] = {"eval_f", "eval_grad_f", 
+		"eval_g", "eval_jac_g", "eval_h", "solve", "apply_new",
+		"eval_all"};
+	problem *temp = (problem*) self;
+	Timeline *timeline = &temp->data->timeline;
+	long kept, first, i;
+	double origin = 0.;
+	char *buf, *p;
+	size_t size;
+	PyObject *result;
+
+	if (!PyArg_ParseTuple(args, ":timeline_json"))
+		return NULL;
+	if (temp->in_solve)
+	{
+		PyErr_SetString(PyExc_RuntimeError, 
+				"the problem is being solved");
+		return NULL;
+	}
+	kept = timeline->count < timeline->capacity ? 
+		timeline->count : timeline->capacity;
+	first = timeline->count - kept;
+	for (i = first; i < timeline->count; i++)
+	{
+		TimelineEvent *e = &timeline->events[i % timeline->capacity];
+		if (i == first || e->start < origin) origin = e->start;
+	}
+
+	/* every event is well under 256 characters */
+	size = 256 * (kept + 1);
+	if (!(buf = (char*) malloc(size))) return PyErr_NoMemory();
+	p = buf + sprintf(buf, "{\"traceEvents\":[");
+	for (i = first; i < timeline->count; i++)
+	{
+		TimelineEvent *e = &timeline->events[i % timeline->capacity];
+		p += sprintf(p, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+			     "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1,"
+			     "\"args\":{\"new_x\":%d,\"structure\":%d}}",
+			     i == first ? "" : ",", names[e->kind],
+			     e->kind == STAT_SOLVE ? "ipopt" : 
+			     e->kind < NSTATS ? "callback" : "python",
+			     (e->start - origin) * 1e6, 
+			     (e->end - e->start) * 1e6,
+			     (e->flags & EVENT_NEW_X) != 0,
+			     (e->flags & EVENT_STRUCTURE) != 0);
+	}
+	p += sprintf(p, "\n],\"displayTimeUnit\":\"ns\","
+		     "\"otherData\":{\"dropped\":%ld}}\n", first);
+	result = PyString_FromStringAndSize(buf, p - buf);
+	free(buf);
+	return result;
+}
+
+static char PYIPOPT_TRACE_DOC[] = "trace(eval_f, eval_g, n) -> dict\n \
+        \n \
+        Run eval_f(x) and eval_g(x) once on an array of n tracer objects \n \
+        and record what they compute into a native model, with exact \n \
+        derivatives and no Python left in the evaluation. The result has \n \
+        n, m, nnzj, nnzh, the C callbacks eval_f, eval_grad_f, eval_g, \n \
+        eval_jac_g and eval_h and the user_data they take, all ready for \n \
+        create(): \n \
+        	t = pyipopt.trace(eval_f, eval_g, n) \n \
+        	nlp = pyipopt.create(n, xl, xu, t['m'], gl, gu, t['nnzj'], \n \
+        		t['nnzh'], t['eval_f'], t['eval_grad_f'], t['eval_g'], \n \
+        		t['eval_jac_g'], t['eval_h'], user_data=t['user_data']) \n \
+        The functions may use + - * / ** abs, indexing and slicing of x, \n \
+        sums and numpy's elementwise functions (exp, log, sqrt, sin, ...). \n \
+        eval_g returns a list or an object array of expressions; note \n \
+        that array([...], float_) can't hold them. Nothing may depend \n \
+        on the value of x: no float(), comparisons or branches. eval_g \n \
+        may be None for a problem without constraints. A traced model \n \
+        serves one problem at a time. ";
+
+static PyObject *PyExc_SolveError = NULL, *PyExc_SolveExceedMaxIter = NULL;
+
+/* Both of these must be called with the GIL held */
+void save_python_exception(DispatchData *data)
+{
+	PyObject *exc = NULL, *val = NULL, *tb = NULL;
+	PyErr_Fetch(&exc, &val, &tb);
+	if (NULL == exc) return;
+	PyErr_NormalizeException(&exc, &val, &tb);
+	Py_XDECREF(data->exctype);
+	Py_XDECREF(data->excval);
+	Py_XDECREF(data->exctb);
+	data->exctype = exc;
+	data->excval = val;
+	data->exctb = tb;
+}
+
+int restore_python_exception(DispatchData *data)
+{
+	if (!data->exctype) return FALSE;
+	PyErr_Restore(data->exctype, data->excval, data->exctb);
+	data->exctype = data->excval = data->exctb = NULL;
+	return TRUE;
+}
+
+/* The iteration history as a dict of arrays, one entry per iteration */
+static PyObject *history_dict(const IterHistory *history)
+{
+	static const struct {
+		const char *name;
+		size_t offset;
+		int is_index;
+	} fields[] = {
+		{"iter", offsetof(IterRecord, iter), 1},
+		{"obj", offsetof(IterRecord, obj), 0},
+		{"inf_pr", offsetof(IterRecord, inf_pr), 0},
+		{"inf_du", offsetof(IterRecord, inf_du), 0},
+		{"mu", offsetof(IterRecord, mu), 0},
+		{"d_norm", offsetof(IterRecord, d_norm), 0},
+		{"regularization_size", offsetof(IterRecord, regularization_size), 0},
+		{"alpha_du", offsetof(IterRecord, alpha_du), 0},
+		{"alpha_pr", offsetof(IterRecord, alpha_pr), 0},
+		{"ls_trials", offsetof(IterRecord, ls_trials), 1},
+		{"alg_mod", offsetof(IterRecord, alg_mod), 1},
+	};
+	npy_intp dims[1], k;
+	PyArrayObject *arr;
+	PyObject *dict = PyDict_New();
+	size_t i;
+
+	if (!dict) return NULL;
+	dims[0] = history->count;
+	for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+	{
+		arr = (PyArrayObject*) PyArray_SimpleNew(1, dims, 
+				fields[i].is_index ? PyArray_INT : PyArray_DOUBLE);
+		if (!arr) goto error;
+		for (k = 0; k < dims[0]; k++)
+		{
+			const char *rec = (const char*) &history->records[k] + 
+				fields[i].offset;
+			if (fields[i].is_index)
+				((int*) arr->data)[k] = *(const Index*) rec;
+			else
+				((double*) arr->data)[k] = *(const Number*) rec;
+		}
+		if (PyDict_SetItemString(dict, fields[i].name, (PyObject*) arr))
+		{
+			Py_DECREF(arr);
+			goto error;
+		}
+		Py_DECREF(arr);
+	}
+	return dict;
+error:
+	Py_DECREF(dict);
+	return NULL;
+}
+
+/* Starting multipliers for a warm start must be arrays Ipopt can use in
+   place: they are its in/out buffers and come back as the result's */
+static int check_multipliers(PyObject *obj, npy_intp size, const char *name)
+{
+	if (obj == Py_None) return 1;
+	if (!PyArray_Check(obj) || 
+	    PyArray_TYPE((PyArrayObject*) obj) != PyArray_DOUBLE ||
+	    !PyArray_ISCARRAY((PyArrayObject*) obj) ||
+	    PyArray_SIZE((PyArrayObject*) obj) != size)
+	{
+		PyErr_Format(PyExc_TypeError, 
+			     "%s must be a writable contiguous float64 array of %ld values",
+			     name, (long) size);
+		return 0;
+	}
+	return 1;
+}
+
+static PyArrayObject *multiplier_buffer(PyObject *init, npy_intp *dims)
+{
+	if (init == Py_None)
+		return (PyArrayObject*) PyArray_SimpleNew(1, dims, PyArray_DOUBLE);
+	Py_INCREF(init);
+	return (PyArrayObject*) init;
+}
+
+/* A field of /proc/self/status in kB, or -1 where there is none */
+static long long proc_status_kb(const char *field)
+{
+	char line[256];
+	long long kb = -1;
+	size_t len = strlen(field);
+	FILE *f = fopen("/proc/self/status", "r");
+
+	if (!f) return -1;
+	while (fgets(line, sizeof(line), f))
+		if (strncmp(line, field, len) == 0)
+		{
+			kb = strtoll(line + len, NULL, 10);
+			break;
+		}
+	fclose(f);
+	return kb;
+}
+
+/* How many times solve(memory=True) has reset the peak, bumped with the
+   GIL held. A solve that finds it moved on by the end had its baseline
+   reset by a concurrent one and can't tell its own peak. */
+static unsigned long peak_resets = 0;
+
+/* Make VmHWM start again from the current RSS (Linux 4.0 and later).
+   This is process-wide, so other threads reading it are reset too. */
+static int reset_peak_rss(void)
+{
+	int ok;
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+
+	if (!f) return 0;
+	ok = fputs("5", f) >= 0;
+	return fclose(f) == 0 && ok;
+}
+
+/* solve(memory=True): peak is the RSS growth in kB, or -1 if unknown */
+static PyObject *memory_dict(problem *temp, long long peak)
+{
+	static const char *names[] = {"eval_f", "eval_grad_f", "eval_g",
+				      "eval_jac_g", "eval_h"};
+	DispatchData *data = temp->data;
+	PyObject *dict, *callbacks, *item;
+	Index i, ineq = 0, hess = 0;
+	int k;
+
+	/* the augmented system Ipopt factors: the Hessian when it is exact,
+	   the Jacobian, a diagonal for x and for the constraints, and a slack
+	   with its diagonal and its Jacobian entry for each inequality */
+	for (i = 0; i < temp->m; i++)
+		if (data->g_L[i] != data->g_U[i]) ineq++;
+	if (data->eval_h_python || data->native.eval_h) hess = data->nele_hess;
+
+	if (!(callbacks = PyDict_New())) return NULL;
+	for (k = STAT_F; k <= STAT_H; k++)
+	{
+		item = Py_BuildValue("{slsL}", "allocations", 
+				     data->allocs[k].count,
+				     "bytes", data->allocs[k].bytes);
+		if (!item || PyDict_SetItemString(callbacks, names[k], item) < 0)
+		{
+			Py_XDECREF(item);
+			Py_DECREF(callbacks);
+			return NULL;
+		}
+		Py_DECREF(item);
+	}
+	if (peak >= 0)
+		dict = Py_BuildValue("{sLsNsn}", "peak_rss_delta", peak * 1024,
+				     "callbacks", callbacks, 
+				     "kkt_matrix_nonzeros",
+				     (Py_ssize_t) hess + data->nele_jac + 
+				     temp->n + temp->m + 2 * ineq);
+	else
+		dict = Py_BuildValue("{sOsNsn}", "peak_rss_delta", Py_None,
+				     "callbacks", callbacks, 
+				     "kkt_matrix_nonzeros",
+				     (Py_ssize_t) hess + data->nele_jac + 
+				     temp->n + temp->m + 2 * ineq);
+	return dict;
+}
+
+static const char *status_name(enum ApplicationReturnStatus status, 
+			       int stopped)
+{
+	if (stopped == STOP_DEADLINE) return "Deadline_Exceeded";
+	if (stopped == STOP_BUDGET) return "Evaluation_Budget_Exceeded";
+	switch (status)
+	{
+	case Solve_Succeeded: return "Solve_Succeeded";
+	case Solved_To_Acceptable_Level: return "Solved_To_Acceptable_Level";
+	case User_Requested_Stop: return "User_Requested_Stop";
+	case Maximum_Iterations_Exceeded: return "Maximum_Iterations_Exceeded";
+	default: return "Unknown";
+	}
+}
+
+PyObject *solve(PyObject *self, PyObject *args, PyObject *keywds)
+{
+
+
+    enum ApplicationReturnStatus status; /* Solve return code */
+    int i;
+	
+	
+  	/* Return values */
+  	problem* temp = (problem*)self;
+	const int n=temp->n;
+	const int m=temp->m;
   	
-	// logger("n is %d, m is %d\n", n, m);
+  	IpoptProblem nlp = (IpoptProblem)(temp->nlp);
+  	DispatchData* bigfield = (DispatchData*)(temp->data);
+  	
+  	npy_intp dX[1] = {n};
+  	npy_intp dL[1] = {m};
+  	
+  	PyArrayObject *x, *mL, *mU, *lambda, *con;
+  	Number obj;                          /* objective value */
+  	
+	PyObject *x0 = NULL;
+	double *x0data;
+
 	
-	x = (PyArrayObject *)PyArray_SimpleNew( 1, dX, PyArray_DOUBLE );
+	PyObject* myuserdata = NULL;
+	const char *logpath = NULL;
+	int log_multipliers = 0, solved, stopped;
+	char logerr[256];
+	PyObject *deadline = Py_None;
+	double seconds = 0;
+	long max_evals = 0;
+	SolveLimits *limits = &bigfield->limits;
+	PyObject *init_g = Py_None, *init_xL = Py_None, *init_xU = Py_None;
+	PyObject *outobj = Py_None;
+	result *out = NULL;
+	int memory = 0, peak_reset = 0;
+	unsigned long my_reset = 0;
+	long long rss_start = -1, hwm_start = -1, hwm_end = -1;
+	static char *kwlist[] = {"x0", "userdata", "log", "log_multipliers", 
+				 "deadline", "max_evals", "mult_g", "mult_xL",
+				 "mult_xU", "out", "memory", NULL};
 	
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "|OOziOlOOOOi:solve", 
+					 kwlist, &x0, &myuserdata, &logpath,
+					 &log_multipliers, &deadline,
+					 &max_evals, &init_g, &init_xL,
+					 &init_xU, &outobj, &memory))
+	{
+		return NULL;
+	}
+	/* before anything in bigfield changes, a refused call leaves the
+	   running solve alone */
+	if (nlp == NULL)
+	{
+		PyErr_SetString(PyExc_ValueError, "nlp objective passed to solve is NULL. Problem created?");
+		return NULL;
+	}
+	if (temp->in_solve)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "this problem is already being solved by another thread");
+		return NULL;
+	}
+	if (outobj != Py_None)
+	{
+		if (!PyObject_TypeCheck(outobj, &ResultType) ||
+		    PyArray_SIZE(((result*) outobj)->x) != n ||
+		    PyArray_SIZE(((result*) outobj)->g) != m)
+		{
+			PyErr_SetString(PyExc_TypeError, 
+					"out must come from this problem's result()");
+			return NULL;
+		}
+		/* its multipliers already start from the last solve */
+		if (init_g != Py_None || init_xL != Py_None || 
+		    init_xU != Py_None)
+		{
+			PyErr_SetString(PyExc_ValueError, 
+					"mult_g, mult_xL and mult_xU can't go with out");
+			return NULL;
+		}
+		out = (result*) outobj;
+	}
+	if (!check_multipliers(init_g, m, "mult_g") ||
+	    !check_multipliers(init_xL, n, "mult_xL") ||
+	    !check_multipliers(init_xU, n, "mult_xU"))
+		return NULL;
+	if (init_xL != Py_None && init_xL == init_xU)
+	{
+		PyErr_SetString(PyExc_ValueError, 
+				"mult_xL and mult_xU must be different arrays");
+		return NULL;
+	}
+	if (deadline != Py_None)
+	{
+		seconds = PyFloat_AsDouble(deadline);
+		if (seconds == -1 && PyErr_Occurred()) return NULL;
+		if (!(seconds > 0))
+		{
+			PyErr_SetString(PyExc_ValueError, 
+					"deadline must be a positive number of seconds");
+			return NULL;
+		}
+	}
+	if (max_evals < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "max_evals must not be negative");
+		return NULL;
+	}
+	/* models read from a .nl file come with their own starting point */
+	if ((x0 == NULL || x0 == Py_None) && bigfield->nl != NULL)
+		x0data = bigfield->nl->x0;
+	else if (x0 != NULL && PyArray_Check(x0))
+		x0data = (double*) ((PyArrayObject*) x0)->data;
+	else
+	{
+		PyErr_SetString(PyExc_TypeError, "solve() needs x0 as an array");
+		return NULL;
+	}
 	
-	Number* newx0 = (Number*)malloc(sizeof(Number)*temp->n);
-	double* xdata = (double*) x0->data;
-	for (i =0; i< n; i++)
-		newx0[i] = xdata[i];
+	if (myuserdata != NULL)
+	{
+		/* the cached argument tuples carry the old userdata */
+		if (myuserdata != bigfield->userdata)
+			reset_dispatch_args(bigfield);
+		Py_INCREF(myuserdata);
+		Py_XDECREF(bigfield->userdata);
+		bigfield->userdata = myuserdata;
+		logger("[PyIPOPT] User specified data field to callback function.\n");
+	}
+		
+	if (bigfield->nblocks > 0)
+	{
+		Index rows = 0, nz = 0;
+		for (i = 0; i < bigfield->nblocks; i++)
+		{
+			rows += bigfield->blocks[i].row_end - bigfield->blocks[i].row_start;
+			nz += bigfield->blocks[i].nz_end - bigfield->blocks[i].nz_start;
+		}
+		/* they don't overlap, so this means they cover everything */
+		if (rows != m || nz != bigfield->nele_jac)
+		{
+			PyErr_SetString(PyExc_ValueError, 
+					"the constraint blocks must cover every row and Jacobian nonzero");
+			return NULL;
+		}
+	}
+	else if ((!bigfield->eval_g_python && !bigfield->native.eval_g &&
+		  !bigfield->eval_all_python) ||
+		 (!bigfield->eval_jac_g_python && !bigfield->native.eval_jac_g &&
+		  !(bigfield->eval_all_python && bigfield->jac_structure)))
+	{
+		PyErr_SetString(PyExc_ValueError, 
+				"eval_g and eval_jac_g are needed unless add_block() is used");
+		return NULL;
+	}
+ 	
+	/* set some options */
+  	
+  	// AddIpoptNumOption(nlp, "tol", 1e-8);
+  	// AddIpoptStrOption(nlp, "mu_strategy", "adaptive");
+  	if (bigfield->eval_h_python == NULL && bigfield->native.eval_h == NULL)
+  	{
+  		AddIpoptStrOption(nlp, "hessian_approximation","limited-memory");
+		//logger("Can't find eval_h callback function\n");
+	}
+	memset(limits, 0, sizeof(SolveLimits));
+	if (deadline != Py_None || max_evals > 0)
+	{
+		limits->n = n;
+		limits->max_evals = max_evals;
+		limits->x = malloc(sizeof(Number) * n);
+		limits->pending = malloc(sizeof(Number) * n);
+		if (!limits->x || !limits->pending)
+		{
+			free(limits->x);
+			free(limits->pending);
+			limits->x = limits->pending = NULL;
+			return PyErr_NoMemory();
+		}
+		memcpy(limits->pending, x0data, sizeof(Number) * n);
+	}
+	if (logpath != NULL)
+	{
+		bigfield->iterlog = iterlog_open(logpath, n, m, log_multipliers,
+						 logerr, sizeof(logerr));
+		if (!bigfield->iterlog)
+		{
+			free(limits->x);
+			free(limits->pending);
+			limits->x = limits->pending = NULL;
+			PyErr_SetString(PyExc_IOError, logerr);
+			return NULL;
+		}
+	}
+  	/* allocate space for the initial point and set the values */
+  	
+	// logger("n is %d, m is %d\n", n, m);
 	
-  	mL = (PyArrayObject *)PyArray_SimpleNew( 1, dX, PyArray_DOUBLE );
-	mU = (PyArrayObject *)PyArray_SimpleNew( 1, dX, PyArray_DOUBLE );
-	lambda = (PyArrayObject *)PyArray_SimpleNew( 1, dL, PyArray_DOUBLE );
-	con = (PyArrayObject *)PyArray_SimpleNew( 1, dL, PyArray_DOUBLE );
+	/* Ipopt starts from x and leaves the solution there, so the result
+	   array is the only copy; with out and x0 = out.x there is none */
+	if (out)
+	{
+		x = out->x;
+		mL = out->mult_xL;
+		mU = out->mult_xU;
+		lambda = out->mult_g;
+		con = out->g;
+		Py_INCREF(x);
+		Py_INCREF(mL);
+		Py_INCREF(mU);
+		Py_INCREF(lambda);
+		Py_INCREF(con);
+	}
+	else
+	{
+		x = (PyArrayObject *)PyArray_SimpleNew( 1, dX, PyArray_DOUBLE );
+		mL = multiplier_buffer(init_xL, dX);
+		mU = multiplier_buffer(init_xU, dX);
+		lambda = multiplier_buffer(init_g, dL);
+		con = (PyArrayObject *)PyArray_SimpleNew( 1, dL, PyArray_DOUBLE );
+	}
+	if (!x || !mL || !mU || !lambda || !con)
+	{
+		free(limits->x);
+		free(limits->pending);
+		limits->x = limits->pending = NULL;
+		if (bigfield->iterlog)
+			iterlog_close(bigfield->iterlog, logerr, sizeof(logerr));
+		bigfield->iterlog = NULL;
+		goto fail;
+	}
+	Number *newx0 = (Number*) x->data;
+	if (newx0 != x0data)
+		memcpy(newx0, x0data, sizeof(Number) * n);
 	// logger("Ready to go\n");
 			
+	/* The GIL is released for the whole solve so that other threads,
+	   including ones solving other problems, can run. The callbacks take
+	   it back whenever they have to call into Python. */
+	if (memory)
+	{
+		track_allocations();
+		memset(bigfield->allocs, 0, sizeof(bigfield->allocs));
+		bigfield->track_memory = 1;
+		rss_start = proc_status_kb("VmRSS:");
+		hwm_start = proc_status_kb("VmHWM:");
+		peak_reset = reset_peak_rss();
+		my_reset = ++peak_resets;
+	}
+	temp->in_solve = 1;
+	bigfield->history.count = 0;
+	Py_BEGIN_ALLOW_THREADS
+	double start = monotonic_time();
+	if (seconds > 0) limits->deadline = start + seconds;
   	status = IpoptSolve(nlp, newx0, (double*)con->data, &obj,
 			    (double*)lambda->data,
 			    (double*)mL->data,
 			    (double*)mU->data,
 			    (UserDataPtr)bigfield);
  	// The final parameter is the userdata (void * type)
+	record_call(bigfield, STAT_SOLVE, start, FALSE, FALSE);
+	Py_END_ALLOW_THREADS
+	temp->in_solve = 0;
+	if (memory)
+	{
+		bigfield->track_memory = 0;
+		hwm_end = proc_status_kb("VmHWM:");
+	}
 
-
- 
  	// For status code, see: IpReturnCodes_inc.h 
-  	if (status == Solve_Succeeded ||
-	    status == Solved_To_Acceptable_Level ||
-	    status == User_Requested_Stop ||
-	    status == Maximum_Iterations_Exceeded ) {
+	stopped = limits->stop;
+	solved = status == Solve_Succeeded ||
+		status == Solved_To_Acceptable_Level ||
+		status == User_Requested_Stop ||
+		status == Maximum_Iterations_Exceeded || stopped;
+
+	/* out of time or evaluations: the last accepted iterate, and only
+	   when Ipopt itself stopped there do its g and multipliers go with it */
+	if (stopped && limits->have_x)
+	{
+		memcpy(newx0, limits->x, sizeof(Number) * n);
+		obj = limits->obj;
+	}
+	if (stopped && status != User_Requested_Stop)
+	{
+		for (i = 0; i < n; i++)
+			((double*) mL->data)[i] = ((double*) mU->data)[i] = NAN;
+		for (i = 0; i < m; i++)
+			((double*) lambda->data)[i] = ((double*) con->data)[i] = NAN;
+	}
+	free(limits->x);
+	free(limits->pending);
+	limits->x = limits->pending = NULL;
+
+	if (bigfield->iterlog)
+	{
+		int closed;
+		/* the last iterate has no Hessian after it to leave them */
+		if (solved)
+			iterlog_set_multipliers(bigfield->iterlog, 
+						(double*) lambda->data);
+		closed = iterlog_close(bigfield->iterlog, logerr, sizeof(logerr));
+		bigfield->iterlog = NULL;
+		if (closed != 0 && 
+		    PyErr_WarnEx(PyExc_RuntimeWarning, logerr, 1) < 0)
+			goto fail;
+	}
+
+  	if (solved) {
   		logger("Problem solved\n");
-		double* xdata = (double*) x->data;
-		for (i =0; i< n; i++)
-			xdata[i] = newx0[i];
-			// FreeIpoptProblem(nlp);
-		
-		if (newx0) free(newx0);
-		
-		/* A fix for the mem-leak problem */
-		PyObject *r =
-			Py_BuildValue( "{sNsNsNsNsNsd}",
+		PyObject *r;
+
+		PyObject *mem = NULL;
+		if (memory)
+		{
+			/* the peak is the solve's if it was reset or went up,
+			   and no other memory=True solve reset it meanwhile */
+			long long peak = -1;
+			if (rss_start >= 0 && hwm_end >= 0 && 
+			    my_reset == peak_resets &&
+			    (peak_reset || hwm_end > hwm_start))
+				peak = hwm_end > rss_start ? hwm_end - rss_start : 0;
+			mem = memory_dict(temp, peak);
+			if (!mem) goto fail;
+		}
+
+		if (out)
+		{
+			/* the arrays already hold the results */
+			out->f = obj;
+			out->status = status_name(status, stopped);
+			Py_XDECREF(out->memory);
+			out->memory = mem;
+			Py_DECREF(x);
+			Py_DECREF(mL);
+			Py_DECREF(mU);
+			Py_DECREF(lambda);
+			Py_DECREF(con);
+			Py_INCREF(out);
+			r = (PyObject*) out;
+		}
+		else
+		{
+			/* A fix for the mem-leak problem */
+			r = Py_BuildValue( "{sNsNsNsNsNsdsNss}",
 				       "x", PyArray_Return( x ),
 				       "mult_xL", PyArray_Return( mL ),
 				       "mult_xU", PyArray_Return( mU ),
 				       "mult_g", PyArray_Return( lambda ),
 				       "g", con,
-				       "f", obj);
-		if (!r) return NULL;
+				       "f", obj,
+				       "history", history_dict(&bigfield->history),
+				       "status", status_name(status, stopped));
+			if (r && mem && PyDict_SetItemString(r, "memory", mem) < 0)
+				Py_CLEAR(r);
+			Py_XDECREF(mem);
+			if (!r) return NULL;
+		}
+
+		/* the intermediate hook raised, which stopped the solve */
+		if ((status == User_Requested_Stop || stopped) && 
+		    restore_python_exception(bigfield))
+		{
+			Py_DECREF(r);
+			return NULL;
+		}
 
-		if (status != Maximum_Iterations_Exceeded)
+		if (status != Maximum_Iterations_Exceeded || stopped)
 			return r;
 
 		PyErr_SetObject(PyExc_SolveExceedMaxIter, r);
@@ -524,24 +2179,262 @@ PyObject *solve(PyObject *self, PyObject *args)
   	else {
   		// FreeIpoptProblem(nlp);
   		printf("[Error] Ipopt faied in solving problem instance\n");
-		if (!restore_python_exception())
+		if (!restore_python_exception(bigfield))
 			PyErr_SetString(PyExc_SolveError, "Ipopt search failed");
-  		return NULL;
 	}
+fail:
+	Py_XDECREF(x);
+	Py_XDECREF(mL);
+	Py_XDECREF(mU);
+	Py_XDECREF(lambda);
+	Py_XDECREF(con);
+	return NULL;
 }
 
 
 
         
+/* close() and __exit__(type, value, traceback), which takes any arguments
+   and doesn't swallow the exception */
 PyObject *close_model(PyObject *self, PyObject *args)
 {
 	problem* obj = (problem*) self;
-	FreeIpoptProblem(obj->nlp);
+	if (obj->in_solve || obj->in_batch)
+	{
+		PyErr_SetString(PyExc_RuntimeError, 
+				"cannot close a problem while it is being solved or evaluated");
+		return NULL;
+	}
+	if (obj->nlp) FreeIpoptProblem(obj->nlp);
 	obj->nlp = NULL;
+	clear_dispatch_data(obj->data);
+	if (PyTuple_GET_SIZE(args) > 0)
+	{
+		Py_INCREF(Py_False);
+		return Py_False;
+	}
 	Py_INCREF(Py_True);
 	return Py_True;
 }
 
+PyObject *enter_model(PyObject *self, PyObject *args)
+{
+	Py_INCREF(self);
+	return self;
+}
+
+static char PYIPOPT_LIVE_PROBLEMS_DOC[] = "live_problems() -> dict\n \
+        \n \
+        How many problems are alive and how many bytes of C memory \n \
+        pyipopt holds for them: bounds, cached structures and values, \n \
+        histories, timelines and .nl models. Ipopt's own memory isn't \n \
+        counted. A closed problem only counts until it is collected. ";
+
+static PyObject *live_problems(PyObject *self, PyObject *args)
+{
+	problem *p;
+	long count = 0;
+	size_t bytes = 0;
+
+	if (!PyArg_ParseTuple(args, ":live_problems")) return NULL;
+	for (p = live_head; p; p = p->live_next)
+	{
+		count++;
+		bytes += sizeof(problem) + dispatch_data_bytes(p->data, p->n);
+	}
+	return Py_BuildValue("{slsn}", "problems", count, 
+			     "bytes", (Py_ssize_t) bytes);
+}
+
+typedef struct {
+	void *map;
+	size_t size;
+} LogMapping;
+
+static void free_log_mapping(PyObject *capsule)
+{
+	LogMapping *mapping = (LogMapping*) 
+		PyCapsule_GetPointer(capsule, "pyipopt.LogMapping");
+	iterlog_unmap(mapping->map, mapping->size);
+	free(mapping);
+}
+
+/* A read-only view of rows rows of cols values, one row per record,
+   which keeps the mapping alive */
+static PyObject *log_view(PyObject *owner, char *data, int type, 
+			  const IterLogHeader *header, npy_intp cols, int nd)
+{
+	npy_intp dims[2] = {header->count, cols};
+	npy_intp strides[2] = {header->record_size, 8};
+	PyArrayObject *arr = (PyArrayObject*) 
+		PyArray_New(&PyArray_Type, nd, dims, type, strides, data, 0,
+			    NPY_ALIGNED, NULL);
+	if (!arr) return NULL;
+	Py_INCREF(owner);
+	arr->base = owner;
+	return (PyObject*) arr;
+}
+
+static char PYIPOPT_READ_LOG_DOC[] = "read_log(path) -> dict\n \
+        \n \
+        Map an iterate log written by solve(log=path) and return iter, \n \
+        obj and x, the iterates as an (iters, n) array, plus mult_g \n \
+        when the log has multipliers. The arrays are read-only views \n \
+        of the file, nothing is copied; a log still being written \n \
+        reads back up to its last complete iteration. ";
+
+PyObject *read_log(PyObject *self, PyObject *args)
+{
+	const char *path;
+	char err[256];
+	IterLogHeader header;
+	LogMapping *mapping;
+	PyObject *owner, *r;
+	char *records;
+
+	if (!PyArg_ParseTuple(args, "s:read_log", &path)) return NULL;
+	mapping = malloc(sizeof(LogMapping));
+	if (!mapping) return PyErr_NoMemory();
+	mapping->map = iterlog_map(path, &header, &mapping->size, err, 
+				   sizeof(err));
+	if (!mapping->map)
+	{
+		free(mapping);
+		PyErr_SetString(PyExc_IOError, err);
+		return NULL;
+	}
+	owner = PyCapsule_New(mapping, "pyipopt.LogMapping", free_log_mapping);
+	if (!owner)
+	{
+		iterlog_unmap(mapping->map, mapping->size);
+		free(mapping);
+		return NULL;
+	}
+	records = (char*) mapping->map + header.header_size;
+	r = Py_BuildValue("{sNsNsN}",
+			  "iter", log_view(owner, records, NPY_LONGLONG, 
+					   &header, 1, 1),
+			  "obj", log_view(owner, records + 8, PyArray_DOUBLE,
+					  &header, 1, 1),
+			  "x", log_view(owner, records + 16, PyArray_DOUBLE,
+					&header, header.n, 2));
+	if (r && (header.flags & ITERLOG_MULTIPLIERS))
+	{
+		PyObject *mult = log_view(owner, records + 16 + 8 * header.n,
+					  PyArray_DOUBLE, &header, header.m, 2);
+		if (!mult || PyDict_SetItemString(r, "mult_g", mult) < 0)
+			Py_CLEAR(r);
+		Py_XDECREF(mult);
+	}
+	Py_DECREF(owner);
+	return r;
+}
+
+static char PYIPOPT_LOAD_NL_DOC[] = "load_nl(path) -> dict\n \
+        \n \
+        Read an AMPL .nl file (text or binary) and return what create() \n \
+        needs as numpy arrays: n, m, x_L, x_U, g_L, g_U, x0, nnzj, nnzh, \n \
+        jac_structure and hess_structure (pairs of row and column index \n \
+        arrays, the latter for the lower triangle), the constant Jacobian \n \
+        coefficients jac_linear (aligned with jac_structure), the linear \n \
+        part of the objective obj_linear (indices, coefficients) and its \n \
+        sense (1 to minimize, -1 to maximize). ";
+
+static PyObject *index_array(npy_intp len)
+{
+	return PyArray_SimpleNew(1, &len, NPY_INT);
+}
+
+static PyObject *double_array(const double *data, npy_intp len)
+{
+	PyArrayObject *a = (PyArrayObject*) PyArray_SimpleNew(1, &len, NPY_DOUBLE);
+	if (a && len) memcpy(a->data, data, sizeof(double) * len);
+	return (PyObject*) a;
+}
+
+static PyObject *load_nl(PyObject *obj, PyObject *args)
+{
+	char *path;
+	char err[512];
+	NLModel *model;
+	PyObject *xl, *xu, *gl, *gu, *x0, *jrow, *jcol, *jlin, *hrow, *hcol;
+	PyObject *ovar, *ocoef, *result = NULL;
+	Index i, k;
+
+	if (!PyArg_ParseTuple(args, "s", &path)) 
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	model = nl_read(path, err, sizeof(err));
+	Py_END_ALLOW_THREADS
+	if (!model)
+	{
+		PyErr_Format(PyExc_ValueError, "%s: %s", path, err);
+		return NULL;
+	}
+
+	xl = double_array(model->x_L, model->n);
+	xu = double_array(model->x_U, model->n);
+	gl = double_array(model->g_L, model->m);
+	gu = double_array(model->g_U, model->m);
+	x0 = double_array(model->x0, model->n);
+	jlin = double_array(model->jac_coef, model->nnzj);
+	ocoef = double_array(model->grad_coef, model->grad_count);
+	jrow = index_array(model->nnzj);
+	jcol = index_array(model->nnzj);
+	hrow = index_array(model->nnzh);
+	hcol = index_array(model->nnzh);
+	ovar = index_array(model->grad_count);
+	if (xl && xu && gl && gu && x0 && jlin && ocoef && jrow && jcol &&
+	    hrow && hcol && ovar)
+	{
+		Index *r = (Index*) ((PyArrayObject*) jrow)->data;
+		Index *c = (Index*) ((PyArrayObject*) jcol)->data;
+		for (i = 0; i < model->m; i++)
+			for (k = model->jac_start[i]; k < model->jac_start[i+1]; k++)
+			{
+				r[k] = i;
+				c[k] = model->jac_col[k];
+			}
+		r = (Index*) ((PyArrayObject*) hrow)->data;
+		c = (Index*) ((PyArrayObject*) hcol)->data;
+		for (i = 0; i < model->n; i++)
+			for (k = model->hess_start[i]; k < model->hess_start[i+1]; k++)
+			{
+				r[k] = model->hess_row[k];
+				c[k] = i;
+			}
+		r = (Index*) ((PyArrayObject*) ovar)->data;
+		for (k = 0; k < model->grad_count; k++)
+			r[k] = model->grad_var[k];
+		result = Py_BuildValue("{s:i,s:i,s:O,s:O,s:O,s:O,s:O,s:i,s:i,"
+				       "s:(OO),s:(OO),s:O,s:(OO),s:d}",
+				       "n", model->n, "m", model->m,
+				       "x_L", xl, "x_U", xu, "g_L", gl, "g_U", gu,
+				       "x0", x0, "nnzj", model->nnzj,
+				       "nnzh", model->nnzh,
+				       "jac_structure", jrow, jcol,
+				       "hess_structure", hrow, hcol,
+				       "jac_linear", jlin,
+				       "obj_linear", ovar, ocoef,
+				       "sense", model->sense);
+	}
+	Py_XDECREF(xl);
+	Py_XDECREF(xu);
+	Py_XDECREF(gl);
+	Py_XDECREF(gu);
+	Py_XDECREF(x0);
+	Py_XDECREF(jlin);
+	Py_XDECREF(ocoef);
+	Py_XDECREF(jrow);
+	Py_XDECREF(jcol);
+	Py_XDECREF(hrow);
+	Py_XDECREF(hcol);
+	Py_XDECREF(ovar);
+	nl_free(model);
+	return result;
+}
+
 static char PYTEST[] = "TestCreate\n";
 
 static PyObject *test(PyObject *self, PyObject *args)
@@ -558,7 +2451,13 @@ static PyObject *test(PyObject *self, PyObject *args)
 /* Begin Python Module code section */
 static PyMethodDef ipoptMethods[] = {
  //    { "solve", solve, METH_VARARGS, PYIPOPT_SOLVE_DOC},
-    { "create", create, METH_VARARGS, PYIPOPT_CREATE_DOC},
+    { "create", (PyCFunction)create, METH_VARARGS | METH_KEYWORDS, PYIPOPT_CREATE_DOC},
+    { "create_from_nl", (PyCFunction)create_from_nl, METH_VARARGS | METH_KEYWORDS, PYIPOPT_CREATE_FROM_NL_DOC},
+    { "nl_eval_batch", nl_eval_batch_py, METH_VARARGS, PYIPOPT_NL_EVAL_BATCH_DOC},
+    { "load_nl", load_nl, METH_VARARGS, PYIPOPT_LOAD_NL_DOC},
+    { "live_problems", live_problems, METH_VARARGS, PYIPOPT_LIVE_PROBLEMS_DOC},
+    { "read_log", read_log, METH_VARARGS, PYIPOPT_READ_LOG_DOC},
+    { "trace", (PyCFunction)trace_model, METH_VARARGS | METH_KEYWORDS, PYIPOPT_TRACE_DOC},
     // { "close",  close_model, METH_VARARGS, PYIPOPT_CLOSE_DOC}, 
    // { "test",   test, 		METH_VARARGS, PYTEST},
     { NULL, NULL }
@@ -573,8 +2472,12 @@ initpyipopt(void)
 	   			"A hooker between Ipopt and Python");
 	   if (!m) goto error;
 	   
+	   PyEval_InitThreads();    /* callbacks use PyGILState_Ensure */
 	   import_array( );         /* Initialize the Numarray module. */
 		/* A segfault will occur if I use numarray without this.. */
+	   if (init_tracer() < 0) goto error;
+	   if (PyType_Ready(&IpoptProblemType) < 0) goto error;
+	   if (PyType_Ready(&ResultType) < 0) goto error;
 
 	   PyExc_SolveError = PyErr_NewException("pyipopt.SolveError",
 						  NULL,NULL);
@@ -584,6 +2487,10 @@ initpyipopt(void)
 	   if (!PyExc_SolveExceedMaxIter) goto error;
 	   if (-1 == PyObject_SetAttrString(m,"SolveError",PyExc_SolveError)) goto error;
 	   if (-1 == PyObject_SetAttrString(m,"SolveExceedMaxIter",PyExc_SolveExceedMaxIter)) goto error;
+	   if (-1 == PyModule_AddIntConstant(m, "NEED_F", NEED_F)) goto error;
+	   if (-1 == PyModule_AddIntConstant(m, "NEED_GRAD_F", NEED_GRAD_F)) goto error;
+	   if (-1 == PyModule_AddIntConstant(m, "NEED_G", NEED_G)) goto error;
+	   if (-1 == PyModule_AddIntConstant(m, "NEED_JAC_G", NEED_JAC_G)) goto error;
 
 	   if (PyErr_Occurred())	
 	 	  Py_FatalError("Unable to initialize module pyipopt");
@@ -0,0 +1,867 @@
+/* Copyright (c) 2008, Eric You Xu, Washington University
+* All rights reserved.
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the Washington University nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS "AS IS" AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE REGENTS AND CONTRIBUTORS BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// This file records Python models into native .nl expression graphs
+/* trace() calls eval_f and eval_g once with an array of Tracer objects in
+   place of x. Every operation on a Tracer appends a node to a tape (the
+   NLNode of nlmodel.h, with AMPL's opcodes) and returns a Tracer for the
+   result, so when the functions return the tape holds the whole
+   computation. The tape is then written out as .nl text and read back by
+   nl_parse, which gives the same native values and derivatives as a model
+   made by create_from_nl. A node that is used more than once is written
+   as a defined variable, so shared subexpressions are only evaluated
+   once; so is one that would nest too deep for the reader. */
+
+#define NO_IMPORT_ARRAY
+#include <stdarg.h>
+#include "hook.h"
+#include "nlmodel.h"
+
+/* deepest expression written without a defined variable in between */
+#define TRACE_MAX_DEPTH	200
+
+typedef struct {
+	NLNode *nodes;
+	int nnodes, cap;
+} Tape;
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *tape;		/* capsule holding the Tape */
+	int node;
+} Tracer;
+
+static PyTypeObject TracerType;
+
+#define Tracer_Check(op) PyObject_TypeCheck(op, &TracerType)
+
+static void free_tape(PyObject *capsule)
+{
+	Tape *tape = (Tape*) PyCapsule_GetPointer(capsule, "pyipopt.Tape");
+	if (!tape) return;
+	free(tape->nodes);
+	free(tape);
+}
+
+static Tape *get_tape(PyObject *capsule)
+{
+	return (Tape*) PyCapsule_GetPointer(capsule, "pyipopt.Tape");
+}
+
+/* Append a node, returns its index or -1 with MemoryError set */
+static int record(PyObject *capsule, int op, int a, int b, double c)
+{
+	Tape *tape = get_tape(capsule);
+	NLNode *node;
+	if (tape->nnodes == tape->cap)
+	{
+		int cap = tape->cap ? 2 * tape->cap : 256;
+		NLNode *nodes = (NLNode*) realloc(tape->nodes, 
+						  sizeof(NLNode) * cap);
+		if (!nodes)
+		{
+			PyErr_NoMemory();
+			return -1;
+		}
+		tape->nodes = nodes;
+		tape->cap = cap;
+	}
+	node = &tape->nodes[tape->nnodes];
+	node->op = op;
+	node->a = a;
+	node->b = b;
+	node->c = c;
+	return tape->nnodes++;
+}
+
+static PyObject *new_tracer(PyObject *capsule, int node)
+{
+	Tracer *t;
+	if (node < 0) return NULL;
+	t = PyObject_New(Tracer, &TracerType);
+	if (!t) return NULL;
+	Py_INCREF(capsule);
+	t->tape = capsule;
+	t->node = node;
+	return (PyObject*) t;
+}
+
+static void tracer_dealloc(PyObject *self)
+{
+	Py_XDECREF(((Tracer*) self)->tape);
+	PyObject_Del(self);
+}
+
+/* What an operand is: 1 for a Tracer of this tape (its node in *node),
+   2 for a plain number (in *c), 0 for anything else and -1 on error */
+static int operand(PyObject *capsule, PyObject *o, int *node, double *c)
+{
+	if (Tracer_Check(o))
+	{
+		if (((Tracer*) o)->tape != capsule)
+		{
+			PyErr_SetString(PyExc_TypeError, 
+					"expression from another trace");
+			return -1;
+		}
+		*node = ((Tracer*) o)->node;
+		return 1;
+	}
+	if (PyFloat_Check(o) || PyInt_Check(o) || PyLong_Check(o) ||
+	    PyArray_IsScalar(o, Number))
+	{
+		*c = PyFloat_AsDouble(o);
+		if (*c == -1. && PyErr_Occurred()) return -1;
+		return 2;
+	}
+	return 0;
+}
+
+static PyObject *binary(PyObject *a, PyObject *b, int op)
+{
+	PyObject *capsule = Tracer_Check(a) ? ((Tracer*) a)->tape
+		: ((Tracer*) b)->tape;
+	int ka, kb, na = 0, nb = 0;
+	double ca = 0., cb = 0.;
+
+	if ((ka = operand(capsule, a, &na, &ca)) < 0 ||
+	    (kb = operand(capsule, b, &nb, &cb)) < 0)
+		return NULL;
+	if (ka == 0 || kb == 0)
+	{
+		/* e.g. an array, which does this element by element */
+		Py_INCREF(Py_NotImplemented);
+		return Py_NotImplemented;
+	}
+
+	/* the identities that sum() and friends produce all the time */
+	if ((kb == 2 && cb == 0. && (op == OP_PLUS || op == OP_MINUS)) ||
+	    (kb == 2 && cb == 1. && (op == OP_MULT || op == OP_DIV ||
+				     op == OP_POW)))
+	{
+		Py_INCREF(a);
+		return a;
+	}
+	if ((ka == 2 && ca == 0. && op == OP_PLUS) ||
+	    (ka == 2 && ca == 1. && op == OP_MULT))
+	{
+		Py_INCREF(b);
+		return b;
+	}
+
+	if (op == OP_POW && kb == 2 && cb == 2.)
+		return new_tracer(capsule, record(capsule, OP_POW2, na, 0, 0.));
+	if (op == OP_POW && kb == 2)
+		op = OP_POW_CONST_EXP;
+	else if (op == OP_POW && ka == 2)
+		op = OP_POW_CONST_BASE;
+	if (ka == 2 && (na = record(capsule, NL_NUM, 0, 0, ca)) < 0)
+		return NULL;
+	if (kb == 2 && (nb = record(capsule, NL_NUM, 0, 0, cb)) < 0)
+		return NULL;
+	return new_tracer(capsule, record(capsule, op, na, nb, 0.));
+}
+
+static PyObject *unary(PyObject *self, int op)
+{
+	Tracer *t = (Tracer*) self;
+	return new_tracer(t->tape, record(t->tape, op, t->node, 0, 0.));
+}
+
+static PyObject *tracer_add(PyObject *a, PyObject *b)
+{
+	return binary(a, b, OP_PLUS);
+}
+
+static PyObject *tracer_subtract(PyObject *a, PyObject *b)
+{
+	return binary(a, b, OP_MINUS);
+}
+
+static PyObject *tracer_multiply(PyObject *a, PyObject *b)
+{
+	return binary(a, b, OP_MULT);
+}
+
+static PyObject *tracer_divide(PyObject *a, PyObject *b)
+{
+	return binary(a, b, OP_DIV);
+}
+
+static PyObject *tracer_power(PyObject *a, PyObject *b, PyObject *mod)
+{
+	if (mod != Py_None)
+	{
+		PyErr_SetString(PyExc_TypeError, 
+				"pow() with a modulus can't be traced");
+		return NULL;
+	}
+	return binary(a, b, OP_POW);
+}
+
+static PyObject *tracer_negative(PyObject *self)
+{
+	return unary(self, OP_NEG);
+}
+
+static PyObject *tracer_positive(PyObject *self)
+{
+	Py_INCREF(self);
+	return self;
+}
+
+static PyObject *tracer_absolute(PyObject *self)
+{
+	return unary(self, OP_ABS);
+}
+
+/* A traced expression has no value, so anything that needs one (float(),
+   if, comparisons) can't be recorded */
+static PyObject *no_value(void)
+{
+	PyErr_SetString(PyExc_TypeError, 
+			"a traced expression has no value; the model must not "
+			"convert x to float or branch on it");
+	return NULL;
+}
+
+static int tracer_nonzero(PyObject *self)
+{
+	no_value();
+	return -1;
+}
+
+static PyObject *tracer_float(PyObject *self)
+{
+	return no_value();
+}
+
+static PyObject *tracer_richcompare(PyObject *a, PyObject *b, int op)
+{
+	return no_value();
+}
+
+/* numpy calls these by name for its ufuncs on object arrays */
+#define TRACER_FUNCTION(name, op)					\
+	static PyObject *tracer_##name(PyObject *self, PyObject *unused) \
+	{								\
+		return unary(self, op);					\
+	}
+TRACER_FUNCTION(exp, OP_EXP)
+TRACER_FUNCTION(log, OP_LOG)
+TRACER_FUNCTION(log10, OP_LOG10)
+TRACER_FUNCTION(sqrt, OP_SQRT)
+TRACER_FUNCTION(sin, OP_SIN)
+TRACER_FUNCTION(cos, OP_COS)
+TRACER_FUNCTION(tan, OP_TAN)
+TRACER_FUNCTION(arcsin, OP_ASIN)
+TRACER_FUNCTION(arccos, OP_ACOS)
+TRACER_FUNCTION(arctan, OP_ATAN)
+TRACER_FUNCTION(sinh, OP_SINH)
+TRACER_FUNCTION(cosh, OP_COSH)
+TRACER_FUNCTION(tanh, OP_TANH)
+TRACER_FUNCTION(arcsinh, OP_ASINH)
+TRACER_FUNCTION(arccosh, OP_ACOSH)
+TRACER_FUNCTION(arctanh, OP_ATANH)
+#undef TRACER_FUNCTION
+
+static PyObject *tracer_square(PyObject *self, PyObject *unused)
+{
+	return unary(self, OP_POW2);
+}
+
+static PyMethodDef tracer_methods[] = {
+	{ "exp", tracer_exp, METH_NOARGS, NULL},
+	{ "log", tracer_log, METH_NOARGS, NULL},
+	{ "log10", tracer_log10, METH_NOARGS, NULL},
+	{ "sqrt", tracer_sqrt, METH_NOARGS, NULL},
+	{ "square", tracer_square, METH_NOARGS, NULL},
+	{ "sin", tracer_sin, METH_NOARGS, NULL},
+	{ "cos", tracer_cos, METH_NOARGS, NULL},
+	{ "tan", tracer_tan, METH_NOARGS, NULL},
+	{ "arcsin", tracer_arcsin, METH_NOARGS, NULL},
+	{ "arccos", tracer_arccos, METH_NOARGS, NULL},
+	{ "arctan", tracer_arctan, METH_NOARGS, NULL},
+	{ "sinh", tracer_sinh, METH_NOARGS, NULL},
+	{ "cosh", tracer_cosh, METH_NOARGS, NULL},
+	{ "tanh", tracer_tanh, METH_NOARGS, NULL},
+	{ "arcsinh", tracer_arcsinh, METH_NOARGS, NULL},
+	{ "arccosh", tracer_arccosh, METH_NOARGS, NULL},
+	{ "arctanh", tracer_arctanh, METH_NOARGS, NULL},
+	{NULL, NULL},
+};
+
+static PyNumberMethods tracer_as_number = {
+	tracer_add,		/*nb_add*/
+	tracer_subtract,	/*nb_subtract*/
+	tracer_multiply,	/*nb_multiply*/
+	tracer_divide,		/*nb_divide*/
+	0,			/*nb_remainder*/
+	0,			/*nb_divmod*/
+	tracer_power,		/*nb_power*/
+	tracer_negative,	/*nb_negative*/
+	tracer_positive,	/*nb_positive*/
+	tracer_absolute,	/*nb_absolute*/
+	tracer_nonzero,		/*nb_nonzero*/
+	0,			/*nb_invert*/
+	0,			/*nb_lshift*/
+	0,			/*nb_rshift*/
+	0,			/*nb_and*/
+	0,			/*nb_xor*/
+	0,			/*nb_or*/
+	0,			/*nb_coerce*/
+	tracer_float,		/*nb_int*/
+	tracer_float,		/*nb_long*/
+	tracer_float,		/*nb_float*/
+	0,			/*nb_oct*/
+	0,			/*nb_hex*/
+	0,			/*nb_inplace_add*/
+	0,			/*nb_inplace_subtract*/
+	0,			/*nb_inplace_multiply*/
+	0,			/*nb_inplace_divide*/
+	0,			/*nb_inplace_remainder*/
+	0,			/*nb_inplace_power*/
+	0,			/*nb_inplace_lshift*/
+	0,			/*nb_inplace_rshift*/
+	0,			/*nb_inplace_and*/
+	0,			/*nb_inplace_xor*/
+	0,			/*nb_inplace_or*/
+	0,			/*nb_floor_divide*/
+	tracer_divide,		/*nb_true_divide*/
+};
+
+static PyTypeObject TracerType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "pyipopt.Tracer",          /*tp_name*/
+    sizeof(Tracer),            /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    tracer_dealloc,            /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    &tracer_as_number,         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_CHECKTYPES, /*tp_flags*/
+    "An expression of x being traced by pyipopt.trace", /* tp_doc */
+    0,                         /*tp_traverse*/
+    0,                         /*tp_clear*/
+    tracer_richcompare,        /*tp_richcompare*/
+    0,                         /*tp_weaklistoffset*/
+    0,                         /*tp_iter*/
+    0,                         /*tp_iternext*/
+    tracer_methods,            /*tp_methods*/
+};
+
+int init_tracer(void)
+{
+	return PyType_Ready(&TracerType);
+}
+
+/* Writer section */
+
+typedef struct {
+	char *p;
+	size_t len, cap;
+	int failed;
+} Text;
+
+#ifdef __GNUC__
+__attribute__ ((format (printf, 2, 3)))
+#endif
+static void put(Text *t, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+	if (t->failed) return;
+	for (;;)
+	{
+		va_start(ap, fmt);
+		len = vsnprintf(t->p + t->len, t->cap - t->len, fmt, ap);
+		va_end(ap);
+		if (len >= 0 && t->len + len < t->cap) break;
+		t->cap = t->cap ? 2 * t->cap : 65536;
+		if (!(t->p = (char*) realloc(t->p, t->cap)))
+		{
+			t->failed = 1;
+			return;
+		}
+	}
+	t->len += len;
+}
+
+typedef struct {
+	int *v;
+	int len, cap;
+} IntList;
+
+static int push(IntList *l, int v)
+{
+	if (l->len == l->cap)
+	{
+		int cap = l->cap ? 2 * l->cap : 64;
+		int *p = (int*) realloc(l->v, sizeof(int) * cap);
+		if (!p) return FALSE;
+		l->v = p;
+		l->cap = cap;
+	}
+	l->v[l->len++] = v;
+	return TRUE;
+}
+
+typedef struct {
+	const NLNode *nodes;
+	int nnodes, n;
+	int *def;		/* defined variable of a node, or -1 */
+	int ndef;
+	int *stamp, *vstamp, generation;
+	/* the variables each defined variable depends on */
+	int *def_start;
+	IntList defvars;
+	IntList stack, sum;
+} Writer;
+
+static int compare_ints(const void *a, const void *b)
+{
+	return *(const int*) a - *(const int*) b;
+}
+
+/* Append the variables expression top depends on to out, sorted */
+static int collect_vars(Writer *w, int top, IntList *out)
+{
+	int first = out->len, i, k, d;
+	const NLNode *node;
+
+	w->generation++;
+	w->stack.len = 0;
+	if (!push(&w->stack, top)) return FALSE;
+	while (w->stack.len > 0)
+	{
+		i = w->stack.v[--w->stack.len];
+		if (w->stamp[i] == w->generation) continue;
+		w->stamp[i] = w->generation;
+		node = &w->nodes[i];
+		if (i != top && w->def[i] >= 0)
+		{
+			d = w->def[i];
+			for (k = w->def_start[d]; k < w->def_start[d+1]; k++)
+			{
+				int v = w->defvars.v[k];
+				if (w->vstamp[v] == w->generation) continue;
+				w->vstamp[v] = w->generation;
+				if (!push(out, v)) return FALSE;
+			}
+			continue;
+		}
+		switch (node->op == NL_VAR ? 3 : nl_arity(node->op))
+		{
+		case 3:
+			if (w->vstamp[node->a] == w->generation) break;
+			w->vstamp[node->a] = w->generation;
+			if (!push(out, node->a)) return FALSE;
+			break;
+		case 2:
+			if (!push(&w->stack, node->b)) return FALSE;
+			/* fall through */
+		case 1:
+			if (!push(&w->stack, node->a)) return FALSE;
+			break;
+		}
+	}
+	qsort(out->v + first, out->len - first, sizeof(int), compare_ints);
+	return TRUE;
+}
+
+/* The operands of the sum at node i, with the sums nested in it that are
+   written inline flattened into it, left to right */
+static int sum_operands(Writer *w, int i)
+{
+	IntList pending = {NULL, 0, 0};
+	int j, ok = TRUE;
+	w->sum.len = 0;
+	ok = push(&pending, w->nodes[i].b) && push(&pending, w->nodes[i].a);
+	while (ok && pending.len > 0)
+	{
+		j = pending.v[--pending.len];
+		if (w->nodes[j].op == OP_PLUS && w->def[j] < 0)
+			ok = push(&pending, w->nodes[j].b) &&
+				push(&pending, w->nodes[j].a);
+		else
+			ok = push(&w->sum, j);
+	}
+	free(pending.v);
+	return ok;
+}
+
+/* Expression top in prefix order. A defined variable is written as a
+   reference unless it is the top of its own V segment */
+static int write_expr(Writer *w, Text *t, int top, int own)
+{
+	int i, k;
+	const NLNode *node;
+
+	w->stack.len = 0;
+	if (!push(&w->stack, top)) return FALSE;
+	while (w->stack.len > 0)
+	{
+		i = w->stack.v[--w->stack.len];
+		node = &w->nodes[i];
+		if (w->def[i] >= 0 && !(own && i == top))
+		{
+			put(t, "v%d\n", w->n + w->def[i]);
+			continue;
+		}
+		if (node->op == NL_NUM)
+		{
+			put(t, "n%.17g\n", node->c);
+			continue;
+		}
+		if (node->op == NL_VAR)
+		{
+			put(t, "v%d\n", node->a);
+			continue;
+		}
+		if (node->op == OP_PLUS)
+		{
+			if (!sum_operands(w, i)) return FALSE;
+			if (w->sum.len > 2)
+			{
+				put(t, "o%d\n%d\n", OP_SUM, w->sum.len);
+				for (k = w->sum.len - 1; k >= 0; k--)
+					if (!push(&w->stack, w->sum.v[k]))
+						return FALSE;
+				continue;
+			}
+		}
+		put(t, "o%d\n", node->op);
+		if (nl_arity(node->op) == 2 && !push(&w->stack, node->b))
+			return FALSE;
+		if (!push(&w->stack, node->a)) return FALSE;
+	}
+	return !t->failed;
+}
+
+/* The .nl text for objective roots[m] and constraints roots[0..m-1].
+   All of it is nonlinear; the J and G segments only give the structure,
+   with zero coefficients. Returns NULL when out of memory. */
+static char *write_nl(const Tape *tape, int n, int m, const int *roots,
+		      size_t *size)
+{
+	Writer w;
+	Text t = {NULL, 0, 0, 0};
+	IntList vars = {NULL, 0, 0};
+	int *ref = NULL, *depth = NULL, *out_start = NULL;
+	int i, k, d, c, ok = FALSE;
+	const NLNode *node;
+
+	memset(&w, 0, sizeof(Writer));
+	w.nodes = tape->nodes;
+	w.nnodes = tape->nnodes;
+	w.n = n;
+	ref = (int*) calloc(w.nnodes + 1, sizeof(int));
+	depth = (int*) calloc(w.nnodes + 1, sizeof(int));
+	w.def = (int*) calloc(w.nnodes + 1, sizeof(int));
+	w.stamp = (int*) calloc(w.nnodes + 1, sizeof(int));
+	w.vstamp = (int*) calloc(n + 1, sizeof(int));
+	w.def_start = (int*) calloc(w.nnodes + 2, sizeof(int));
+	out_start = (int*) calloc(m + 2, sizeof(int));
+	if (!ref || !depth || !w.def || !w.stamp || !w.vstamp ||
+	    !w.def_start || !out_start)
+		goto done;
+
+	/* the tape is in evaluation order, so operands come first */
+	for (i = 0; i < w.nnodes; i++)
+	{
+		node = &w.nodes[i];
+		switch (nl_arity(node->op))
+		{
+		case 2: ref[node->b]++; /* fall through */
+		case 1: ref[node->a]++;
+		}
+	}
+	for (k = 0; k <= m; k++)
+		ref[roots[k]]++;
+	for (i = 0; i < w.nnodes; i++)
+	{
+		node = &w.nodes[i];
+		w.def[i] = -1;
+		if (node->op == NL_NUM || node->op == NL_VAR) continue;
+		d = 0;
+		for (k = 0; k < nl_arity(node->op); k++)
+		{
+			c = k ? node->b : node->a;
+			if (w.def[c] >= 0) continue;
+			/* a sum in a sum is written as one */
+			if (node->op == OP_PLUS && w.nodes[c].op == OP_PLUS)
+				d = depth[c] - 1 > d ? depth[c] - 1 : d;
+			else
+				d = depth[c] > d ? depth[c] : d;
+		}
+		depth[i] = d + 1;
+		if (ref[i] > 1 || depth[i] > TRACE_MAX_DEPTH)
+		{
+			w.def[i] = w.ndef;
+			if (!collect_vars(&w, i, &w.defvars)) goto done;
+			w.def_start[++w.ndef] = w.defvars.len;
+		}
+	}
+	for (k = 0; k <= m; k++)
+	{
+		if (!collect_vars(&w, roots[k], &vars)) goto done;
+		out_start[k+1] = vars.len;
+	}
+
+	put(&t, "g3 1 1 0\t# traced by pyipopt\n");
+	put(&t, " %d %d 1 0 0\n", n, m);
+	put(&t, " %d 1\n", m);
+	put(&t, " 0 0\n");
+	put(&t, " %d %d %d\n", n, n, n);
+	put(&t, " 0 0 0 1\n");
+	put(&t, " 0 0 0 0 0\n");
+	put(&t, " %d %d\n", out_start[m], vars.len - out_start[m]);
+	put(&t, " 0 0\n");
+	put(&t, " 0 %d 0 0 0\n", w.ndef);
+	for (i = 0; i < w.nnodes; i++)
+	{
+		if (w.def[i] < 0) continue;
+		put(&t, "V%d 0 0\n", n + w.def[i]);
+		if (!write_expr(&w, &t, i, TRUE)) goto done;
+	}
+	for (k = 0; k < m; k++)
+	{
+		put(&t, "C%d\n", k);
+		if (!write_expr(&w, &t, roots[k], FALSE)) goto done;
+	}
+	put(&t, "O0 0\n");
+	if (!write_expr(&w, &t, roots[m], FALSE)) goto done;
+	for (k = 0; k <= m; k++)
+	{
+		if (k < m)
+			put(&t, "J%d %d\n", k, out_start[k+1] - out_start[k]);
+		else
+			put(&t, "G0 %d\n", out_start[k+1] - out_start[k]);
+		for (i = out_start[k]; i < out_start[k+1]; i++)
+			put(&t, "%d 0\n", vars.v[i]);
+	}
+	ok = !t.failed;
+done:
+	free(ref);
+	free(depth);
+	free(w.def);
+	free(w.stamp);
+	free(w.vstamp);
+	free(w.def_start);
+	free(w.defvars.v);
+	free(w.stack.v);
+	free(w.sum.v);
+	free(out_start);
+	free(vars.v);
+	if (!ok)
+	{
+		free(t.p);
+		return NULL;
+	}
+	*size = t.len;
+	return t.p;
+}
+
+/* Python section */
+
+/* The node of something eval_f or eval_g returned: a Tracer of this
+   tape or a constant. -1 with an exception set for anything else. */
+static int result_node(PyObject *capsule, PyObject *o, const char *who)
+{
+	int node = -1, kind;
+	double c = 0.;
+	kind = operand(capsule, o, &node, &c);
+	if (kind == 2)
+		node = record(capsule, NL_NUM, 0, 0, c);
+	else if (kind == 0)
+	{
+		PyErr_Format(PyExc_TypeError, 
+			     "%s must return expressions of x or numbers", who);
+		node = -1;
+	}
+	return node;
+}
+
+static void free_model(PyObject *capsule)
+{
+	nl_free((NLModel*) PyCapsule_GetPointer(capsule, "pyipopt.NLModel"));
+}
+
+static int set_capsule(PyObject *dict, const char *key, void *p,
+		       const char *name, PyCapsule_Destructor destructor)
+{
+	PyObject *capsule = PyCapsule_New(p, name, destructor);
+	int rc;
+	if (!capsule) return -1;
+	rc = PyDict_SetItemString(dict, key, capsule);
+	Py_DECREF(capsule);
+	return rc;
+}
+
+static int set_int(PyObject *dict, const char *key, long v)
+{
+	PyObject *o = PyInt_FromLong(v);
+	int rc;
+	if (!o) return -1;
+	rc = PyDict_SetItemString(dict, key, o);
+	Py_DECREF(o);
+	return rc;
+}
+
+PyObject *trace_model(PyObject *self, PyObject *args, PyObject *keywds)
+{
+	PyObject *f, *g = Py_None;
+	PyObject *capsule = NULL, *xs = NULL, *x = NULL;
+	PyObject *fval = NULL, *gval = NULL, *gseq = NULL, *result = NULL;
+	PyObject *owner = NULL;
+	Tape *tape;
+	NLModel *model = NULL;
+	int n, m = 0, i, *roots = NULL;
+	char *text = NULL, err[512];
+	size_t size = 0;
+
+	static char *kwlist[] = {"eval_f", "eval_g", "n", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "OOi:trace", kwlist,
+					 &f, &g, &n))
+		return NULL;
+	if (!PyCallable_Check(f) || (g != Py_None && !PyCallable_Check(g)))
+	{
+		PyErr_SetString(PyExc_TypeError, 
+				"Need a callable object for function!");
+		return NULL;
+	}
+	if (n <= 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "n must be positive");
+		return NULL;
+	}
+
+	if (!(tape = (Tape*) calloc(1, sizeof(Tape)))) 
+		return PyErr_NoMemory();
+	capsule = PyCapsule_New(tape, "pyipopt.Tape", free_tape);
+	if (!capsule)
+	{
+		free(tape);
+		return NULL;
+	}
+
+	/* x is an object array, so slicing and whole array arithmetic
+	   work on it the way they do on a float one */
+	if (!(xs = PyList_New(n))) goto error;
+	for (i = 0; i < n; i++)
+	{
+		PyObject *t = new_tracer(capsule, 
+					 record(capsule, NL_VAR, i, 0, 0.));
+		if (!t) goto error;
+		PyList_SET_ITEM(xs, i, t);
+	}
+	x = PyArray_FROMANY(xs, NPY_OBJECT, 1, 1, NPY_DEFAULT);
+	if (!x) goto error;
+
+	if (!(fval = PyObject_CallFunctionObjArgs(f, x, NULL))) goto error;
+	if (g != Py_None)
+	{
+		if (!(gval = PyObject_CallFunctionObjArgs(g, x, NULL))) 
+			goto error;
+		gseq = PySequence_Fast(gval, "eval_g must return a sequence");
+		if (!gseq) goto error;
+		m = PySequence_Fast_GET_SIZE(gseq);
+	}
+	if (!(roots = (int*) malloc(sizeof(int) * (m + 1))))
+	{
+		PyErr_NoMemory();
+		goto error;
+	}
+	for (i = 0; i < m; i++)
+		if ((roots[i] = result_node(capsule, 
+					    PySequence_Fast_GET_ITEM(gseq, i),
+					    "eval_g")) < 0)
+			goto error;
+	if ((roots[m] = result_node(capsule, fval, "eval_f")) < 0) goto error;
+
+	tape = get_tape(capsule);
+	Py_BEGIN_ALLOW_THREADS
+	text = write_nl(tape, n, m, roots, &size);
+	if (text)
+		model = nl_parse(text, size, err, sizeof(err));
+	Py_END_ALLOW_THREADS
+	if (!text)
+	{
+		PyErr_NoMemory();
+		goto error;
+	}
+	if (!model)
+	{
+		PyErr_Format(PyExc_RuntimeError, "traced model: %s", err);
+		goto error;
+	}
+
+	if (!(result = PyDict_New())) goto error;
+	if (set_int(result, "n", n) || set_int(result, "m", m) ||
+	    set_int(result, "nnzj", model->nnzj) ||
+	    set_int(result, "nnzh", model->nnzh) ||
+	    set_int(result, "nodes", get_tape(capsule)->nnodes) ||
+	    set_capsule(result, "eval_f", (void*) &nl_eval_f, NULL, NULL) ||
+	    set_capsule(result, "eval_grad_f", (void*) &nl_eval_grad_f, 
+			NULL, NULL) ||
+	    set_capsule(result, "eval_g", (void*) &nl_eval_g, NULL, NULL) ||
+	    set_capsule(result, "eval_jac_g", (void*) &nl_eval_jac_g, 
+			NULL, NULL) ||
+	    set_capsule(result, "eval_h", (void*) &nl_eval_h, NULL, NULL))
+		goto error;
+	if (!(owner = PyCapsule_New(model, "pyipopt.NLModel", free_model)))
+		goto error;
+	model = NULL;		/* the capsule has it now */
+	if (PyDict_SetItemString(result, "user_data", owner)) goto error;
+	goto done;
+error:
+	Py_CLEAR(result);
+done:
+	nl_free(model);
+	free(text);
+	free(roots);
+	Py_XDECREF(owner);
+	Py_XDECREF(gseq);
+	Py_XDECREF(gval);
+	Py_XDECREF(fval);
+	Py_XDECREF(x);
+	Py_XDECREF(xs);
+	Py_XDECREF(capsule);
+	return result;
+}